@@ -0,0 +1,186 @@
+// Benchmarks the module through its JS interface: encodeSync for every
+// buffer type, push-data replays on both stacks, and sync encodes against
+// async ones with 1..8 in flight. Prints JSON in the same shape as the
+// native jpeg_bench, so bench/compare.js can diff two runs.
+//
+//   node bench/bench.js [--quick] [--filter substring] > run.json
+
+var JpegLib = require('../build/Release/jpeg');
+var fs = require('fs');
+var path = require('path');
+var Buffer = require('buffer').Buffer;
+
+var quick = process.argv.indexOf('--quick') >= 0;
+var filterAt = process.argv.indexOf('--filter');
+var filter = filterAt >= 0 ? process.argv[filterAt + 1] : null;
+
+var pushDir = path.join(__dirname, '../examples/push-data');
+var results = [];
+var peakRss = 0;
+
+function now() {
+    var t = process.hrtime();
+    return t[0]*1e3 + t[1]/1e6;
+}
+
+function sampleRss() {
+    var rss = process.memoryUsage().rss;
+    if (rss > peakRss) peakRss = rss;
+}
+
+function wanted(name) {
+    return !filter || name.indexOf(filter) >= 0;
+}
+
+function percentile(sorted, p) {
+    var i = Math.min(sorted.length - 1, Math.floor(p/100*sorted.length));
+    return sorted[i];
+}
+
+function record(name, ms, totalMs, pixels, bytesOut) {
+    var sorted = ms.slice().sort(function (a, b) { return a - b; });
+    var secs = totalMs/1000;
+    results.push({
+        name: name,
+        iterations: ms.length,
+        ops_per_s: +(ms.length/secs).toFixed(2),
+        mpix_per_s: +(ms.length*pixels/1e6/secs).toFixed(2),
+        bytes_out: bytesOut,
+        p50_ms: +percentile(sorted, 50).toFixed(3),
+        p90_ms: +percentile(sorted, 90).toFixed(3),
+        p99_ms: +percentile(sorted, 99).toFixed(3),
+        max_ms: +sorted[sorted.length - 1].toFixed(3)
+    });
+}
+
+// Calls fn (which returns the encoded size) until it has run 5 times and
+// for at least minMs, after one warm-up call.
+function runSync(name, pixels, fn) {
+    if (!wanted(name)) return;
+    var minMs = quick ? 50 : 300;
+    var ms = [], bytesOut = fn();
+    var start = now();
+    while (ms.length < 1000 && (ms.length < 5 || now() - start < minMs)) {
+        var t = now();
+        bytesOut = fn();
+        ms.push(now() - t);
+        sampleRss();
+    }
+    record(name, ms, now() - start, pixels, bytesOut);
+}
+
+function bytesPerImage(type, w, h) {
+    switch (type) {
+    case 'rgb': case 'bgr': return w*h*3;
+    case 'rgb565': return w*h*2;
+    case 'yuv420': case 'nv12': return w*h + 2*Math.ceil(w/2)*Math.ceil(h/2);
+    default: return w*h*4;
+    }
+}
+
+// Gradients with a little noise, like jpeg_bench's images.
+function makeImage(type, w, h) {
+    var buf = new Buffer(bytesPerImage(type, w, h));
+    var seed = 1;
+    for (var i = 0; i < buf.length; i++) {
+        seed = (seed*1103515245 + 12345) & 0x7fffffff;
+        buf[i] = ((i % (w*4))*255/(8*w) + Math.floor(i/(w*4))*127/h + ((seed >> 16) & 7)) & 0xff;
+    }
+    return buf;
+}
+
+function rectDim(fileName) {
+    var m = fileName.match(/^\d+-rgba-(\d+)-(\d+)-(\d+)-(\d+).dat$/);
+    var dim = [m[1], m[2], m[3], m[4]].map(function (n) {
+        return parseInt(n, 10);
+    });
+    return { x: dim[0], y: dim[1], w: dim[2], h: dim[3] }
+}
+
+function benchEncode() {
+    var types = ['rgb', 'bgr', 'rgba', 'bgra', 'rgbx', 'bgrx', 'xrgb', 'argb',
+        'rgb565', 'yuv420', 'nv12'];
+    var sizes = [[16, 16], [128, 128], [720, 400], [1920, 1080]];
+    if (!quick) sizes.push([3840, 2160], [7680, 4320]);
+
+    types.forEach(function (type) {
+        sizes.forEach(function (size) {
+            var w = size[0], h = size[1];
+            var name = 'js-encode/' + type + '/' + w + 'x' + h + '/q80';
+            if (!wanted(name)) return;
+            var image = makeImage(type, w, h);
+            runSync(name, w*h, function () {
+                return new JpegLib.Jpeg(image, w, h, 80, type).encodeSync().length;
+            });
+        });
+    });
+}
+
+function benchStacks() {
+    var fragments = fs.readdirSync(pushDir).sort().map(function (file) {
+        var dim = rectDim(file);
+        dim.rgba = fs.readFileSync(path.join(pushDir, file));
+        return dim;
+    });
+    var terminal = fs.readFileSync(path.join(pushDir, '../rgba-terminal.dat'));
+
+    runSync('js-fixed-stack/push-data', 720*400, function () {
+        var stack = new JpegLib.FixedJpegStack(720, 400, 'rgba');
+        fragments.forEach(function (f) { stack.push(f.rgba, f.x, f.y, f.w, f.h); });
+        return stack.encodeSync().length;
+    });
+    runSync('js-dynamic-stack/push-data', 720*400, function () {
+        var stack = new JpegLib.DynamicJpegStack('rgba');
+        stack.setBackground(terminal, 720, 400);
+        fragments.forEach(function (f) { stack.push(f.rgba, f.x, f.y, f.w, f.h); });
+        return stack.encodeSync().length;
+    });
+}
+
+// total async encodes with at most inFlight outstanding at a time.
+function benchAsync(inFlight, done) {
+    var name = 'js-async/rgba/1920x1080/q80/c' + inFlight;
+    if (!wanted(name)) return done();
+
+    var image = makeImage('rgba', 1920, 1080);
+    var total = quick ? 8 : 40;
+    var started = 0, finished = 0, ms = [], bytesOut = 0;
+    var start = now();
+
+    function next() {
+        var t = now();
+        started++;
+        new JpegLib.Jpeg(image, 1920, 1080, 80, 'rgba').encode(function (jpeg, error) {
+            if (error) throw error;
+            ms.push(now() - t);
+            bytesOut = jpeg.length;
+            sampleRss();
+            if (++finished == total) {
+                record(name, ms, now() - start, 1920*1080, bytesOut);
+                return done();
+            }
+            if (started < total) next();
+        });
+    }
+    for (var i = 0; i < inFlight && i < total; i++) next();
+}
+
+function print() {
+    var lines = results.map(function (r) { return '    ' + JSON.stringify(r); });
+    process.stdout.write('{\n  "tool": "bench.js",\n  "cases": [\n' + lines.join(',\n') +
+        '\n  ],\n  "peak_rss_kb": ' + Math.round(peakRss/1024) + '\n}\n');
+}
+
+benchEncode();
+benchStacks();
+
+var image = makeImage('rgba', 1920, 1080);
+runSync('js-sync/rgba/1920x1080/q80', 1920*1080, function () {
+    return new JpegLib.Jpeg(image, 1920, 1080, 80, 'rgba').encodeSync().length;
+});
+
+var concurrency = [1, 2, 4, 8];
+(function nextConcurrency() {
+    if (!concurrency.length) return print();
+    benchAsync(concurrency.shift(), nextConcurrency);
+})();
@@ -0,0 +1,90 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+// Helpers shared by the native benchmark tools: timing, percentiles,
+// peak RSS and the JSON lines they print.
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+
+#include "encode_stats.h"
+
+static inline double
+elapsed_ms(uint64_t start)
+{
+    return (stats_clock() - start)/1e6;
+}
+
+// Nearest-rank percentile of sorted latencies.
+static inline double
+percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty()) return 0;
+    size_t i = (size_t)(p/100*sorted.size());
+    if (i >= sorted.size()) i = sorted.size() - 1;
+    return sorted[i];
+}
+
+static inline long
+peak_rss_kb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Latencies of one benchmark case and what it produced.
+struct BenchResult {
+    std::string name;
+    std::vector<double> ms;
+    double total_ms;      // wall time, less than the sum of ms when threaded
+    double pixels;        // per iteration
+    double bytes_out;     // per iteration
+
+    BenchResult(const std::string &nname) : name(nname), total_ms(0), pixels(0), bytes_out(0) {}
+
+    void print(FILE *out, bool last) {
+        std::sort(ms.begin(), ms.end());
+        double secs = total_ms/1000;
+        fprintf(out, "    {\"name\": \"%s\", \"iterations\": %lu, \"ops_per_s\": %.2f, "
+            "\"mpix_per_s\": %.2f, \"bytes_out\": %.0f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, "
+            "\"p99_ms\": %.3f, \"max_ms\": %.3f}%s\n",
+            name.c_str(), (unsigned long)ms.size(), ms.size()/secs,
+            ms.size()*pixels/1e6/secs, bytes_out, percentile(ms, 50), percentile(ms, 90),
+            percentile(ms, 99), ms.empty() ? 0 : ms.back(), last ? "" : ",");
+    }
+};
+
+// Runs fn until it has been called at least min_iters times and min_ms
+// has passed (but no more than max_iters times), after one warm-up call.
+// fn returns the bytes it produced.
+template <class Fn>
+static void
+run_case(BenchResult &result, Fn &fn, int min_iters, double min_ms, int max_iters = 1000)
+{
+    fn();
+    uint64_t start = stats_clock();
+    while ((int)result.ms.size() < max_iters &&
+        ((int)result.ms.size() < min_iters || elapsed_ms(start) < min_ms))
+    {
+        uint64_t t = stats_clock();
+        result.bytes_out = fn();
+        result.ms.push_back(elapsed_ms(t));
+    }
+    result.total_ms = elapsed_ms(start);
+}
+
+static inline void
+print_results(FILE *out, const char *tool, std::vector<BenchResult> &results)
+{
+    fprintf(out, "{\n  \"tool\": \"%s\",\n  \"cases\": [\n", tool);
+    for (size_t i = 0; i < results.size(); i++)
+        results[i].print(out, i == results.size() - 1);
+    fprintf(out, "  ],\n  \"peak_rss_kb\": %ld\n}\n", peak_rss_kb());
+}
+
+#endif
+
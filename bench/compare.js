@@ -0,0 +1,60 @@
+// Compares two runs of jpeg_bench or bench.js and exits with status 1 if
+// any case got slower than the threshold (10% by default).
+//
+//   node bench/compare.js base.json new.json [--threshold 10]
+
+var fs = require('fs');
+
+var args = process.argv.slice(2);
+var thresholdAt = args.indexOf('--threshold');
+var threshold = 10;
+if (thresholdAt >= 0) {
+    threshold = parseFloat(args[thresholdAt + 1]);
+    args.splice(thresholdAt, 2);
+}
+if (args.length != 2) {
+    console.error('usage: node compare.js base.json new.json [--threshold percent]');
+    process.exit(2);
+}
+
+var base = JSON.parse(fs.readFileSync(args[0], 'utf8'));
+var head = JSON.parse(fs.readFileSync(args[1], 'utf8'));
+
+var baseCases = {};
+base.cases.forEach(function (c) { baseCases[c.name] = c; });
+
+function change(before, after) {
+    return before ? (after - before)/before*100 : 0;
+}
+
+function pad(s, n) {
+    s = String(s);
+    while (s.length < n) s += ' ';
+    return s;
+}
+
+var regressions = 0;
+head.cases.forEach(function (c) {
+    var b = baseCases[c.name];
+    if (!b) {
+        console.log(pad(c.name, 44) + ' new');
+        return;
+    }
+    // throughput going down or p50 latency going up both count
+    var ops = change(b.ops_per_s, c.ops_per_s);
+    var p50 = change(b.p50_ms, c.p50_ms);
+    var size = change(b.bytes_out, c.bytes_out);
+    var slower = -ops > threshold || p50 > threshold;
+    if (slower) regressions++;
+    console.log(pad(c.name, 44) +
+        ' ops/s ' + pad((ops >= 0 ? '+' : '') + ops.toFixed(1) + '%', 8) +
+        ' p50 ' + pad((p50 >= 0 ? '+' : '') + p50.toFixed(1) + '%', 8) +
+        (size ? ' size ' + (size >= 0 ? '+' : '') + size.toFixed(1) + '%' : '') +
+        (slower ? '  REGRESSION' : ''));
+});
+
+console.log('peak rss ' + base.peak_rss_kb + ' kB -> ' + head.peak_rss_kb + ' kB');
+if (regressions) {
+    console.log(regressions + ' case(s) slower by more than ' + threshold + '%');
+    process.exit(1);
+}
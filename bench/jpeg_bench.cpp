@@ -0,0 +1,286 @@
+// Native benchmark of the encoder and the canvas the stacks are built on,
+// without node in the way. Prints JSON (one case per line so that two runs
+// diff well, see bench/compare.js).
+//
+//   jpeg_bench [--quick] [--filter substring] [--push-data dir]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <dirent.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "jpeg_encoder.h"
+#include "tiled_canvas.h"
+#include "bench_util.h"
+
+static const buffer_type all_types[] = {
+    BUF_RGB, BUF_BGR, BUF_RGBA, BUF_BGRA, BUF_RGBX, BUF_BGRX, BUF_XRGB, BUF_ARGB,
+    BUF_RGB565, BUF_YUV420, BUF_NV12
+};
+static const char *type_names[] = {
+    "rgb", "bgr", "rgba", "bgra", "rgbx", "bgrx", "xrgb", "argb",
+    "rgb565", "yuv420", "nv12"
+};
+
+static bool quick = false;
+static const char *filter = NULL;
+static std::vector<BenchResult> results;
+
+static bool
+wanted(const std::string &name)
+{
+    return !filter || name.find(filter) != std::string::npos;
+}
+
+static std::string
+case_name(const char *kind, const char *type, int w, int h, int q)
+{
+    char name[128];
+    snprintf(name, sizeof(name), "%s/%s/%dx%d/q%d", kind, type, w, h, q);
+    return name;
+}
+
+// Gradients with a little noise, so that the entropy coder has something
+// like real content to chew on.
+static std::vector<unsigned char>
+make_image(int w, int h, buffer_type buf_type)
+{
+    std::vector<unsigned char> buf(image_span(w, h, buf_type, 0));
+    unsigned int seed = 1;
+    int channels = is_planar(buf_type) ? 1 : bytes_per_pixel(buf_type);
+    int plane_w = is_planar(buf_type) ? w : w*channels;
+
+    for (size_t i = 0; i < buf.size(); i++) {
+        int x = (int)(i%plane_w)/channels, y = (int)(i/plane_w)%h;
+        int c = (int)(i%plane_w)%channels;
+        seed = seed*1103515245 + 12345;
+        buf[i] = (unsigned char)((x + c*w/3)*255/(2*w) + y*127/h + ((seed >> 16) & 7));
+    }
+    return buf;
+}
+
+struct EncodeCase {
+    std::vector<unsigned char> image;
+    int w, h, quality;
+    buffer_type buf_type;
+
+    double operator()() {
+        JpegEncoder encoder(&image[0], w, h, quality, buf_type);
+        encoder.encode();
+        return encoder.get_jpeg_len();
+    }
+};
+
+static void
+bench_encode(const char *kind, buffer_type buf_type, const char *type, int w, int h, int quality)
+{
+    std::string name = case_name(kind, type, w, h, quality);
+    if (!wanted(name)) return;
+
+    EncodeCase fn;
+    fn.image = make_image(w, h, buf_type);
+    fn.w = w; fn.h = h; fn.quality = quality; fn.buf_type = buf_type;
+
+    BenchResult result(name);
+    result.pixels = (double)w*h;
+    run_case(result, fn, 5, quick ? 50 : 300);
+    results.push_back(result);
+}
+
+struct Fragment {
+    int x, y, w, h;
+    std::vector<unsigned char> rgba;
+};
+
+static std::vector<unsigned char>
+read_file(const std::string &path)
+{
+    std::vector<unsigned char> data;
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) return data;
+    unsigned char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        data.insert(data.end(), buf, buf + n);
+    fclose(f);
+    return data;
+}
+
+// The files in examples/push-data are named NN-rgba-x-y-w-h.dat.
+static std::vector<Fragment>
+read_push_data(const std::string &dir)
+{
+    std::vector<std::string> names;
+    DIR *d = opendir(dir.c_str());
+    if (d) {
+        struct dirent *ent;
+        while ((ent = readdir(d)))
+            if (strstr(ent->d_name, ".dat")) names.push_back(ent->d_name);
+        closedir(d);
+    }
+    std::sort(names.begin(), names.end());
+
+    std::vector<Fragment> fragments;
+    for (size_t i = 0; i < names.size(); i++) {
+        Fragment frag;
+        if (sscanf(names[i].c_str(), "%*d-rgba-%d-%d-%d-%d.dat",
+                &frag.x, &frag.y, &frag.w, &frag.h) != 4)
+            continue;
+        frag.rgba = read_file(dir + "/" + names[i]);
+        if (frag.rgba.size() < (size_t)frag.w*frag.h*4) continue;
+        fragments.push_back(frag);
+    }
+    return fragments;
+}
+
+// Pushes every fragment onto a 720x400 canvas (over the terminal screenshot
+// when there is one) and encodes either all of it, like FixedJpegStack, or
+// just the pushed area, like DynamicJpegStack.
+struct StackCase {
+    const std::vector<Fragment> *fragments;
+    const std::vector<unsigned char> *background;
+    bool dynamic;
+
+    double operator()() {
+        TiledCanvas canvas(720, 400);
+        if (!background->empty())
+            canvas.push(&(*background)[0], BUF_RGBA, 0, 0, 720, 400);
+
+        int x1 = 720, y1 = 400, x2 = 0, y2 = 0;
+        for (size_t i = 0; i < fragments->size(); i++) {
+            const Fragment &f = (*fragments)[i];
+            canvas.push(&f.rgba[0], BUF_RGBA, f.x, f.y, f.w, f.h);
+            x1 = std::min(x1, f.x); y1 = std::min(y1, f.y);
+            x2 = std::max(x2, f.x + f.w); y2 = std::max(y2, f.y + f.h);
+        }
+
+        CanvasRowSource rows(canvas);
+        JpegEncoder encoder(&rows, 720, 400, 60);
+        if (dynamic) encoder.setRect(Rect(x1, y1, x2 - x1, y2 - y1));
+        encoder.encode();
+        return encoder.get_jpeg_len();
+    }
+};
+
+static void
+bench_stacks(const std::string &push_data)
+{
+    std::vector<Fragment> fragments = read_push_data(push_data);
+    if (fragments.empty()) {
+        fprintf(stderr, "jpeg_bench: no push data in %s, skipping stack cases\n", push_data.c_str());
+        return;
+    }
+    std::vector<unsigned char> background = read_file(push_data + "/../rgba-terminal.dat");
+    if (background.size() != 720*400*4) background.clear();
+
+    const char *names[2] = { "fixed-stack/push-data", "dynamic-stack/push-data" };
+    for (int i = 0; i < 2; i++) {
+        if (!wanted(names[i])) continue;
+        StackCase fn;
+        fn.fragments = &fragments;
+        fn.background = &background;
+        fn.dynamic = i == 1;
+
+        BenchResult result(names[i]);
+        result.pixels = 720*400;
+        run_case(result, fn, 20, quick ? 50 : 300);
+        results.push_back(result);
+    }
+}
+
+struct ThreadArgs {
+    EncodeCase *fn;
+    int iters;
+    std::vector<double> ms;
+};
+
+static void *
+encode_thread(void *arg)
+{
+    ThreadArgs *args = (ThreadArgs *)arg;
+    for (int i = 0; i < args->iters; i++) {
+        uint64_t t = stats_clock();
+        (*args->fn)();
+        args->ms.push_back(elapsed_ms(t));
+    }
+    return NULL;
+}
+
+// The same encode on 1..8 threads at once, like async encodes on the
+// libuv threadpool.
+static void
+bench_threads()
+{
+    EncodeCase fn;
+    fn.w = 1920; fn.h = 1080; fn.quality = 80; fn.buf_type = BUF_RGBA;
+    fn.image = make_image(fn.w, fn.h, fn.buf_type);
+
+    for (int n = 1; n <= 8; n *= 2) {
+        char name[64];
+        snprintf(name, sizeof(name), "threads/rgba/1920x1080/q80/t%d", n);
+        if (!wanted(name)) continue;
+
+        std::vector<ThreadArgs> args(n);
+        std::vector<pthread_t> threads(n);
+        uint64_t start = stats_clock();
+        for (int i = 0; i < n; i++) {
+            args[i].fn = &fn;
+            args[i].iters = quick ? 3 : 10;
+            pthread_create(&threads[i], NULL, encode_thread, &args[i]);
+        }
+
+        BenchResult result(name);
+        for (int i = 0; i < n; i++) {
+            pthread_join(threads[i], NULL);
+            result.ms.insert(result.ms.end(), args[i].ms.begin(), args[i].ms.end());
+        }
+        result.total_ms = elapsed_ms(start);
+        result.pixels = (double)fn.w*fn.h;
+        result.bytes_out = fn();
+        results.push_back(result);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    std::string push_data = "examples/push-data";
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--quick")) quick = true;
+        else if (!strcmp(argv[i], "--filter") && i + 1 < argc) filter = argv[++i];
+        else if (!strcmp(argv[i], "--push-data") && i + 1 < argc) push_data = argv[++i];
+        else {
+            fprintf(stderr, "usage: %s [--quick] [--filter substring] [--push-data dir]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    static const int sizes[][2] = {
+        {16, 16}, {128, 128}, {720, 400}, {1920, 1080}, {3840, 2160}, {7680, 4320}
+    };
+    int nsizes = quick ? 4 : 6;
+
+    try {
+        for (size_t t = 0; t < sizeof(all_types)/sizeof(all_types[0]); t++)
+            for (int s = 0; s < nsizes; s++)
+                bench_encode("encode", all_types[t], type_names[t], sizes[s][0], sizes[s][1], 80);
+
+        for (int q = 10; q <= 100; q += 15)
+            bench_encode("quality", BUF_RGB, "rgb", 1920, 1080, q);
+
+        bench_stacks(push_data);
+        bench_threads();
+    }
+    catch (const char *err) {
+        fprintf(stderr, "jpeg_bench: %s\n", err);
+        return 1;
+    }
+
+    print_results(stdout, "jpeg_bench", results);
+    return 0;
+}
@@ -0,0 +1,310 @@
+// Replays a recorded stack session (see bench/trace.js) and reports frames
+// per second, encode latency and bytes per frame as JSON, in the same shape
+// as jpeg_bench.
+//
+//   jpeg_replay [--realtime] [--repeat n] [--stack fixed|dynamic] trace...
+//
+// A trace is a text file. The first line names the stack it was recorded
+// on, the rest are calls, each prefixed with milliseconds since recording
+// started. Files are raw pixels, relative to the trace's directory:
+//
+//   stack dynamic rgba
+//   stack fixed 720 400 rgba
+//   <ms> quality <q>
+//   <ms> background <w> <h> <file> [stride]
+//   <ms> solid <r> <g> <b> <w> <h>
+//   <ms> push <x> <y> <w> <h> <file> [stride]
+//   <ms> reset
+//   <ms> encode
+//
+// The stacks themselves are node objects, so this drives the TiledCanvas
+// and JpegEncoder they are made of the same way they do. --stack replays a
+// trace on the other kind of stack: a fixed one encodes the whole canvas,
+// a dynamic one only the area pushed since the last reset.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include <time.h>
+
+#include "common.h"
+#include "jpeg_encoder.h"
+#include "tiled_canvas.h"
+#include "bench_util.h"
+
+enum op_type { OP_QUALITY, OP_BACKGROUND, OP_SOLID, OP_PUSH, OP_RESET, OP_ENCODE };
+
+struct TraceOp {
+    double ms;
+    op_type type;
+    int args[6];
+    size_t stride;
+    const std::vector<unsigned char> *data;
+};
+
+struct Trace {
+    std::string name;
+    bool dynamic;
+    int width, height; // of a fixed stack
+    buffer_type buf_type;
+    std::vector<TraceOp> ops;
+    std::map<std::string, std::vector<unsigned char> > files;
+};
+
+static std::vector<unsigned char>
+read_file(const std::string &path)
+{
+    std::vector<unsigned char> data;
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) throw "can't open a file the trace refers to";
+    unsigned char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        data.insert(data.end(), buf, buf + n);
+    fclose(f);
+    return data;
+}
+
+// Reads the trace and every file it refers to, so that replaying doesn't
+// touch the disk.
+static void
+load_trace(const char *path, Trace &trace)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) throw "can't open trace";
+
+    trace.name = path;
+    std::string dir = trace.name.rfind('/') == std::string::npos ? "." :
+        trace.name.substr(0, trace.name.rfind('/'));
+
+    char line[1024], word[32], type[32], file[512];
+    bool have_stack = false;
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+
+        if (!have_stack) {
+            trace.width = trace.height = 0;
+            if (sscanf(line, "stack dynamic %31s", type) == 1)
+                trace.dynamic = true;
+            else if (sscanf(line, "stack fixed %d %d %31s", &trace.width, &trace.height, type) == 3)
+                trace.dynamic = false;
+            else
+                break;
+            if (!parse_buffer_type(type, trace.buf_type) || is_planar(trace.buf_type))
+                break;
+            have_stack = true;
+            continue;
+        }
+
+        TraceOp op;
+        int n;
+        memset(op.args, 0, sizeof(op.args));
+        op.stride = 0;
+        op.data = NULL;
+        if (sscanf(line, "%lf %31s %n", &op.ms, word, &n) != 2) {
+            fclose(f);
+            throw "bad line in trace";
+        }
+        const char *rest = line + n;
+        unsigned long stride = 0;
+        int *a = op.args;
+
+        if (!strcmp(word, "quality") && sscanf(rest, "%d", &a[0]) == 1)
+            op.type = OP_QUALITY;
+        else if (!strcmp(word, "background") &&
+            sscanf(rest, "%d %d %511s %lu", &a[0], &a[1], file, &stride) >= 3)
+            op.type = OP_BACKGROUND;
+        else if (!strcmp(word, "solid") &&
+            sscanf(rest, "%d %d %d %d %d", &a[0], &a[1], &a[2], &a[3], &a[4]) == 5)
+            op.type = OP_SOLID;
+        else if (!strcmp(word, "push") &&
+            sscanf(rest, "%d %d %d %d %511s %lu", &a[0], &a[1], &a[2], &a[3], file, &stride) >= 5)
+            op.type = OP_PUSH;
+        else if (!strcmp(word, "reset"))
+            op.type = OP_RESET;
+        else if (!strcmp(word, "encode"))
+            op.type = OP_ENCODE;
+        else {
+            fclose(f);
+            throw "bad line in trace";
+        }
+
+        if (op.type == OP_BACKGROUND || op.type == OP_PUSH) {
+            int w = op.type == OP_PUSH ? a[2] : a[0], h = op.type == OP_PUSH ? a[3] : a[1];
+            std::string file_path = file[0] == '/' ? file : dir + "/" + file;
+            if (!trace.files.count(file_path))
+                trace.files[file_path] = read_file(file_path);
+            op.data = &trace.files[file_path];
+            op.stride = stride;
+            if (op.data->size() < image_span(w, h, trace.buf_type, stride)) {
+                fclose(f);
+                throw "a file in the trace is too small for its rectangle";
+            }
+        }
+        trace.ops.push_back(op);
+    }
+    fclose(f);
+    if (!have_stack) throw "trace doesn't start with a valid stack line";
+}
+
+static void
+sleep_ms(double ms)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)(ms/1000);
+    ts.tv_nsec = (long)((ms - ts.tv_sec*1000.0)*1e6);
+    nanosleep(&ts, NULL);
+}
+
+// What FixedJpegStack and DynamicJpegStack do with each call.
+class ReplayStack {
+    bool dynamic;
+    int width, height, quality;
+    buffer_type buf_type;
+    TiledCanvas *canvas;
+    int x1, y1, x2, y2; // pushed area, x2 < x1 when nothing was pushed
+
+public:
+    ReplayStack(const Trace &trace, bool ddynamic) :
+        dynamic(ddynamic), width(trace.width), height(trace.height),
+        quality(60), buf_type(trace.buf_type), canvas(NULL)
+    {
+        if (width && height) canvas = new TiledCanvas(width, height);
+        reset();
+    }
+    ~ReplayStack() { delete canvas; }
+
+    void reset() { x1 = y1 = 0x7fffffff; x2 = y2 = -1; }
+
+    void solid(int r, int g, int b, int w, int h) {
+        // a fixed stack keeps its size
+        if (canvas && !dynamic) { w = width; h = height; }
+        delete canvas;
+        canvas = new TiledCanvas(w, h, r, g, b);
+        width = w;
+        height = h;
+    }
+
+    void push(const TraceOp &op) {
+        if (!canvas) throw "trace pushes before setting a background";
+        const int *a = op.args;
+        canvas->push(&(*op.data)[0], buf_type, a[0], a[1], a[2], a[3], op.stride);
+        if (a[0] < x1) x1 = a[0];
+        if (a[1] < y1) y1 = a[1];
+        if (a[0] + a[2] > x2) x2 = a[0] + a[2];
+        if (a[1] + a[3] > y2) y2 = a[1] + a[3];
+    }
+
+    void apply(const TraceOp &op) {
+        const int *a = op.args;
+        switch (op.type) {
+        case OP_QUALITY: quality = a[0]; break;
+        case OP_SOLID: solid(a[0], a[1], a[2], a[3], a[4]); break;
+        case OP_BACKGROUND:
+            solid(0, 0, 0, a[0], a[1]);
+            canvas->push(&(*op.data)[0], buf_type, 0, 0, a[0], a[1], op.stride);
+            break;
+        case OP_PUSH: push(op); break;
+        case OP_RESET: reset(); break;
+        case OP_ENCODE: break;
+        }
+    }
+
+    // Returns the encoded size, adds the encoded area to pixels.
+    unsigned long encode(double &pixels) {
+        if (!canvas) throw "trace encodes before setting a background";
+        if (dynamic && x2 < x1) return 0; // nothing to encode yet
+        CanvasRowSource rows(*canvas);
+        JpegEncoder encoder(&rows, width, height, quality);
+        if (dynamic) {
+            encoder.setRect(Rect(x1, y1, x2 - x1, y2 - y1));
+            pixels += (double)(x2 - x1)*(y2 - y1);
+        }
+        else {
+            pixels += (double)width*height;
+        }
+        encoder.encode();
+        return encoder.get_jpeg_len();
+    }
+};
+
+static BenchResult
+replay(const Trace &trace, bool dynamic, bool realtime, int repeat)
+{
+    BenchResult result("replay/" + trace.name + (dynamic ? "/dynamic" : "/fixed"));
+    double pixels = 0, bytes = 0;
+    uint64_t start = stats_clock();
+
+    for (int r = 0; r < repeat; r++) {
+        ReplayStack stack(trace, dynamic);
+        uint64_t session_start = stats_clock();
+        for (size_t i = 0; i < trace.ops.size(); i++) {
+            const TraceOp &op = trace.ops[i];
+            if (realtime) {
+                double ahead = op.ms - elapsed_ms(session_start);
+                if (ahead > 0) sleep_ms(ahead);
+            }
+            if (op.type != OP_ENCODE) {
+                stack.apply(op);
+                continue;
+            }
+            uint64_t t = stats_clock();
+            unsigned long len = stack.encode(pixels);
+            if (!len) continue;
+            result.ms.push_back(elapsed_ms(t));
+            bytes += len;
+        }
+    }
+
+    result.total_ms = elapsed_ms(start);
+    if (!result.ms.empty()) {
+        result.pixels = pixels/result.ms.size();
+        result.bytes_out = bytes/result.ms.size();
+    }
+    return result;
+}
+
+int
+main(int argc, char **argv)
+{
+    bool realtime = false;
+    int repeat = 1;
+    const char *stack = NULL;
+    bool bad_args = false;
+    std::vector<const char *> paths;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--realtime")) realtime = true;
+        else if (!strcmp(argv[i], "--repeat") && i + 1 < argc) repeat = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--stack") && i + 1 < argc) stack = argv[++i];
+        else if (argv[i][0] != '-') paths.push_back(argv[i]);
+        else bad_args = true;
+    }
+    if (bad_args || paths.empty() || repeat < 1 ||
+        (stack && strcmp(stack, "fixed") && strcmp(stack, "dynamic")))
+    {
+        fprintf(stderr, "usage: %s [--realtime] [--repeat n] [--stack fixed|dynamic] trace...\n",
+            argv[0]);
+        return 1;
+    }
+
+    std::vector<BenchResult> results;
+    for (size_t i = 0; i < paths.size(); i++) {
+        try {
+            Trace trace;
+            load_trace(paths[i], trace);
+            bool dynamic = stack ? !strcmp(stack, "dynamic") : trace.dynamic;
+            results.push_back(replay(trace, dynamic, realtime, repeat));
+        }
+        catch (const char *err) {
+            fprintf(stderr, "jpeg_replay: %s: %s\n", paths[i], err);
+            return 1;
+        }
+    }
+
+    print_results(stdout, "jpeg_replay", results);
+    return 0;
+}
@@ -0,0 +1,71 @@
+// Records what is done to a FixedJpegStack or DynamicJpegStack as a trace
+// that build/Release/jpeg_replay can play back (the format is described in
+// bench/jpeg_replay.cpp). Pixels go to numbered .dat files next to the
+// trace.
+//
+//   var trace = require('./bench/trace');
+//   var stack = trace.record(new JpegLib.DynamicJpegStack('rgba'),
+//       'session', 'dynamic rgba');
+//   // ... use stack as usual ...
+//   stack.stopRecording();
+//
+// header is 'dynamic <buffer_type>' or 'fixed <width> <height> <buffer_type>'.
+// Only Buffers are recorded; pushes of files, stride/offset/x/y options,
+// blending, scaling and pushJpeg calls are passed through unrecorded.
+
+var fs = require('fs');
+var path = require('path');
+
+exports.record = function (stack, dir, header) {
+    if (!fs.existsSync(dir)) fs.mkdirSync(dir);
+    var fd = fs.openSync(path.join(dir, 'session.trace'), 'w');
+    var start = process.hrtime();
+    var files = 0;
+
+    function write(line) {
+        var t = process.hrtime(start);
+        fs.writeSync(fd, (t[0]*1e3 + t[1]/1e6).toFixed(3) + ' ' + line + '\n');
+    }
+
+    function save(buf) {
+        var file = ('000' + files++).slice(-4) + '.dat';
+        fs.writeFileSync(path.join(dir, file), buf);
+        return file;
+    }
+
+    function plain(args, n) {
+        return Buffer.isBuffer(args[0]) && args.length == n;
+    }
+
+    function wrap(name, record) {
+        var orig = stack[name];
+        if (!orig) return;
+        stack[name] = function () {
+            var args = Array.prototype.slice.call(arguments);
+            record(args);
+            return orig.apply(stack, args);
+        };
+    }
+
+    fs.writeSync(fd, 'stack ' + header + '\n');
+
+    wrap('setQuality', function (a) { write('quality ' + a[0]); });
+    wrap('setBackground', function (a) {
+        if (plain(a, 3)) write('background ' + a[1] + ' ' + a[2] + ' ' + save(a[0]));
+    });
+    wrap('setSolidBackground', function (a) {
+        if (a.length == 5) write('solid ' + a.join(' '));
+    });
+    wrap('push', function (a) {
+        if (plain(a, 5)) write('push ' + a.slice(1).join(' ') + ' ' + save(a[0]));
+    });
+    wrap('reset', function () { write('reset'); });
+    wrap('encode', function () { write('encode'); });
+    wrap('encodeSync', function () { write('encode'); });
+    wrap('encodeToFile', function () { write('encode'); });
+
+    stack.stopRecording = function () {
+        fs.closeSync(fd);
+    };
+    return stack;
+};
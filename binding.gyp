@@ -5,15 +5,98 @@
       "sources": [
         "src/common.cpp",
         "src/jpeg_encoder.cpp",
+        "src/encode_stats.cpp",
+        "src/image_metrics.cpp",
+        "src/jpeg_transform.cpp",
+        "src/jpeg_variants.cpp",
+        "src/dct_image.cpp",
+        "src/tiled_canvas.cpp",
+        "src/tile_pool.cpp",
+        "src/dirty_map.cpp",
+        "src/yuv_canvas.cpp",
+        "src/coef_canvas.cpp",
+        "src/blend.cpp",
+        "src/resample.cpp",
+        "src/mapped_file.cpp",
+        "src/shared_region.cpp",
         "src/jpeg.cpp",
         "src/fixed_jpeg_stack.cpp",
         "src/dynamic_jpeg_stack.cpp",
+        "src/background.cpp",
+        "src/shared_memory.cpp",
+        "src/scan_emitter.cpp",
+        "src/transform.cpp",
+        "src/stats.cpp",
+        "src/metrics.cpp",
+        "src/external_memory.cpp",
+        "src/js_args.cpp",
         "src/module.cpp"
       ],
       "include_dirs" : ["<!(node -p -e \"require('path').dirname(require.resolve('nan'))\")"],
       "libraries": ["-ljpeg"],
       "cflags!": [ "-fno-exceptions", "-D_FILE_OFFSET_BITS=64", "-D_LARGEFILE_SOURCE" ],
       "cflags_cc!": [ "-fno-exceptions", "-D_FILE_OFFSET_BITS=64", "-D_LARGEFILE_SOURCE" ],
+      "conditions": [
+        ["OS=='mac'", {
+          "xcode_settings": {
+            "GCC_ENABLE_CPP_EXCEPTIONS": "YES"
+          }
+        }],
+        ["OS=='linux'", {
+          "libraries": ["-lrt"]
+        }]
+      ]
+    },
+    {
+      "target_name": "jpeg_bench",
+      "type": "executable",
+      "sources": [
+        "bench/jpeg_bench.cpp",
+        "src/common.cpp",
+        "src/jpeg_encoder.cpp",
+        "src/encode_stats.cpp",
+        "src/image_metrics.cpp",
+        "src/jpeg_transform.cpp",
+        "src/jpeg_variants.cpp",
+        "src/dct_image.cpp",
+        "src/tiled_canvas.cpp",
+        "src/tile_pool.cpp",
+        "src/blend.cpp",
+        "src/resample.cpp"
+      ],
+      "include_dirs" : ["src", "<!(node -p -e \"require('path').dirname(require.resolve('nan'))\")"],
+      "libraries": ["-ljpeg", "-lpthread"],
+      "cflags!": [ "-fno-exceptions", "-D_FILE_OFFSET_BITS=64", "-D_LARGEFILE_SOURCE" ],
+      "cflags_cc!": [ "-fno-exceptions", "-D_FILE_OFFSET_BITS=64", "-D_LARGEFILE_SOURCE" ],
+      "conditions": [
+        ["OS=='mac'", {
+          "xcode_settings": {
+            "GCC_ENABLE_CPP_EXCEPTIONS": "YES"
+          }
+        }]
+      ]
+    },
+    {
+      "target_name": "jpeg_replay",
+      "type": "executable",
+      "sources": [
+        "bench/jpeg_replay.cpp",
+        "src/common.cpp",
+        "src/jpeg_encoder.cpp",
+        "src/encode_stats.cpp",
+        "src/image_metrics.cpp",
+        "src/jpeg_transform.cpp",
+        "src/jpeg_variants.cpp",
+        "src/dct_image.cpp",
+        "src/tiled_canvas.cpp",
+        "src/tile_pool.cpp",
+        "src/blend.cpp",
+        "src/resample.cpp"
+      ],
+      "include_dirs" : ["src", "<!(node -p -e \"require('path').dirname(require.resolve('nan'))\")"],
+      "libraries": ["-ljpeg", "-lpthread"],
+      "cflags!": [ "-fno-exceptions", "-D_FILE_OFFSET_BITS=64", "-D_LARGEFILE_SOURCE" ],
+      "cflags_cc!": [ "-fno-exceptions", "-D_FILE_OFFSET_BITS=64", "-D_LARGEFILE_SOURCE" ],
       "conditions": [
         ["OS=='mac'", {
           "xcode_settings": {
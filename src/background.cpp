@@ -0,0 +1,129 @@
+#include <node.h>
+
+#include "background.h"
+#include "js_args.h"
+
+using namespace v8;
+using namespace node;
+
+// Tags Background objects, so stacks can tell them apart from other
+// wrapped objects without a persistent template per context.
+static Local<String>
+tag()
+{
+    return String::NewSymbol("node-jpeg:Background");
+}
+
+void
+Background::Initialize(v8::Handle<v8::Object> target)
+{
+    NanScope();
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    NODE_SET_PROTOTYPE_METHOD(t, "dispose", Dispose);
+    target->Set(String::NewSymbol("Background"), t->GetFunction());
+}
+
+Background::Background(TiledCanvas *ccanvas) : canvas(ccanvas)
+{
+    memory.set(canvas->allocated_bytes());
+}
+
+Background::~Background()
+{
+    if (canvas) canvas->unref();
+}
+
+const TiledCanvas *
+Background::get_canvas() const
+{
+    return canvas;
+}
+
+// Drops our reference, stacks using the background keep theirs.
+void
+Background::Dispose()
+{
+    if (canvas) canvas->unref();
+    canvas = NULL;
+    memory.set(0);
+}
+
+Background *
+Background::FromValue(v8::Handle<v8::Value> val)
+{
+    if (!val->IsObject()) return NULL;
+    Local<Value> ext = val->ToObject()->GetHiddenValue(tag());
+    if (ext.IsEmpty() || !ext->IsExternal()) return NULL;
+    return (Background *)Local<External>::Cast(ext)->Value();
+}
+
+NAN_METHOD(Background::New)
+{
+    NanScope();
+
+    if (args.Length() < 3)
+        return NanThrowError("At least three arguments required - buffer, width, height, [buffer type, and options]");
+    unsigned char *bytes;
+    size_t bytes_len;
+    if (!get_bytes(args[0], bytes, bytes_len))
+        return NanThrowTypeError("First argument must be a Buffer, typed array or ArrayBuffer.");
+    if (!args[1]->IsInt32())
+        return NanThrowTypeError("Second argument must be integer width.");
+    if (!args[2]->IsInt32())
+        return NanThrowTypeError("Third argument must be integer height.");
+
+    int w = args[1]->Int32Value();
+    int h = args[2]->Int32Value();
+
+    if (w < 0)
+        return NanThrowRangeError("Width smaller than 0.");
+    if (h < 0)
+        return NanThrowRangeError("Height smaller than 0.");
+
+    buffer_type buf_type = BUF_RGB;
+    if (args.Length() >= 4) {
+        if (!args[3]->IsString())
+            return NanThrowTypeError("Fourth argument must be a string. One of " BUFFER_TYPES ".");
+
+        String::AsciiValue bt(args[3]->ToString());
+        if (!parse_buffer_type(*bt, buf_type))
+            return NanThrowTypeError("Buffer type must be " BUFFER_TYPES ".");
+    }
+
+    SourceOptions src;
+    if (args.Length() >= 5) {
+        const char *err = parse_source_options(args[4], src);
+        if (err) return NanThrowTypeError(err);
+    }
+    size_t start, span;
+    const char *extent_err = source_extent(src, w, h, buf_type, start, span);
+    if (extent_err) return NanThrowRangeError(extent_err);
+    if (!extent_fits(start, span, bytes_len))
+        return NanThrowRangeError("Buffer is too small for the given width, height and buffer type.");
+
+    TiledCanvas *canvas = NULL;
+    try {
+        canvas = new TiledCanvas(w, h);
+        canvas->push(bytes + start, buf_type, 0, 0, w, h, src.stride);
+    }
+    catch (const char *err) {
+        if (canvas) canvas->unref();
+        return NanThrowError(err);
+    }
+
+    Background *bg = new Background(canvas);
+    bg->Wrap(args.This());
+    args.This()->SetHiddenValue(tag(), External::New(bg));
+    NanReturnValue(args.This());
+}
+
+NAN_METHOD(Background::Dispose)
+{
+    NanScope();
+
+    Background *bg = ObjectWrap::Unwrap<Background>(args.This());
+    bg->Dispose();
+    NanReturnUndefined();
+}
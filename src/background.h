@@ -0,0 +1,34 @@
+#ifndef BACKGROUND_H
+#define BACKGROUND_H
+
+#include <node.h>
+
+#include "common.h"
+#include "tiled_canvas.h"
+#include "external_memory.h"
+
+// A background that's converted once and then shared by any number of
+// DynamicJpegStacks through setBackground(background). Stacks only read its
+// tiles and copy the ones they push over, so it stays alive while a stack
+// still uses it, even after dispose().
+class Background : public node::ObjectWrap {
+    TiledCanvas *canvas; // one reference is ours, NULL once disposed
+    ExternalMemory memory;
+
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+    Background(TiledCanvas *ccanvas);
+    ~Background();
+
+    const TiledCanvas *get_canvas() const;
+    void Dispose();
+
+    // The Background wrapped by val, or NULL if it isn't one.
+    static Background *FromValue(v8::Handle<v8::Value> val);
+
+    static NAN_METHOD(New);
+    static NAN_METHOD(Dispose);
+};
+
+#endif
+
@@ -0,0 +1,114 @@
+#include "blend.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Pixels staged per pass, keeps the scratch rows on the stack.
+#define BLEND_CHUNK 128
+
+bool
+has_alpha(buffer_type buf_type)
+{
+    return buf_type == BUF_RGBA || buf_type == BUF_BGRA || buf_type == BUF_ARGB;
+}
+
+// x/255 rounded, exact for x <= 255*255.
+static inline unsigned int
+div255(unsigned int x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+// Splits src into packed RGB and an alpha value per RGB byte, so that the
+// blend itself is a plain byte-wise loop over both rows.
+static void
+stage_row(const unsigned char *src, unsigned char *rgb, unsigned char *alpha,
+    int pixels, buffer_type buf_type)
+{
+    int r, g, b, a;
+    switch (buf_type) {
+    case BUF_RGBA: r = 0; g = 1; b = 2; a = 3; break;
+    case BUF_BGRA: r = 2; g = 1; b = 0; a = 3; break;
+    case BUF_ARGB: r = 1; g = 2; b = 3; a = 0; break;
+    default:
+        throw "Unexpected buf_type in blend_row";
+    }
+
+    for (int i = 0; i < pixels; i++, src += 4) {
+        *rgb++ = src[r];
+        *rgb++ = src[g];
+        *rgb++ = src[b];
+        *alpha++ = src[a];
+        *alpha++ = src[a];
+        *alpha++ = src[a];
+    }
+}
+
+// dst = src*a + dst*(255 - a), or src + dst*(255 - a) for premultiplied
+// sources, n bytes at a time.
+static void
+blend_bytes(unsigned char *dst, const unsigned char *src, const unsigned char *alpha,
+    int n, bool premultiplied)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c128 = _mm_set1_epi16(128);
+    const __m128i c255 = _mm_set1_epi16(255);
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i a = _mm_loadu_si128((const __m128i *)(alpha + i));
+
+        __m128i a_lo = _mm_unpacklo_epi8(a, zero), a_hi = _mm_unpackhi_epi8(a, zero);
+        __m128i d_lo = _mm_unpacklo_epi8(d, zero), d_hi = _mm_unpackhi_epi8(d, zero);
+
+        // dst*(255 - a) + 128, plus src*a for straight alpha; fits in 16 bits
+        __m128i t_lo = _mm_add_epi16(_mm_mullo_epi16(d_lo, _mm_sub_epi16(c255, a_lo)), c128);
+        __m128i t_hi = _mm_add_epi16(_mm_mullo_epi16(d_hi, _mm_sub_epi16(c255, a_hi)), c128);
+        if (!premultiplied) {
+            t_lo = _mm_add_epi16(t_lo, _mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), a_lo));
+            t_hi = _mm_add_epi16(t_hi, _mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), a_hi));
+        }
+        t_lo = _mm_srli_epi16(_mm_add_epi16(t_lo, _mm_srli_epi16(t_lo, 8)), 8);
+        t_hi = _mm_srli_epi16(_mm_add_epi16(t_hi, _mm_srli_epi16(t_hi, 8)), 8);
+
+        __m128i out = _mm_packus_epi16(t_lo, t_hi);
+        if (premultiplied)
+            out = _mm_adds_epu8(out, s);
+        _mm_storeu_si128((__m128i *)(dst + i), out);
+    }
+#endif
+
+    for (; i < n; i++) {
+        unsigned int a = alpha[i];
+        if (premultiplied) {
+            unsigned int v = src[i] + div255(dst[i]*(255 - a));
+            dst[i] = v > 255 ? 255 : v;
+        }
+        else {
+            dst[i] = div255(src[i]*a + dst[i]*(255 - a));
+        }
+    }
+}
+
+void
+blend_row(const unsigned char *src, unsigned char *rgb, int pixels,
+    buffer_type buf_type, blend_mode mode)
+{
+    unsigned char src_rgb[BLEND_CHUNK*3];
+    unsigned char alpha[BLEND_CHUNK*3];
+
+    while (pixels > 0) {
+        int n = pixels < BLEND_CHUNK ? pixels : BLEND_CHUNK;
+        stage_row(src, src_rgb, alpha, n, buf_type);
+        blend_bytes(rgb, src_rgb, alpha, n*3, mode == BLEND_PREMULTIPLIED);
+        src += n*4;
+        rgb += n*3;
+        pixels -= n;
+    }
+}
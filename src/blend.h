@@ -0,0 +1,21 @@
+#ifndef BLEND_H
+#define BLEND_H
+
+#include "common.h"
+
+// How a pushed fragment is combined with the canvas under it.
+typedef enum {
+    BLEND_NONE,          // replace, alpha is ignored
+    BLEND_OVER,          // source-over with straight alpha
+    BLEND_PREMULTIPLIED  // source-over with premultiplied alpha
+} blend_mode;
+
+bool has_alpha(buffer_type buf_type);
+
+// Composites `pixels' pixels of src (RGBA, BGRA or ARGB) over the packed
+// RGB pixels at rgb.
+void blend_row(const unsigned char *src, unsigned char *rgb, int pixels,
+    buffer_type buf_type, blend_mode mode);
+
+#endif
+
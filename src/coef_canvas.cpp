@@ -0,0 +1,266 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include "coef_canvas.h"
+
+CoefCanvas::CoefCanvas(int wwidth, int hheight,
+    unsigned char r, unsigned char g, unsigned char b) :
+    width(wwidth), height(hheight), initialized(false),
+    color_space(JCS_UNKNOWN), num_components(0),
+    max_h_samp(1), max_v_samp(1), blocks_per_mcu(0),
+    mcus_x(0), mcus_y(0), mcu_count(0)
+{
+    fill[0] = r;
+    fill[1] = g;
+    fill[2] = b;
+}
+
+CoefCanvas::~CoefCanvas()
+{
+    for (size_t i = 0; i < mcus.size(); i++)
+        free(mcus[i]);
+}
+
+int
+CoefCanvas::mcu_width() const
+{
+    return initialized ? max_h_samp*DCTSIZE : 0;
+}
+
+int
+CoefCanvas::mcu_height() const
+{
+    return initialized ? max_v_samp*DCTSIZE : 0;
+}
+
+size_t
+CoefCanvas::allocated_bytes() const
+{
+    return (size_t)mcu_count*sizeof(JBLOCK)*blocks_per_mcu + mcus.size()*sizeof(mcus[0]);
+}
+
+void
+CoefCanvas::init_geometry(j_decompress_ptr srcinfo)
+{
+    color_space = srcinfo->jpeg_color_space;
+    num_components = srcinfo->num_components;
+    max_h_samp = srcinfo->max_h_samp_factor;
+    max_v_samp = srcinfo->max_v_samp_factor;
+
+    // JFIF YCbCr of the fill colour
+    double r = fill[0], g = fill[1], b = fill[2];
+    double levels[3] = {
+        0.299*r + 0.587*g + 0.114*b,
+        -0.168736*r - 0.331264*g + 0.5*b + 128,
+        0.5*r - 0.418688*g - 0.081312*b + 128
+    };
+
+    blocks_per_mcu = 0;
+    for (int ci = 0; ci < num_components; ci++) {
+        jpeg_component_info *comp = srcinfo->comp_info + ci;
+        h_samp[ci] = comp->h_samp_factor;
+        v_samp[ci] = comp->v_samp_factor;
+        memcpy(quant[ci], comp->quant_table->quantval, sizeof(quant[ci]));
+        block_offset[ci] = blocks_per_mcu;
+        blocks_per_mcu += h_samp[ci]*v_samp[ci];
+
+        // a flat block's DC is 8 times its level shifted sample value
+        fill_dc[ci] = (JCOEF)floor(8*(levels[ci] - 128)/quant[ci][0] + 0.5);
+    }
+
+    mcus_x = (width + max_h_samp*DCTSIZE - 1)/(max_h_samp*DCTSIZE);
+    mcus_y = (height + max_v_samp*DCTSIZE - 1)/(max_v_samp*DCTSIZE);
+    mcus.assign((size_t)mcus_x*mcus_y, (JCOEF *)NULL);
+    initialized = true;
+}
+
+void
+CoefCanvas::check_geometry(j_decompress_ptr srcinfo)
+{
+    bool same = srcinfo->jpeg_color_space == color_space &&
+        srcinfo->num_components == num_components;
+    for (int ci = 0; same && ci < num_components; ci++) {
+        jpeg_component_info *comp = srcinfo->comp_info + ci;
+        same = comp->h_samp_factor == h_samp[ci] && comp->v_samp_factor == v_samp[ci] &&
+            memcmp(comp->quant_table->quantval, quant[ci], sizeof(quant[ci])) == 0;
+    }
+    if (!same)
+        throw "JPEG tile's colour space, sampling or quantization tables differ from the first tile's.";
+}
+
+void
+CoefCanvas::fill_block(int ci, JCOEFPTR block) const
+{
+    memset(block, 0, sizeof(JBLOCK));
+    block[0] = fill_dc[ci];
+}
+
+JCOEF *
+CoefCanvas::materialize_mcu(int mx, int my)
+{
+    JCOEF *&mcu = mcus[(size_t)my*mcus_x + mx];
+    if (mcu) return mcu;
+
+    mcu = (JCOEF *)malloc(sizeof(JBLOCK)*blocks_per_mcu);
+    if (!mcu) throw "malloc failed in CoefCanvas::materialize_mcu";
+    mcu_count++;
+
+    for (int ci = 0; ci < num_components; ci++)
+        for (int i = 0; i < h_samp[ci]*v_samp[ci]; i++)
+            fill_block(ci, mcu + (block_offset[ci] + i)*DCTSIZE2);
+    return mcu;
+}
+
+void
+CoefCanvas::push_jpeg(const unsigned char *jpeg, size_t len, int x, int y, int &w, int &h)
+{
+    struct jpeg_decompress_struct srcinfo;
+    jpeg_jmp_error_mgr jerr;
+    char message[JMSG_LENGTH_MAX];
+
+    memset(&srcinfo, 0, sizeof(srcinfo));
+    srcinfo.err = jpeg_jmp_error(&jerr, message);
+
+    if (setjmp(jerr.jump)) {
+        jpeg_destroy_decompress(&srcinfo);
+        snprintf(error, sizeof(error), "%s", message);
+        throw (const char *)error;
+    }
+
+    try {
+        jpeg_create_decompress(&srcinfo);
+        jpeg_buffer_src(&srcinfo, jpeg, len);
+        jpeg_read_header(&srcinfo, TRUE);
+
+        if (srcinfo.jpeg_color_space != JCS_YCbCr && srcinfo.jpeg_color_space != JCS_GRAYSCALE)
+            throw "Only YCbCr and grayscale JPEG tiles can be pushed.";
+
+        jvirt_barray_ptr *coefs = jpeg_read_coefficients(&srcinfo);
+        if (!initialized)
+            init_geometry(&srcinfo);
+        else
+            check_geometry(&srcinfo);
+
+        w = srcinfo.image_width;
+        h = srcinfo.image_height;
+        int mcu_w = mcu_width(), mcu_h = mcu_height();
+        if (x % mcu_w || y % mcu_h) {
+            snprintf(error, sizeof(error),
+                "JPEG tiles must be pushed at x and y that are multiples of %d and %d.",
+                mcu_w, mcu_h);
+            throw (const char *)error;
+        }
+        if (x + w > width || y + h > height)
+            throw "Pushed JPEG tile exceeds DynamicJpegStack's background dimensions.";
+        // a partial MCU would show the tile's edge padding next to its neighbour
+        if ((w % mcu_w && x + w != width) || (h % mcu_h && y + h != height)) {
+            snprintf(error, sizeof(error),
+                "JPEG tile width and height must be multiples of %d and %d, "
+                "unless the tile ends at the background's edge.", mcu_w, mcu_h);
+            throw (const char *)error;
+        }
+
+        for (int ci = 0; ci < num_components; ci++) {
+            int tile_bw = comp_blocks(w, h_samp[ci], max_h_samp);
+            int tile_bh = comp_blocks(h, v_samp[ci], max_v_samp);
+            int bx0 = x/mcu_w*h_samp[ci], by0 = y/mcu_h*v_samp[ci];
+
+            for (int by = 0; by < tile_bh; by++) {
+                JBLOCKARRAY row = (*srcinfo.mem->access_virt_barray)
+                    ((j_common_ptr)&srcinfo, coefs[ci], by, 1, FALSE);
+                int gy = by0 + by;
+                for (int bx = 0; bx < tile_bw; bx++) {
+                    int gx = bx0 + bx;
+                    JCOEF *mcu = materialize_mcu(gx/h_samp[ci], gy/v_samp[ci]);
+                    int i = (gy % v_samp[ci])*h_samp[ci] + gx % h_samp[ci];
+                    memcpy(mcu + (block_offset[ci] + i)*DCTSIZE2, row[0][bx], sizeof(JBLOCK));
+                }
+            }
+        }
+
+        jpeg_finish_decompress(&srcinfo);
+    }
+    catch (...) {
+        jpeg_destroy_decompress(&srcinfo);
+        throw;
+    }
+    jpeg_destroy_decompress(&srcinfo);
+}
+
+void
+CoefCanvas::write_coefficients(j_compress_ptr cinfo, int x, int y, int w, int h)
+{
+    if (!initialized)
+        throw "No JPEG tiles have been pushed.";
+    int mcu_w = mcu_width(), mcu_h = mcu_height();
+    if (x % mcu_w || y % mcu_h)
+        throw "Area to encode must start on an MCU boundary.";
+
+    cinfo->image_width = w;
+    cinfo->image_height = h;
+    cinfo->input_components = num_components;
+    cinfo->in_color_space = color_space;
+    jpeg_set_defaults(cinfo);
+    jpeg_set_colorspace(cinfo, color_space);
+
+    // one quantization table per distinct component table
+    int tables = 0;
+    for (int ci = 0; ci < num_components; ci++) {
+        jpeg_component_info *comp = cinfo->comp_info + ci;
+        comp->h_samp_factor = h_samp[ci];
+        comp->v_samp_factor = v_samp[ci];
+
+        int t = 0;
+        while (t < ci && memcmp(quant[t], quant[ci], sizeof(quant[ci])) != 0) t++;
+        if (t == ci) {
+            t = tables++;
+            if (!cinfo->quant_tbl_ptrs[t])
+                cinfo->quant_tbl_ptrs[t] = jpeg_alloc_quant_table((j_common_ptr)cinfo);
+            memcpy(cinfo->quant_tbl_ptrs[t]->quantval, quant[ci], sizeof(quant[ci]));
+            cinfo->quant_tbl_ptrs[t]->sent_table = FALSE;
+        }
+        else {
+            t = cinfo->comp_info[t].quant_tbl_no;
+        }
+        comp->quant_tbl_no = t;
+    }
+
+    // libjpeg keeps this pointer until jpeg_finish_compress, so it can't
+    // live on our stack
+    jvirt_barray_ptr *arrays = (jvirt_barray_ptr *)(*cinfo->mem->alloc_small)
+        ((j_common_ptr)cinfo, JPOOL_IMAGE, sizeof(jvirt_barray_ptr)*num_components);
+    for (int ci = 0; ci < num_components; ci++) {
+        arrays[ci] = (*cinfo->mem->request_virt_barray)
+            ((j_common_ptr)cinfo, JPOOL_IMAGE, FALSE,
+             comp_blocks(w, h_samp[ci], max_h_samp),
+             comp_blocks(h, v_samp[ci], max_v_samp), v_samp[ci]);
+    }
+
+    // realizes the arrays; nothing is coded before jpeg_finish_compress
+    jpeg_write_coefficients(cinfo, arrays);
+
+    for (int ci = 0; ci < num_components; ci++) {
+        int bw = comp_blocks(w, h_samp[ci], max_h_samp);
+        int bh = comp_blocks(h, v_samp[ci], max_v_samp);
+        int bx0 = x/mcu_w*h_samp[ci], by0 = y/mcu_h*v_samp[ci];
+
+        for (int by = 0; by < bh; by++) {
+            JBLOCKARRAY row = (*cinfo->mem->access_virt_barray)
+                ((j_common_ptr)cinfo, arrays[ci], by, 1, TRUE);
+            int gy = by0 + by;
+            for (int bx = 0; bx < bw; bx++) {
+                int gx = bx0 + bx;
+                int mx = gx/h_samp[ci], my = gy/v_samp[ci];
+                const JCOEF *mcu = mx < mcus_x && my < mcus_y ? mcus[(size_t)my*mcus_x + mx] : NULL;
+                if (mcu) {
+                    int i = (gy % v_samp[ci])*h_samp[ci] + gx % h_samp[ci];
+                    memcpy(row[0][bx], mcu + (block_offset[ci] + i)*DCTSIZE2, sizeof(JBLOCK));
+                }
+                else {
+                    fill_block(ci, row[0][bx]);
+                }
+            }
+        }
+    }
+}
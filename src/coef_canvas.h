@@ -0,0 +1,56 @@
+#ifndef COEF_CANVAS_H
+#define COEF_CANVAS_H
+
+#include <vector>
+
+#include "common.h"
+#include "jpeg_encoder.h"
+#include "jpeg_transform.h"
+
+// Canvas of DCT coefficients that already encoded JPEG tiles are copied
+// into block by block, so a mosaic can be written out again with only the
+// entropy coding redone. The first tile fixes the components, sampling and
+// quantization tables, later tiles have to match them. MCUs nothing was
+// pushed onto hold a flat block of the fill colour.
+class CoefCanvas : public JpegCoefSource {
+    int width, height;
+    unsigned char fill[3];
+
+    bool initialized; // set by the first tile
+    J_COLOR_SPACE color_space;
+    int num_components;
+    int h_samp[MAX_COMPONENTS], v_samp[MAX_COMPONENTS];
+    int max_h_samp, max_v_samp;
+    UINT16 quant[MAX_COMPONENTS][DCTSIZE2];
+    int block_offset[MAX_COMPONENTS]; // of each component's blocks in an MCU
+    int blocks_per_mcu;
+    JCOEF fill_dc[MAX_COMPONENTS];
+
+    int mcus_x, mcus_y;
+    std::vector<JCOEF *> mcus; // NULL until a tile covers the MCU
+    int mcu_count; // MCUs that aren't NULL
+
+    char error[JMSG_LENGTH_MAX + 128];
+
+    void init_geometry(j_decompress_ptr srcinfo);
+    void check_geometry(j_decompress_ptr srcinfo);
+    JCOEF *materialize_mcu(int mx, int my);
+    void fill_block(int ci, JCOEFPTR block) const;
+
+public:
+    CoefCanvas(int wwidth, int hheight,
+        unsigned char r = 0, unsigned char g = 0, unsigned char b = 0);
+    ~CoefCanvas();
+
+    int mcu_width() const;  // 0 until the first tile
+    int mcu_height() const;
+    size_t allocated_bytes() const;
+
+    // Copies the blocks of a JPEG into the canvas at (x, y), which has to be
+    // on an MCU boundary. Sets w and h to the tile's size.
+    void push_jpeg(const unsigned char *jpeg, size_t len, int x, int y, int &w, int &h);
+    void write_coefficients(j_compress_ptr cinfo, int x, int y, int w, int h);
+};
+
+#endif
+
@@ -1,5 +1,4 @@
 #include <cstdlib>
-#include <cassert>
 #include "common.h"
 
 using namespace v8;
@@ -9,53 +8,184 @@ bool str_eq(const char *s1, const char *s2)
         return strcmp(s1, s2) == 0;
 }
 
-unsigned char *
-rgba_to_rgb(const unsigned char *rgba, int rgba_size)
+bool
+parse_buffer_type(const char *name, buffer_type &buf_type)
 {
-    assert(rgba_size%4==0);
+    static const struct { const char *name; buffer_type type; } types[] = {
+        { "rgb", BUF_RGB }, { "bgr", BUF_BGR },
+        { "rgba", BUF_RGBA }, { "bgra", BUF_BGRA },
+        { "rgbx", BUF_RGBX }, { "bgrx", BUF_BGRX },
+        { "xrgb", BUF_XRGB }, { "argb", BUF_ARGB },
+        { "rgb565", BUF_RGB565 },
+        { "yuv420", BUF_YUV420 }, { "i420", BUF_YUV420 },
+        { "nv12", BUF_NV12 }
+    };
 
-    int rgb_size = rgba_size*3/4;
-    unsigned char *rgb = (unsigned char *)malloc(sizeof(*rgb)*rgb_size);
-    if (!rgb) return NULL;
+    for (size_t i = 0; i < sizeof(types)/sizeof(types[0]); i++) {
+        if (str_eq(name, types[i].name)) {
+            buf_type = types[i].type;
+            return true;
+        }
+    }
+    return false;
+}
 
-    for (int i=0,j=0; i<rgba_size; i+=4,j+=3) {
-        rgb[j] = rgba[i];
-        rgb[j+1] = rgba[i+1];
-        rgb[j+2] = rgba[i+2];
+bool
+is_planar(buffer_type buf_type)
+{
+    return buf_type == BUF_YUV420 || buf_type == BUF_NV12;
+}
+
+// For planar types this is the luma plane's bytes per pixel.
+int
+bytes_per_pixel(buffer_type buf_type)
+{
+    switch (buf_type) {
+    case BUF_YUV420:
+    case BUF_NV12:
+        return 1;
+    case BUF_RGB565:
+        return 2;
+    case BUF_RGB:
+    case BUF_BGR:
+        return 3;
+    case BUF_RGBA:
+    case BUF_BGRA:
+    case BUF_RGBX:
+    case BUF_BGRX:
+    case BUF_XRGB:
+    case BUF_ARGB:
+        return 4;
+    default:
+        throw "Unexpected buf_type in bytes_per_pixel";
     }
-    return rgb;
 }
 
-unsigned char *
-bgra_to_rgb(const unsigned char *bgra, int bgra_size)
+static size_t
+chroma_stride(buffer_type buf_type, size_t stride)
 {
-    assert(bgra_size%4==0);
+    // I420 chroma planes are half as wide, NV12's UV plane holds two
+    // samples per chroma pixel
+    return buf_type == BUF_NV12 ? (stride + 1) & ~(size_t)1 : (stride + 1)/2;
+}
 
-    int rgb_size = bgra_size*3/4;
-    unsigned char *rgb = (unsigned char *)malloc(sizeof(*rgb)*rgb_size);
-    if (!rgb) return NULL;
+// Bytes spanned by h rows of w pixels that are stride bytes apart
+// (0 means tightly packed). Planar types include their chroma planes.
+size_t
+image_span(int w, int h, buffer_type buf_type, size_t stride)
+{
+    size_t row = (size_t)w*bytes_per_pixel(buf_type);
+    if (h == 0) return 0;
+    if (!stride) stride = row;
 
-    for (int i=0,j=0; i<bgra_size; i+=4,j+=3) {
-        rgb[j] = bgra[i+2];
-        rgb[j+1] = bgra[i+1];
-        rgb[j+2] = bgra[i];
+    if (is_planar(buf_type)) {
+        size_t chroma_rows = (h + 1)/2;
+        size_t planes = buf_type == BUF_NV12 ? 1 : 2;
+        return (size_t)h*stride + planes*chroma_rows*chroma_stride(buf_type, stride);
     }
-    return rgb;
+    return (size_t)(h - 1)*stride + row;
 }
 
-unsigned char *
-bgr_to_rgb(const unsigned char *bgr, int bgr_size)
+YuvPlanes::YuvPlanes(const unsigned char *data, int w, int h, buffer_type buf_type,
+    size_t stride)
 {
-    assert(bgr_size%3==0);
+    y_stride = stride ? stride : (size_t)w;
+    uv_stride = chroma_stride(buf_type, y_stride);
+    y = data;
+    if (buf_type == BUF_NV12) {
+        u = data + (size_t)h*y_stride;
+        v = u + 1;
+        uv_step = 2;
+    }
+    else {
+        u = data + (size_t)h*y_stride;
+        v = u + (size_t)((h + 1)/2)*uv_stride;
+        uv_step = 1;
+    }
+}
 
-    unsigned char *rgb = (unsigned char *)malloc(sizeof(*rgb)*bgr_size);
-    if (!rgb) return NULL;
+static inline unsigned char
+clamp_sample(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
 
-    for (int i=0; i<bgr_size; i+=3) {
-        rgb[i] = bgr[i+2];
-        rgb[i+1] = bgr[i+1];
-        rgb[i+2] = bgr[i];
+// JFIF YCbCr -> RGB in 16.16 fixed point, for `pixels' pixels of row y
+// starting at column x.
+void
+yuv_row_to_rgb(const YuvPlanes &planes, int x, int y, int pixels, unsigned char *rgb)
+{
+    const unsigned char *yrow = planes.y + (size_t)y*planes.y_stride;
+    const unsigned char *urow = planes.u + (size_t)(y/2)*planes.uv_stride;
+    const unsigned char *vrow = planes.v + (size_t)(y/2)*planes.uv_stride;
+
+    for (int i = x; i < x + pixels; i++) {
+        int yy = yrow[i] << 16;
+        int cb = urow[(i/2)*planes.uv_step] - 128;
+        int cr = vrow[(i/2)*planes.uv_step] - 128;
+
+        *rgb++ = clamp_sample((yy + 91881*cr + 32768) >> 16);
+        *rgb++ = clamp_sample((yy - 22554*cb - 46802*cr + 32768) >> 16);
+        *rgb++ = clamp_sample((yy + 116130*cb + 32768) >> 16);
     }
-    return rgb;
 }
 
+// Converts a single row of `pixels' pixels of a packed buf_type to RGB.
+void
+row_to_rgb(const unsigned char *src, unsigned char *rgb, int pixels, buffer_type buf_type)
+{
+    switch (buf_type) {
+    case BUF_RGB:
+        memcpy(rgb, src, (size_t)pixels*3);
+        break;
+
+    case BUF_BGR:
+        for (int i = 0; i < pixels; i++, src += 3) {
+            *rgb++ = src[2];
+            *rgb++ = src[1];
+            *rgb++ = src[0];
+        }
+        break;
+
+    case BUF_RGBA:
+    case BUF_RGBX:
+        for (int i = 0; i < pixels; i++, src += 4) {
+            *rgb++ = src[0];
+            *rgb++ = src[1];
+            *rgb++ = src[2];
+        }
+        break;
+
+    case BUF_BGRA:
+    case BUF_BGRX:
+        for (int i = 0; i < pixels; i++, src += 4) {
+            *rgb++ = src[2];
+            *rgb++ = src[1];
+            *rgb++ = src[0];
+        }
+        break;
+
+    case BUF_XRGB:
+    case BUF_ARGB:
+        for (int i = 0; i < pixels; i++, src += 4) {
+            *rgb++ = src[1];
+            *rgb++ = src[2];
+            *rgb++ = src[3];
+        }
+        break;
+
+    case BUF_RGB565:
+        // little endian, 5 bits red in the high bits
+        for (int i = 0; i < pixels; i++, src += 2) {
+            unsigned int v = src[0] | (src[1] << 8);
+            unsigned int r = v >> 11, g = (v >> 5) & 0x3f, b = v & 0x1f;
+            *rgb++ = (r << 3) | (r >> 2);
+            *rgb++ = (g << 2) | (g >> 4);
+            *rgb++ = (b << 3) | (b >> 2);
+        }
+        break;
+
+    default:
+        throw "Unexpected buf_type in row_to_rgb";
+    }
+}
@@ -18,12 +18,38 @@ struct Rect {
     bool isNull() { return x == 0 && y == 0 && w == 0 && h == 0; }
 };
 
+// Largest Buffer we hand back to JS; anything bigger has to go to a file.
+#define MAX_BUFFER_LENGTH 0x3fffffff
+
 bool str_eq(const char *s1, const char *s2);
-unsigned char *rgba_to_rgb(const unsigned char *rgba, int rgba_size);
-unsigned char *bgra_to_rgb(const unsigned char *rgba, int bgra_size);
-unsigned char *bgr_to_rgb(const unsigned char *rgb, int rgb_size);
 
-typedef enum { BUF_RGB, BUF_BGR, BUF_RGBA, BUF_BGRA } buffer_type;
+typedef enum {
+    BUF_RGB, BUF_BGR, BUF_RGBA, BUF_BGRA,
+    BUF_RGBX, BUF_BGRX, BUF_XRGB, BUF_ARGB,
+    BUF_RGB565,
+    BUF_YUV420, BUF_NV12 // planar, full range (JFIF) YCbCr 4:2:0
+} buffer_type;
+
+#define BUFFER_TYPES "'rgb', 'bgr', 'rgba', 'bgra', 'rgbx', 'bgrx', 'xrgb', 'argb', 'rgb565', 'yuv420' or 'nv12'"
+
+bool parse_buffer_type(const char *name, buffer_type &buf_type);
+bool is_planar(buffer_type buf_type);
+int bytes_per_pixel(buffer_type buf_type);
+size_t image_span(int w, int h, buffer_type buf_type, size_t stride);
+void row_to_rgb(const unsigned char *src, unsigned char *rgb, int pixels, buffer_type buf_type);
+
+// Planes of a YUV420 (I420) or NV12 buffer. The Y plane (h rows, stride
+// bytes apart) is followed by the half resolution chroma: separate U and V
+// planes for YUV420, one interleaved UV plane for NV12.
+struct YuvPlanes {
+    const unsigned char *y, *u, *v;
+    size_t y_stride, uv_stride;
+    int uv_step; // distance between chroma samples of one plane
+
+    YuvPlanes(const unsigned char *data, int w, int h, buffer_type buf_type, size_t stride);
+};
+
+void yuv_row_to_rgb(const YuvPlanes &planes, int x, int y, int pixels, unsigned char *rgb);
 
 #endif
 
@@ -0,0 +1,223 @@
+#include <pthread.h>
+
+#include "dct_image.h"
+#include "jpeg_transform.h"
+
+// Scale of each output of the AA&N transform below relative to the true
+// DCT coefficient, folded back in once per block.
+static float aan_scale[DCTSIZE2];
+static pthread_once_t aan_scale_once = PTHREAD_ONCE_INIT;
+
+static void
+init_aan_scale()
+{
+    static const double factor[DCTSIZE] = {
+        1.0, 1.387039845, 1.306562965, 1.175875602,
+        1.0, 0.785694958, 0.541196100, 0.275899379
+    };
+    for (int v = 0; v < DCTSIZE; v++) {
+        for (int u = 0; u < DCTSIZE; u++)
+            aan_scale[v*DCTSIZE + u] = (float)(1.0/(factor[v]*factor[u]*8.0));
+    }
+}
+
+// One dimensional AA&N forward DCT of 8 values d[0], d[step], ..., the
+// same algorithm as libjpeg's jfdctflt.c.
+static inline void
+aan_fdct_1d(float *d, int step)
+{
+    float tmp0 = d[0] + d[7*step], tmp7 = d[0] - d[7*step];
+    float tmp1 = d[step] + d[6*step], tmp6 = d[step] - d[6*step];
+    float tmp2 = d[2*step] + d[5*step], tmp5 = d[2*step] - d[5*step];
+    float tmp3 = d[3*step] + d[4*step], tmp4 = d[3*step] - d[4*step];
+
+    // even part
+    float tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+    float tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+    d[0] = tmp10 + tmp11;
+    d[4*step] = tmp10 - tmp11;
+    float z1 = (tmp12 + tmp13)*0.707106781f;
+    d[2*step] = tmp13 + z1;
+    d[6*step] = tmp13 - z1;
+
+    // odd part
+    tmp10 = tmp4 + tmp5;
+    tmp11 = tmp5 + tmp6;
+    tmp12 = tmp6 + tmp7;
+    float z5 = (tmp10 - tmp12)*0.382683433f;
+    float z2 = 0.541196100f*tmp10 + z5;
+    float z4 = 1.306562965f*tmp12 + z5;
+    float z3 = tmp11*0.707106781f;
+    float z11 = tmp7 + z3, z13 = tmp7 - z3;
+    d[5*step] = z13 + z2;
+    d[3*step] = z13 - z2;
+    d[step] = z11 + z4;
+    d[7*step] = z11 - z4;
+}
+
+// 8x8 forward DCT of samples that src rows are stride floats apart,
+// level shifted on the way in.
+static void
+fdct_block(const float *src, int stride, float *out)
+{
+    for (int y = 0; y < DCTSIZE; y++) {
+        for (int x = 0; x < DCTSIZE; x++)
+            out[y*DCTSIZE + x] = src[y*stride + x] - CENTERJSAMPLE;
+        aan_fdct_1d(out + y*DCTSIZE, 1);
+    }
+    for (int x = 0; x < DCTSIZE; x++)
+        aan_fdct_1d(out + x, DCTSIZE);
+    for (int k = 0; k < DCTSIZE2; k++)
+        out[k] *= aan_scale[k];
+}
+
+// Reads the image one MCU row (16 pixel rows) at a time. Each row is
+// converted to YCbCr with libjpeg's coefficients, the chroma of the strip
+// is averaged down 2x2 and every block of the strip is transformed.
+DctImage::DctImage(JpegRowSource &rows, int wwidth, int hheight) :
+    width(wwidth), height(hheight)
+{
+    if (width <= 0 || height <= 0)
+        throw "Image to transform is empty.";
+    pthread_once(&aan_scale_once, init_aan_scale);
+
+    for (int ci = 0; ci < 3; ci++) {
+        int samp = ci == 0 ? 2 : 1;
+        blocks_w[ci] = comp_blocks(width, samp, 2);
+        blocks_h[ci] = comp_blocks(height, samp, 2);
+        coefs[ci].resize((size_t)blocks_w[ci]*blocks_h[ci]*DCTSIZE2);
+    }
+
+    int pw = blocks_w[0]*DCTSIZE; // padded luma width, a multiple of 16
+    int mcu_rows = blocks_h[0]/2;
+    std::vector<float> full[3]; // 16 rows of Y, Cb and Cr
+    for (int ci = 0; ci < 3; ci++) full[ci].resize((size_t)pw*16);
+    std::vector<float> chroma[2]; // 8 rows of subsampled Cb and Cr
+    for (int ci = 0; ci < 2; ci++) chroma[ci].resize((size_t)pw/2*8);
+
+    for (int m = 0; m < mcu_rows; m++) {
+        for (int r = 0; r < 16; r++) {
+            int y = m*16 + r;
+            if (y > height - 1) y = height - 1;
+            const unsigned char *rgb = rows.get_row(0, y, width);
+
+            float *py = &full[0][(size_t)r*pw];
+            float *pcb = &full[1][(size_t)r*pw];
+            float *pcr = &full[2][(size_t)r*pw];
+            for (int x = 0; x < pw; x++) {
+                const unsigned char *p = rgb + (x < width ? x : width - 1)*3;
+                float R = p[0], G = p[1], B = p[2];
+                py[x] = 0.29900f*R + 0.58700f*G + 0.11400f*B;
+                pcb[x] = -0.16874f*R - 0.33126f*G + 0.50000f*B + CENTERJSAMPLE;
+                pcr[x] = 0.50000f*R - 0.41869f*G - 0.08131f*B + CENTERJSAMPLE;
+            }
+        }
+
+        for (int ci = 0; ci < 2; ci++) {
+            for (int r = 0; r < 8; r++) {
+                const float *a = &full[ci + 1][(size_t)2*r*pw];
+                const float *b = a + pw;
+                float *out = &chroma[ci][(size_t)r*pw/2];
+                for (int x = 0; x < pw/2; x++)
+                    out[x] = (a[2*x] + a[2*x + 1] + b[2*x] + b[2*x + 1])*0.25f;
+            }
+        }
+
+        transform_strip(&full[0][0], 0, m);
+        transform_strip(&chroma[0][0], 1, m);
+        transform_strip(&chroma[1][0], 2, m);
+    }
+}
+
+// Transforms the blocks of component ci that come from MCU row m, whose
+// samples are in plane.
+void
+DctImage::transform_strip(const float *plane, int ci, int m)
+{
+    int block_rows = ci == 0 ? 2 : 1;
+    int stride = blocks_w[ci]*DCTSIZE;
+
+    for (int r = 0; r < block_rows; r++) {
+        int by = m*block_rows + r;
+        const float *src = plane + (size_t)r*DCTSIZE*stride;
+        float *out = &coefs[ci][(size_t)by*blocks_w[ci]*DCTSIZE2];
+        for (int bx = 0; bx < blocks_w[ci]; bx++)
+            fdct_block(src + bx*DCTSIZE, stride, out + (size_t)bx*DCTSIZE2);
+    }
+}
+
+int
+DctImage::get_width() const
+{
+    return width;
+}
+
+int
+DctImage::get_height() const
+{
+    return height;
+}
+
+size_t
+DctImage::allocated_bytes() const
+{
+    return (coefs[0].size() + coefs[1].size() + coefs[2].size())*sizeof(float);
+}
+
+// Rounds half away from zero, like libjpeg's quantizer.
+void
+DctImage::quantize_row(int ci, int by, const UINT16 *quant, JBLOCKROW out) const
+{
+    float recip[DCTSIZE2];
+    for (int k = 0; k < DCTSIZE2; k++) recip[k] = 1.0f/quant[k];
+
+    const float *in = &coefs[ci][(size_t)by*blocks_w[ci]*DCTSIZE2];
+    for (int bx = 0; bx < blocks_w[ci]; bx++, in += DCTSIZE2) {
+        JCOEFPTR block = out[bx];
+        for (int k = 0; k < DCTSIZE2; k++) {
+            float q = in[k]*recip[k];
+            block[k] = (JCOEF)(q < 0 ? -(int)(0.5f - q) : (int)(q + 0.5f));
+        }
+    }
+}
+
+void
+QuantizedDct::write_coefficients(j_compress_ptr cinfo, int x, int y, int w, int h)
+{
+    if (x || y || w != image.get_width() || h != image.get_height())
+        throw "A transformed image can only be encoded whole.";
+
+    cinfo->image_width = w;
+    cinfo->image_height = h;
+    cinfo->input_components = 3;
+    cinfo->in_color_space = JCS_RGB;
+    jpeg_set_defaults(cinfo); // YCbCr, 2x2 luma, what DctImage assumes
+    jpeg_set_quality(cinfo, quality, TRUE);
+    if (progressive) jpeg_simple_progression(cinfo);
+
+    // libjpeg keeps this pointer until jpeg_finish_compress, so it can't
+    // live on our stack
+    jvirt_barray_ptr *arrays = (jvirt_barray_ptr *)(*cinfo->mem->alloc_small)
+        ((j_common_ptr)cinfo, JPOOL_IMAGE, sizeof(jvirt_barray_ptr)*3);
+    for (int ci = 0; ci < 3; ci++) {
+        jpeg_component_info *comp = cinfo->comp_info + ci;
+        arrays[ci] = (*cinfo->mem->request_virt_barray)
+            ((j_common_ptr)cinfo, JPOOL_IMAGE, FALSE,
+             comp_blocks(w, comp->h_samp_factor, 2),
+             comp_blocks(h, comp->v_samp_factor, 2), comp->v_samp_factor);
+    }
+
+    // realizes the arrays; nothing is coded before jpeg_finish_compress
+    jpeg_write_coefficients(cinfo, arrays);
+
+    for (int ci = 0; ci < 3; ci++) {
+        jpeg_component_info *comp = cinfo->comp_info + ci;
+        const UINT16 *quant = cinfo->quant_tbl_ptrs[comp->quant_tbl_no]->quantval;
+        int bh = comp_blocks(h, comp->v_samp_factor, 2);
+        for (int by = 0; by < bh; by++) {
+            JBLOCKARRAY row = (*cinfo->mem->access_virt_barray)
+                ((j_common_ptr)cinfo, arrays[ci], by, 1, TRUE);
+            image.quantize_row(ci, by, quant, row[0]);
+        }
+    }
+}
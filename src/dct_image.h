@@ -0,0 +1,47 @@
+#ifndef DCT_IMAGE_H
+#define DCT_IMAGE_H
+
+#include <vector>
+
+#include "common.h"
+#include "jpeg_encoder.h"
+
+// Forward DCT of an RGB image, computed the way libjpeg's default pipeline
+// does it (YCbCr, 2x2 subsampled chroma, edges padded to whole MCUs by
+// repeating the last pixel) but left unquantized. The same transform can
+// then be written at any number of qualities with only quantization and
+// entropy coding repeated, see QuantizedDct.
+class DctImage {
+    int width, height;
+    int blocks_w[3], blocks_h[3];
+    std::vector<float> coefs[3]; // DCTSIZE2 per block, natural order
+
+    void transform_strip(const float *plane, int ci, int m);
+
+public:
+    DctImage(JpegRowSource &rows, int wwidth, int hheight);
+
+    int get_width() const;
+    int get_height() const;
+    size_t allocated_bytes() const;
+
+    // Quantizes the blocks of component ci with the natural order table
+    // quant into a row of libjpeg blocks.
+    void quantize_row(int ci, int by, const UINT16 *quant, JBLOCKROW out) const;
+};
+
+// Hands a DctImage to JpegEncoder quantized for one quality.
+class QuantizedDct : public JpegCoefSource {
+    const DctImage &image;
+    int quality;
+    bool progressive;
+
+public:
+    QuantizedDct(const DctImage &iimage, int qquality, bool pprogressive) :
+        image(iimage), quality(qquality), progressive(pprogressive) {}
+
+    void write_coefficients(j_compress_ptr cinfo, int x, int y, int w, int h);
+};
+
+#endif
+
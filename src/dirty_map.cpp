@@ -0,0 +1,50 @@
+#include "dirty_map.h"
+
+DirtyMap::DirtyMap(int wwidth, int hheight)
+{
+    resize(wwidth, hheight);
+}
+
+void
+DirtyMap::resize(int wwidth, int hheight)
+{
+    width = wwidth;
+    height = hheight;
+    cells_x = (width + CELL - 1)/CELL;
+    cells_y = (height + CELL - 1)/CELL;
+    cells.assign((size_t)cells_x*cells_y, true);
+}
+
+void
+DirtyMap::mark(int x, int y, int w, int h)
+{
+    if (w <= 0 || h <= 0) return;
+    for (int cy = y/CELL; cy <= (y + h - 1)/CELL && cy < cells_y; cy++) {
+        for (int cx = x/CELL; cx <= (x + w - 1)/CELL && cx < cells_x; cx++)
+            cells[(size_t)cy*cells_x + cx] = true;
+    }
+}
+
+void
+DirtyMap::mark_all()
+{
+    cells.assign(cells.size(), true);
+}
+
+void
+DirtyMap::clear()
+{
+    cells.assign(cells.size(), false);
+}
+
+bool
+DirtyMap::any(int x, int y, int w, int h) const
+{
+    if (w <= 0 || h <= 0) return false;
+    for (int cy = y/CELL; cy <= (y + h - 1)/CELL && cy < cells_y; cy++) {
+        for (int cx = x/CELL; cx <= (x + w - 1)/CELL && cx < cells_x; cx++) {
+            if (cells[(size_t)cy*cells_x + cx]) return true;
+        }
+    }
+    return false;
+}
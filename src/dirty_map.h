@@ -0,0 +1,28 @@
+#ifndef DIRTY_MAP_H
+#define DIRTY_MAP_H
+
+#include <cstddef>
+#include <vector>
+
+// Which parts of a canvas changed, in CELL x CELL cells. Anything that only
+// touches part of a cell marks all of it, so an area reads as changed a
+// little more often than it did, never less.
+class DirtyMap {
+    int width, height;
+    int cells_x, cells_y;
+    std::vector<bool> cells;
+
+public:
+    static const int CELL = 16;
+
+    DirtyMap(int wwidth, int hheight);
+
+    void resize(int wwidth, int hheight); // and mark everything
+    void mark(int x, int y, int w, int h);
+    void mark_all();
+    void clear();
+    bool any(int x, int y, int w, int h) const;
+};
+
+#endif
+
@@ -6,7 +6,12 @@
 
 #include "common.h"
 #include "dynamic_jpeg_stack.h"
+#include "background.h"
 #include "jpeg_encoder.h"
+#include "js_args.h"
+#include "mapped_file.h"
+#include "shared_memory.h"
+#include "scan_emitter.h"
 
 using namespace v8;
 using namespace node;
@@ -20,22 +25,34 @@ DynamicJpegStack::Initialize(v8::Handle<v8::Object> target)
     t->InstanceTemplate()->SetInternalFieldCount(1);
     NODE_SET_PROTOTYPE_METHOD(t, "encode", JpegEncodeAsync);
     NODE_SET_PROTOTYPE_METHOD(t, "encodeSync", JpegEncodeSync);
+    NODE_SET_PROTOTYPE_METHOD(t, "encodeToFile", JpegEncodeToFileAsync);
     NODE_SET_PROTOTYPE_METHOD(t, "push", Push);
+    NODE_SET_PROTOTYPE_METHOD(t, "pushJpeg", PushJpeg);
     NODE_SET_PROTOTYPE_METHOD(t, "reset", Reset);
     NODE_SET_PROTOTYPE_METHOD(t, "setBackground", SetBackground);
+    NODE_SET_PROTOTYPE_METHOD(t, "copyRect", CopyRect);
+    NODE_SET_PROTOTYPE_METHOD(t, "setSolidBackground", SetSolidBackground);
     NODE_SET_PROTOTYPE_METHOD(t, "setQuality", SetQuality);
+    NODE_SET_PROTOTYPE_METHOD(t, "setProgressive", SetProgressive);
+    NODE_SET_PROTOTYPE_METHOD(t, "setMetrics", SetMetrics);
+    NODE_SET_PROTOTYPE_METHOD(t, "getMetrics", GetMetrics);
+    NODE_SET_PROTOTYPE_METHOD(t, "getStats", GetStats);
+    NODE_SET_PROTOTYPE_METHOD(t, "resetStats", ResetStats);
+    NODE_SET_PROTOTYPE_METHOD(t, "dispose", Dispose);
     NODE_SET_PROTOTYPE_METHOD(t, "dimensions", Dimensions);
     target->Set(String::NewSymbol("DynamicJpegStack"), t->GetFunction());
 }
 
 DynamicJpegStack::DynamicJpegStack(buffer_type bbuf_type) :
-    quality(60), buf_type(bbuf_type),
+    quality(60), progressive(false), buf_type(bbuf_type),
     dyn_rect(-1, -1, 0, 0),
-    bg_width(0), bg_height(0), data(NULL) {}
+    bg_width(0), bg_height(0), canvas(NULL), measure(false), pending(0), disposed(false),
+    coefs(NULL) {}
 
 DynamicJpegStack::~DynamicJpegStack()
 {
-    free(data);
+    delete canvas;
+    delete coefs;
 }
 
 void
@@ -65,13 +82,32 @@ DynamicJpegStack::JpegEncodeSync()
 {
     NanScope();
 
+    if (!canvas)
+        return ThrowException(Exception::Error(String::New("No background has been set, use setBackground or setSolidBackground to set.")));
+
     try {
-        JpegEncoder jpeg_encoder(data, bg_width, bg_height, quality, BUF_RGB);
+        CanvasRowSource rows(*canvas);
+        JpegEncoder jpeg_encoder(&rows, bg_width, bg_height, quality);
         jpeg_encoder.setRect(Rect(dyn_rect.x, dyn_rect.y, dyn_rect.w, dyn_rect.h));
+        if (coefs) jpeg_encoder.set_coef_source(coefs);
+        EncodeStats run;
+        EncodeStats *run_stats = stats_enabled() ? &run : NULL;
+        jpeg_encoder.set_progressive(progressive);
+        ImageMetrics run_metrics;
+        jpeg_encoder.set_metrics(measure ? &run_metrics : NULL);
+        jpeg_encoder.set_stats(run_stats);
         jpeg_encoder.encode();
-        int jpeg_len = jpeg_encoder.get_jpeg_len();
+        unsigned long jpeg_len = jpeg_encoder.get_jpeg_len();
+        if (jpeg_len > MAX_BUFFER_LENGTH)
+            throw "Encoded JPEG is too large for a Buffer.";
+        uint64_t t0 = run_stats ? stats_clock() : 0;
         Local<Object> retbuf = NanNewBufferHandle(jpeg_len);
         memcpy(Buffer::Data(retbuf), jpeg_encoder.get_jpeg(), jpeg_len);
+        if (run_metrics.valid) metrics = run_metrics;
+        if (run_stats) {
+            run.copy_ns += stats_clock() - t0;
+            AddStats(run);
+        }
         return scope.Close(retbuf);
     }
     catch (const char *err) {
@@ -80,98 +116,113 @@ DynamicJpegStack::JpegEncodeSync()
 }
 
 void
-DynamicJpegStack::Push(unsigned char *data_buf, int x, int y, int w, int h)
+DynamicJpegStack::Push(unsigned char *data_buf, int x, int y, int w, int h, size_t stride,
+    blend_mode blend, const ScaleOptions &scale)
 {
-    update_optimal_dimension(x, y, w, h);
-
-    int start = y*bg_width*3 + x*3;
+    if (scale.enabled()) {
+        update_optimal_dimension(x, y, scale.width, scale.height);
+        canvas->push_scaled(data_buf, buf_type, x, y, w, h, stride, scale, blend);
+    }
+    else {
+        update_optimal_dimension(x, y, w, h);
+        canvas->push(data_buf, buf_type, x, y, w, h, stride, blend);
+    }
+    UpdateMemory();
+}
 
-    switch (buf_type) {
-    case BUF_RGB:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*bg_width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-            }
-        }
-        break;
-
-    case BUF_BGR:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*bg_width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *(data_buf+2);
-                *datap++ = *(data_buf+1);
-                *datap++ = *data_buf;
-                data_buf+=3;
-            }
-        }
-        break;
-
-    case BUF_RGBA:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*bg_width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-                data_buf++;
-            }
-        }
-        break;
-
-    case BUF_BGRA:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*bg_width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *(data_buf+2);
-                *datap++ = *(data_buf+1);
-                *datap++ = *data_buf;
-                data_buf += 4;
-            }
-        }
-        break;
+// Pushes a fragment of a frame in shared memory. A torn plain copy is
+// simply pushed again, but blending can't be redone over itself, so blended
+// fragments are copied out of a complete frame first.
+void
+DynamicJpegStack::PushShared(const SharedRegion *region, size_t start, size_t span,
+    int x, int y, int w, int h, size_t stride, blend_mode blend, const ScaleOptions &scale)
+{
+    if (blend != BLEND_NONE && region->has_seqlock()) {
+        std::vector<unsigned char> frame;
+        region->snapshot(start, span, frame);
+        Push(span ? &frame[0] : NULL, x, y, w, h, stride, blend, scale);
+        return;
+    }
 
-    default:
-        throw "Unexpected buf_type in DynamicJpegStack::Push";
+    for (int i = 0; ; i++) {
+        uint32_t gen = region->begin_read();
+        Push((unsigned char *)region->data() + start, x, y, w, h, stride, blend, scale);
+        if (region->end_read(gen)) return;
+        if (i + 1 == SharedRegion::MAX_READS)
+            throw "Shared frame kept changing while it was pushed.";
     }
 }
 
 void
-DynamicJpegStack::SetBackground(unsigned char *data_buf, int w, int h)
+DynamicJpegStack::PushJpeg(const unsigned char *jpeg, size_t len, int x, int y)
 {
-    if (data) {
-        free(data);
-        data = NULL;
+    if (!coefs) {
+        // untouched MCUs get the background's colour
+        unsigned char fill[3];
+        canvas->fill_pixels(fill, 1);
+        coefs = new CoefCanvas(bg_width, bg_height, fill[0], fill[1], fill[2]);
     }
 
-    switch (buf_type) {
-    case BUF_RGB:
-        data = (unsigned char *)malloc(sizeof(*data)*w*h*3);
-        if (!data) throw "malloc failed in DynamicJpegStack::SetBackground";
-        memcpy(data, data_buf, w*h*3);
-        break;
+    int w, h;
+    try {
+        coefs->push_jpeg(jpeg, len, x, y, w, h);
+    }
+    catch (...) {
+        // a first tile that couldn't be read leaves the stack as it was
+        if (!coefs->mcu_width()) {
+            delete coefs;
+            coefs = NULL;
+        }
+        throw;
+    }
+    update_optimal_dimension(x, y, w, h);
+    UpdateMemory();
+}
 
-    case BUF_BGR:
-        data = bgr_to_rgb(data_buf, w*h*3);
-        if (!data) throw "malloc failed in DynamicJpegStack::SetBackground";
-        break;
+void
+DynamicJpegStack::SetBackground(unsigned char *data_buf, int w, int h, size_t stride)
+{
+    SetSolidBackground(0, 0, 0, w, h);
+    canvas->push(data_buf, buf_type, 0, 0, w, h, stride);
+    UpdateMemory();
+}
 
-    case BUF_RGBA:
-        data = rgba_to_rgb(data_buf, w*h*4);
-        if (!data) throw "malloc failed in DynamicJpegStack::SetBackground";
-        break;
+// Only the destination changed, so it's all the dynamic rect has to grow by.
+void
+DynamicJpegStack::CopyRect(const Rect &src, int dst_x, int dst_y)
+{
+    canvas->copy_rect(src.x, src.y, src.w, src.h, dst_x, dst_y);
+    if (src.w && src.h)
+        update_optimal_dimension(dst_x, dst_y, src.w, src.h);
+    UpdateMemory();
+}
 
-    case BUF_BGRA:
-        data = bgra_to_rgb(data_buf, w*h*4);
-        if (!data) throw "malloc failed in DynamicJpegStack::SetBackground";
-        break;
+// Layers a private canvas over base, tiles are copied as they're pushed over.
+void
+DynamicJpegStack::SetSharedBackground(const TiledCanvas *base)
+{
+    TiledCanvas *new_canvas = new TiledCanvas(base);
+    delete canvas;
+    canvas = new_canvas;
+    delete coefs;
+    coefs = NULL;
+    UpdateMemory();
+
+    bg_width = base->get_width();
+    bg_height = base->get_height();
+}
+
+void
+DynamicJpegStack::SetSolidBackground(unsigned char r, unsigned char g, unsigned char b,
+    int w, int h)
+{
+    TiledCanvas *new_canvas = new TiledCanvas(w, h, r, g, b);
+    delete canvas;
+    canvas = new_canvas;
+    delete coefs;
+    coefs = NULL;
+    UpdateMemory();
 
-    default:
-        throw "Unexpected buf_type in DynamicJpegStack::SetBackground";
-    }
     bg_width = w;
     bg_height = h;
 }
@@ -182,6 +233,38 @@ DynamicJpegStack::SetQuality(int q)
     quality = q;
 }
 
+void
+DynamicJpegStack::SetProgressive(bool p)
+{
+    progressive = p;
+}
+
+void
+DynamicJpegStack::AddStats(const EncodeStats &run)
+{
+    stats.add(run);
+    add_global_stats(run);
+}
+
+void
+DynamicJpegStack::UpdateMemory()
+{
+    memory.set((canvas ? canvas->allocated_bytes() : 0) +
+        (coefs ? coefs->allocated_bytes() : 0));
+}
+
+// Frees the canvas now rather than whenever the GC gets to the object.
+void
+DynamicJpegStack::Dispose()
+{
+    delete canvas;
+    canvas = NULL;
+    delete coefs;
+    coefs = NULL;
+    disposed = true;
+    UpdateMemory();
+}
+
 void
 DynamicJpegStack::Reset()
 {
@@ -212,25 +295,11 @@ NAN_METHOD(DynamicJpegStack::New)
     buffer_type buf_type = BUF_RGB;
     if (args.Length() == 1) {
         if (!args[0]->IsString())
-            return NanThrowTypeError("First argument must be a string. Either 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return NanThrowTypeError("First argument must be a string. One of " BUFFER_TYPES ".");
 
         String::AsciiValue bt(args[0]->ToString());
-        if (!(str_eq(*bt, "rgb") || str_eq(*bt, "bgr") ||
-            str_eq(*bt, "rgba") || str_eq(*bt, "bgra")))
-        {
-            return NanThrowTypeError("Buffer type must be 'rgb', 'bgr', 'rgba' or 'bgra'.");
-        }
-
-        if (str_eq(*bt, "rgb"))
-            buf_type = BUF_RGB;
-        else if (str_eq(*bt, "bgr"))
-            buf_type = BUF_BGR;
-        else if (str_eq(*bt, "rgba"))
-            buf_type = BUF_RGBA;
-        else if (str_eq(*bt, "bgra"))
-            buf_type = BUF_BGRA;
-        else
-            return NanThrowTypeError("Buffer type wasn't 'rgb', 'bgr', 'rgba' or 'bgra'.");
+        if (!parse_buffer_type(*bt, buf_type))
+            return NanThrowTypeError("Buffer type must be " BUFFER_TYPES ".");
     }
 
     DynamicJpegStack *jpeg = new DynamicJpegStack(buf_type);
@@ -242,6 +311,9 @@ NAN_METHOD(DynamicJpegStack::JpegEncodeSync)
 {
     NanScope();
     DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+    if (jpeg->disposed)
+        return NanThrowError("DynamicJpegStack has been disposed.");
+
     NanReturnValue(jpeg->JpegEncodeSync());
 }
 
@@ -249,11 +321,14 @@ NAN_METHOD(DynamicJpegStack::Push)
 {
     NanScope();
 
-    if (args.Length() != 5)
-        return NanThrowError("Five arguments required - buffer, x, y, width, height.");
+    if (args.Length() != 5 && args.Length() != 6)
+        return NanThrowError("Five arguments required - buffer, x, y, width, height, [and options].");
 
-    if (!Buffer::HasInstance(args[0]))
-        return NanThrowTypeError("First argument must be Buffer.");
+    unsigned char *bytes = NULL;
+    size_t bytes_len = 0;
+    SharedMemory *shm = SharedMemory::FromValue(args[0]);
+    if (!shm && !args[0]->IsString() && !get_bytes(args[0], bytes, bytes_len))
+        return NanThrowTypeError("First argument must be a Buffer, typed array, ArrayBuffer, SharedMemory or path to a raw pixel file.");
     if (!args[1]->IsInt32())
         return NanThrowTypeError("Second argument must be integer x.");
     if (!args[2]->IsInt32())
@@ -264,11 +339,14 @@ NAN_METHOD(DynamicJpegStack::Push)
         return NanThrowTypeError("Fifth argument must be integer h.");
 
     DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+    if (jpeg->disposed)
+        return NanThrowError("DynamicJpegStack has been disposed.");
 
-    if (!jpeg->data)
+    if (!jpeg->canvas)
         return NanThrowError("No background has been set, use setBackground or setSolidBackground to set.");
+    if (jpeg->coefs)
+        return NanThrowError("Pixels can't be pushed onto a stack that JPEG tiles were pushed onto.");
 
-    Local<Object> data_buf = args[0]->ToObject();
     int x = args[1]->Int32Value();
     int y = args[2]->Int32Value();
     int w = args[3]->Int32Value();
@@ -282,16 +360,106 @@ NAN_METHOD(DynamicJpegStack::Push)
         return NanThrowRangeError("Width smaller than 0.");
     if (h < 0)
         return NanThrowRangeError("Height smaller than 0.");
+    SourceOptions src;
+    blend_mode blend = BLEND_NONE;
+    ScaleOptions scale;
+    if (args.Length() >= 6) {
+        const char *err = parse_source_options(args[5], src);
+        if (!err) err = parse_blend_option(args[5], jpeg->buf_type, blend);
+        if (!err) err = parse_scale_options(args[5], w, h, scale);
+        if (err) return NanThrowTypeError(err);
+    }
+    // area the fragment covers on the canvas
+    int cw = scale.enabled() ? scale.width : w;
+    int ch = scale.enabled() ? scale.height : h;
+
     if (x >= jpeg->bg_width)
         return NanThrowRangeError("Coordinate x exceeds DynamicJpegStack's background dimensions.");
     if (y >= jpeg->bg_height)
         return NanThrowRangeError("Coordinate y exceeds DynamicJpegStack's background dimensions.");
-    if (x+w > jpeg->bg_width)
+    if (x+cw > jpeg->bg_width)
         return NanThrowRangeError("Pushed fragment exceeds DynamicJpegStack's width.");
-    if (y+h > jpeg->bg_height)
+    if (y+ch > jpeg->bg_height)
         return NanThrowRangeError("Pushed fragment exceeds DynamicJpegStack's height.");
 
-    jpeg->Push((unsigned char *)Buffer::Data(data_buf), x, y, w, h);
+    size_t start, span;
+    const char *extent_err = source_extent(src, w, h, jpeg->buf_type, start, span);
+    if (extent_err) return NanThrowRangeError(extent_err);
+
+    try {
+        if (args[0]->IsString()) {
+            String::Utf8Value path(args[0]);
+            MappedFile mapping;
+            mapping.open(*path, start, span);
+            mapping.advise_sequential();
+            jpeg->Push((unsigned char *)mapping.data(), x, y, w, h, src.stride, blend, scale);
+        }
+        else if (shm) {
+            const SharedRegion *region = shm->get_region();
+            if (!region)
+                return NanThrowError("SharedMemory has been disposed.");
+            if (!extent_fits(start, span, region->size()))
+                return NanThrowRangeError("Shared memory is too small for the given width, height and buffer type.");
+            jpeg->PushShared(region, start, span, x, y, w, h, src.stride, blend, scale);
+        }
+        else {
+            if (!extent_fits(start, span, bytes_len))
+                return NanThrowRangeError("Buffer is too small for the given width, height and buffer type.");
+            jpeg->Push(bytes + start, x, y, w, h, src.stride, blend, scale);
+        }
+    }
+    catch (const char *err) {
+        return NanThrowError(err);
+    }
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(DynamicJpegStack::PushJpeg)
+{
+    NanScope();
+
+    if (args.Length() != 3)
+        return NanThrowError("Three arguments required - jpeg buffer, x, y.");
+    unsigned char *jpeg_data;
+    size_t jpeg_len;
+    if (!get_bytes(args[0], jpeg_data, jpeg_len))
+        return NanThrowTypeError("First argument must be a Buffer, typed array or ArrayBuffer with a JPEG.");
+    if (!args[1]->IsInt32())
+        return NanThrowTypeError("Second argument must be integer x.");
+    if (!args[2]->IsInt32())
+        return NanThrowTypeError("Third argument must be integer y.");
+
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+    if (jpeg->disposed)
+        return NanThrowError("DynamicJpegStack has been disposed.");
+
+    // encodes read the tile canvas, and a first tile that fails frees it
+    if (jpeg->pending)
+        return NanThrowError("Can't push JPEG tiles while an encode is running.");
+    if (!jpeg->canvas)
+        return NanThrowError("No background has been set, use setBackground or setSolidBackground to set.");
+    // JPEG tiles replace the pixel canvas, anything pushed there would be lost
+    if (!jpeg->coefs && jpeg->canvas->allocated_tiles())
+        return NanThrowError("JPEG tiles can't be pushed onto a stack that pixels were pushed onto.");
+    // and untouched MCUs are filled with a solid colour, not a shared image
+    if (jpeg->canvas->has_base())
+        return NanThrowError("JPEG tiles can't be pushed onto a Background, use setSolidBackground.");
+
+    int x = args[1]->Int32Value();
+    int y = args[2]->Int32Value();
+
+    if (x < 0)
+        return NanThrowRangeError("Coordinate x smaller than 0.");
+    if (y < 0)
+        return NanThrowRangeError("Coordinate y smaller than 0.");
+
+    try {
+        jpeg->PushJpeg(jpeg_data, jpeg_len, x, y);
+    }
+    catch (const char *err) {
+        return NanThrowError(err);
+    }
 
     NanReturnUndefined();
 }
@@ -300,17 +468,67 @@ NAN_METHOD(DynamicJpegStack::SetBackground)
 {
     NanScope();
 
-    if (args.Length() != 3)
-        return NanThrowError("Four arguments required - buffer, width, height");
-    if (!Buffer::HasInstance(args[0]))
-        return NanThrowTypeError("First argument must be Buffer.");
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+    if (jpeg->disposed)
+        return NanThrowError("DynamicJpegStack has been disposed.");
+    if (jpeg->pending)
+        return NanThrowError("Can't set the background while an encode is running.");
+
+    if (args.Length() == 1) {
+        Background *bg = Background::FromValue(args[0]);
+        if (!bg)
+            return NanThrowTypeError("First argument must be a Background (or buffer, width, height).");
+        if (!bg->get_canvas())
+            return NanThrowError("Background has been disposed.");
+
+        try {
+            jpeg->SetSharedBackground(bg->get_canvas());
+        }
+        catch (const char *err) {
+            return NanThrowError(err);
+        }
+
+        NanReturnUndefined();
+    }
+
+    if (args.Length() == 2) {
+        // virtual background, tiles get allocated as fragments are pushed
+        if (!args[0]->IsInt32())
+            return NanThrowTypeError("First argument must be integer width.");
+        if (!args[1]->IsInt32())
+            return NanThrowTypeError("Second argument must be integer height.");
+
+        int w = args[0]->Int32Value();
+        int h = args[1]->Int32Value();
+
+        if (w < 0)
+            return NanThrowRangeError("Width smaller than 0.");
+        if (h < 0)
+            return NanThrowRangeError("Height smaller than 0.");
+        if (w > JPEG_MAX_DIMENSION || h > JPEG_MAX_DIMENSION)
+            return NanThrowRangeError("Width and height can't be larger than 65500.");
+
+        try {
+            jpeg->SetSolidBackground(0, 0, 0, w, h);
+        }
+        catch (const char *err) {
+            return NanThrowError(err);
+        }
+
+        NanReturnUndefined();
+    }
+
+    if (args.Length() != 3 && args.Length() != 4)
+        return NanThrowError("Three arguments required - buffer, width, height, [and options] (or just width, height, or a Background)");
+    unsigned char *bytes;
+    size_t bytes_len;
+    if (!get_bytes(args[0], bytes, bytes_len))
+        return NanThrowTypeError("First argument must be a Buffer, typed array or ArrayBuffer.");
     if (!args[1]->IsInt32())
         return NanThrowTypeError("Second argument must be integer width.");
     if (!args[2]->IsInt32())
         return NanThrowTypeError("Third argument must be integer height.");
 
-    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
-    Local<Object> data_buf = args[0]->ToObject();
     int w = args[1]->Int32Value();
     int h = args[2]->Int32Value();
 
@@ -319,8 +537,98 @@ NAN_METHOD(DynamicJpegStack::SetBackground)
     if (h < 0)
         return NanThrowRangeError("Coordinate y smaller than 0.");
 
+    SourceOptions src;
+    if (args.Length() == 4) {
+        const char *err = parse_source_options(args[3], src);
+        if (err) return NanThrowTypeError(err);
+    }
+    size_t start, span;
+    const char *extent_err = source_extent(src, w, h, jpeg->buf_type, start, span);
+    if (extent_err) return NanThrowRangeError(extent_err);
+    if (!extent_fits(start, span, bytes_len))
+        return NanThrowRangeError("Buffer is too small for the given width, height and buffer type.");
+
     try {
-        jpeg->SetBackground((unsigned char *)Buffer::Data(data_buf), w, h);
+        jpeg->SetBackground(bytes + start, w, h, src.stride);
+    }
+    catch (const char *err) {
+        return NanThrowError(err);
+    }
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(DynamicJpegStack::CopyRect)
+{
+    NanScope();
+
+    if (args.Length() != 6)
+        return NanThrowError("Six arguments required - srcX, srcY, width, height, dstX, dstY");
+    for (int i = 0; i < 6; i++) {
+        if (!args[i]->IsInt32())
+            return NanThrowTypeError("Arguments must be integers srcX, srcY, width, height, dstX, dstY.");
+    }
+
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+    if (jpeg->disposed)
+        return NanThrowError("DynamicJpegStack has been disposed.");
+    if (!jpeg->canvas)
+        return NanThrowError("No background has been set, use setBackground or setSolidBackground to set.");
+    if (jpeg->coefs)
+        return NanThrowError("Pixels can't be copied on a stack that JPEG tiles were pushed onto.");
+
+    Rect src(args[0]->Int32Value(), args[1]->Int32Value(),
+        args[2]->Int32Value(), args[3]->Int32Value());
+    int dst_x = args[4]->Int32Value();
+    int dst_y = args[5]->Int32Value();
+
+    const char *err = check_copy_rect(src, dst_x, dst_y, jpeg->bg_width, jpeg->bg_height);
+    if (err) return NanThrowRangeError(err);
+
+    try {
+        jpeg->CopyRect(src, dst_x, dst_y);
+    }
+    catch (const char *err) {
+        return NanThrowError(err);
+    }
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(DynamicJpegStack::SetSolidBackground)
+{
+    NanScope();
+
+    if (args.Length() != 5)
+        return NanThrowError("Five arguments required - r, g, b, width, height");
+    for (int i = 0; i < 5; i++) {
+        if (!args[i]->IsInt32())
+            return NanThrowTypeError("Arguments must be integers r, g, b, width, height.");
+    }
+
+    int r = args[0]->Int32Value();
+    int g = args[1]->Int32Value();
+    int b = args[2]->Int32Value();
+    int w = args[3]->Int32Value();
+    int h = args[4]->Int32Value();
+
+    if (r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255)
+        return NanThrowRangeError("Colour components must be between 0 and 255.");
+    if (w < 0)
+        return NanThrowRangeError("Width smaller than 0.");
+    if (h < 0)
+        return NanThrowRangeError("Height smaller than 0.");
+    if (w > JPEG_MAX_DIMENSION || h > JPEG_MAX_DIMENSION)
+        return NanThrowRangeError("Width and height can't be larger than 65500.");
+
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+    if (jpeg->disposed)
+        return NanThrowError("DynamicJpegStack has been disposed.");
+    if (jpeg->pending)
+        return NanThrowError("Can't set the background while an encode is running.");
+
+    try {
+        jpeg->SetSolidBackground(r, g, b, w, h);
     }
     catch (const char *err) {
         return NanThrowError(err);
@@ -369,20 +677,109 @@ NAN_METHOD(DynamicJpegStack::SetQuality)
     NanReturnUndefined();
 }
 
+NAN_METHOD(DynamicJpegStack::SetProgressive)
+{
+    NanScope();
+
+    if (args.Length() != 1)
+        return NanThrowError("One argument required - progressive");
+
+    if (!args[0]->IsBoolean())
+        return NanThrowTypeError("First argument must be boolean progressive");
+
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+    jpeg->SetProgressive(args[0]->BooleanValue());
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(DynamicJpegStack::SetMetrics)
+{
+    NanScope();
+
+    if (args.Length() != 1)
+        return NanThrowError("One argument required - metrics");
+
+    if (!args[0]->IsBoolean())
+        return NanThrowTypeError("First argument must be boolean metrics");
+
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+    jpeg->measure = args[0]->BooleanValue();
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(DynamicJpegStack::GetMetrics)
+{
+    NanScope();
+
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+    if (!jpeg->metrics.valid)
+        NanReturnUndefined();
+    NanReturnValue(metrics_object(jpeg->metrics));
+}
+
+NAN_METHOD(DynamicJpegStack::GetStats)
+{
+    NanScope();
+
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+    NanReturnValue(stats_object(jpeg->stats));
+}
+
+NAN_METHOD(DynamicJpegStack::ResetStats)
+{
+    NanScope();
+
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+    jpeg->stats.reset();
+    NanReturnUndefined();
+}
+
+NAN_METHOD(DynamicJpegStack::Dispose)
+{
+    NanScope();
+
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+    if (jpeg->pending)
+        return NanThrowError("Can't dispose while an encode is running.");
+    jpeg->Dispose();
+    NanReturnUndefined();
+}
+
 
 void DynamicJpegStack::DynamicJpegEncodeWorker::Execute() {
+    started();
+    if (!jpeg_obj->canvas) {
+        errmsg = strdup("No background has been set, use setBackground or setSolidBackground to set.");
+        return;
+    }
+
     try {
         Rect &dyn_rect = jpeg_obj->dyn_rect;
-        JpegEncoder encoder(jpeg_obj->data, jpeg_obj->bg_width, jpeg_obj->bg_height, jpeg_obj->quality, BUF_RGB);
+        CanvasRowSource rows(*jpeg_obj->canvas);
+        JpegEncoder encoder(&rows, jpeg_obj->bg_width, jpeg_obj->bg_height, jpeg_obj->quality);
         encoder.setRect(Rect(dyn_rect.x, dyn_rect.y, dyn_rect.w, dyn_rect.h));
+        if (jpeg_obj->coefs) encoder.set_coef_source(jpeg_obj->coefs);
+        encoder.set_progressive(jpeg_obj->progressive);
+        encoder.set_scan_listener(scans);
+        encoder.set_metrics(jpeg_obj->measure ? &metrics : NULL);
+        encoder.set_stats(run_stats());
         encoder.encode();
         jpeg_len = encoder.get_jpeg_len();
+        if (jpeg_len > MAX_BUFFER_LENGTH)
+            throw "Encoded JPEG is too large for a Buffer.";
+        uint64_t t0 = run_stats() ? stats_clock() : 0;
         jpeg = (char *)malloc(sizeof(*jpeg)*jpeg_len);
         if (!jpeg) {
             errmsg = strdup("malloc in DynamicJpegStack::DynamicJpegEncodeWorker::Execute() failed.");
         }
         else {
             memcpy(jpeg, encoder.get_jpeg(), jpeg_len);
+            if (run_stats()) {
+                stats.copy_ns += stats_clock() - t0;
+                stats.allocations++;
+            }
         }
     }
     catch (const char *err) {
@@ -393,8 +790,13 @@ void DynamicJpegStack::DynamicJpegEncodeWorker::Execute() {
 void DynamicJpegStack::DynamicJpegEncodeWorker::HandleOKCallback() {
     NanScope();
 
+    finish_scans();
+    if (metrics.valid) jpeg_obj->metrics = metrics;
+
+    uint64_t t0 = run_stats() ? stats_clock() : 0;
     Local<Object> buf = NanNewBufferHandle(jpeg_len);
     memcpy(Buffer::Data(buf), jpeg, jpeg_len);
+    if (run_stats()) stats.copy_ns += stats_clock() - t0;
     Local<Value> argv[3] = {buf, jpeg_obj->Dimensions(), Undefined()};
 
     TryCatch try_catch; // don't quite see the necessity of this
@@ -408,11 +810,15 @@ void DynamicJpegStack::DynamicJpegEncodeWorker::HandleOKCallback() {
     free(jpeg);
     jpeg = NULL;
 
+    if (run_stats()) jpeg_obj->AddStats(stats);
+    jpeg_obj->pending--;
     jpeg_obj->Unref();
 }
 
 void DynamicJpegStack::DynamicJpegEncodeWorker::HandleErrorCallback() {
     NanScope();
+
+    finish_scans();
     Local<Value> argv[3] = {Undefined(), Undefined(), v8::Exception::Error(v8::String::New(errmsg))};
 
     TryCatch try_catch; // don't quite see the necessity of this
@@ -428,6 +834,8 @@ void DynamicJpegStack::DynamicJpegEncodeWorker::HandleErrorCallback() {
         jpeg = NULL;
     }
 
+    if (run_stats()) jpeg_obj->AddStats(stats);
+    jpeg_obj->pending--;
     jpeg_obj->Unref();
 }
 
@@ -435,18 +843,116 @@ NAN_METHOD(DynamicJpegStack::JpegEncodeAsync)
 {
     NanScope();
 
-    if (args.Length() != 1)
-        return NanThrowError("One argument required - callback function.");
+    if (args.Length() != 1 && args.Length() != 2)
+        return NanThrowError("One argument required - callback function, [and onScan function].");
 
     if (!args[0]->IsFunction())
         return NanThrowTypeError("First argument must be a function.");
+    if (args.Length() == 2 && !args[1]->IsFunction())
+        return NanThrowTypeError("Second argument must be a function.");
 
     Local<Function> callback = Local<Function>::Cast(args[0]);
     DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+    if (jpeg->disposed)
+        return NanThrowError("DynamicJpegStack has been disposed.");
+
+    DynamicJpegStack::DynamicJpegEncodeWorker *worker = new DynamicJpegStack::DynamicJpegEncodeWorker(new NanCallback(callback), jpeg);
+    if (args.Length() == 2)
+        worker->set_scans(new ScanEmitter(new NanCallback(Local<Function>::Cast(args[1]))));
+    NanAsyncQueueWorker(worker);
+
+    jpeg->Ref();
+    jpeg->pending++;
+
+    NanReturnUndefined();
+}
+
+void DynamicJpegStack::DynamicJpegEncodeToFileWorker::Execute() {
+    started();
+    if (!jpeg_obj->canvas) {
+        errmsg = strdup("No background has been set, use setBackground or setSolidBackground to set.");
+        return;
+    }
+
+    try {
+        Rect &dyn_rect = jpeg_obj->dyn_rect;
+        CanvasRowSource rows(*jpeg_obj->canvas);
+        JpegEncoder encoder(&rows, jpeg_obj->bg_width, jpeg_obj->bg_height, jpeg_obj->quality);
+        encoder.setRect(Rect(dyn_rect.x, dyn_rect.y, dyn_rect.w, dyn_rect.h));
+        if (jpeg_obj->coefs) encoder.set_coef_source(jpeg_obj->coefs);
+        encoder.set_progressive(jpeg_obj->progressive);
+        encoder.set_stats(run_stats());
+        encoder.encode_to_file(target);
+        jpeg_len = encoder.get_jpeg_len();
+    }
+    catch (const char *err) {
+        errmsg = strdup(err);
+    }
+}
+
+void DynamicJpegStack::DynamicJpegEncodeToFileWorker::HandleOKCallback() {
+    NanScope();
+
+    Local<Value> argv[3] = {Number::New(jpeg_len), jpeg_obj->Dimensions(), Undefined()};
+
+    TryCatch try_catch;
+
+    callback->Call(3, argv);
+
+    if (try_catch.HasCaught()) {
+        FatalException(try_catch);
+    }
+
+    if (run_stats()) jpeg_obj->AddStats(stats);
+    jpeg_obj->pending--;
+    jpeg_obj->Unref();
+}
+
+void DynamicJpegStack::DynamicJpegEncodeToFileWorker::HandleErrorCallback() {
+    NanScope();
+    Local<Value> argv[3] = {Undefined(), Undefined(), v8::Exception::Error(v8::String::New(errmsg))};
+
+    TryCatch try_catch;
+
+    callback->Call(3, argv);
+
+    if (try_catch.HasCaught()) {
+        FatalException(try_catch);
+    }
+
+    if (run_stats()) jpeg_obj->AddStats(stats);
+    jpeg_obj->pending--;
+    jpeg_obj->Unref();
+}
+
+NAN_METHOD(DynamicJpegStack::JpegEncodeToFileAsync)
+{
+    NanScope();
+
+    if (args.Length() != 2 && args.Length() != 3)
+        return NanThrowError("Two or three arguments required - path or fd, [options], callback function.");
+
+    if (!args[args.Length()-1]->IsFunction())
+        return NanThrowTypeError("Last argument must be a function.");
+
+    DynamicJpegStack *jpeg = ObjectWrap::Unwrap<DynamicJpegStack>(args.This());
+    if (jpeg->disposed)
+        return NanThrowError("DynamicJpegStack has been disposed.");
+
+    FileTarget target;
+    const char *err = parse_file_target(args[0],
+        args.Length() == 3 ? args[1] : Handle<Value>(Undefined()), target);
+    if (err) {
+        free(target.path);
+        return NanThrowTypeError(err);
+    }
+
+    Local<Function> callback = Local<Function>::Cast(args[args.Length()-1]);
 
-    NanAsyncQueueWorker(new DynamicJpegStack::DynamicJpegEncodeWorker(new NanCallback(callback), jpeg));
+    NanAsyncQueueWorker(new DynamicJpegStack::DynamicJpegEncodeToFileWorker(new NanCallback(callback), jpeg, target));
 
     jpeg->Ref();
+    jpeg->pending++;
 
     NanReturnUndefined();
 }
@@ -9,15 +9,29 @@
 
 #include "common.h"
 #include "jpeg_encoder.h"
+#include "tiled_canvas.h"
+#include "external_memory.h"
+#include "shared_region.h"
+#include "coef_canvas.h"
 
 class DynamicJpegStack : public node::ObjectWrap {
     int quality;
+    bool progressive;
     buffer_type buf_type;
 
     Rect dyn_rect; // rect of dynamic push area (updated after each push)
     int bg_width, bg_height; // background width and height after setBackground
 
-    unsigned char *data;
+    TiledCanvas *canvas;
+    EncodeStats stats;
+    bool measure; // setMetrics
+    ImageMetrics metrics; // of the last measured encode
+    ExternalMemory memory; // canvas bytes reported to V8
+    int pending; // async encodes that still use the canvas
+    bool disposed;
+
+    void UpdateMemory();
+    CoefCanvas *coefs; // set once a JPEG tile is pushed, then used instead of canvas
 
     void update_optimal_dimension(int x, int y, int w, int h);
 
@@ -26,9 +40,20 @@ public:
     ~DynamicJpegStack();
 
     v8::Handle<v8::Value> JpegEncodeSync();
-    void Push(unsigned char *data_buf, int x, int y, int w, int h);
-    void SetBackground(unsigned char *data_buf, int w, int h);
+    void Push(unsigned char *data_buf, int x, int y, int w, int h, size_t stride = 0,
+        blend_mode blend = BLEND_NONE, const ScaleOptions &scale = ScaleOptions());
+    void PushShared(const SharedRegion *region, size_t start, size_t span,
+        int x, int y, int w, int h, size_t stride = 0,
+        blend_mode blend = BLEND_NONE, const ScaleOptions &scale = ScaleOptions());
+    void PushJpeg(const unsigned char *jpeg, size_t len, int x, int y);
+    void SetBackground(unsigned char *data_buf, int w, int h, size_t stride = 0);
+    void SetSharedBackground(const TiledCanvas *base);
+    void CopyRect(const Rect &src, int dst_x, int dst_y);
+    void SetSolidBackground(unsigned char r, unsigned char g, unsigned char b, int w, int h);
     void SetQuality(int q);
+    void SetProgressive(bool p);
+    void AddStats(const EncodeStats &run);
+    void Dispose();
     v8::Handle<v8::Value> Dimensions();
     void Reset();
 
@@ -45,13 +70,39 @@ public:
         DynamicJpegStack *jpeg_obj;
     };
 
+    class DynamicJpegEncodeToFileWorker : public JpegEncoder::EncodeWorker {
+    public:
+        DynamicJpegEncodeToFileWorker(NanCallback *callback, DynamicJpegStack *jpeg, const FileTarget &ttarget) :
+            JpegEncoder::EncodeWorker(callback), jpeg_obj(jpeg), target(ttarget) {
+        };
+        ~DynamicJpegEncodeToFileWorker() { free(target.path); }
+
+        void Execute();
+        void HandleOKCallback();
+        void HandleErrorCallback();
+
+    private:
+        DynamicJpegStack *jpeg_obj;
+        FileTarget target;
+    };
+
     static void Initialize(v8::Handle<v8::Object> target);
     static NAN_METHOD(New);
     static NAN_METHOD(JpegEncodeSync);
     static NAN_METHOD(JpegEncodeAsync);
+    static NAN_METHOD(JpegEncodeToFileAsync);
     static NAN_METHOD(Push);
+    static NAN_METHOD(PushJpeg);
     static NAN_METHOD(SetBackground);
+    static NAN_METHOD(CopyRect);
+    static NAN_METHOD(SetSolidBackground);
     static NAN_METHOD(SetQuality);
+    static NAN_METHOD(SetProgressive);
+    static NAN_METHOD(SetMetrics);
+    static NAN_METHOD(GetMetrics);
+    static NAN_METHOD(GetStats);
+    static NAN_METHOD(ResetStats);
+    static NAN_METHOD(Dispose);
     static NAN_METHOD(Dimensions);
     static NAN_METHOD(Reset);
 };
@@ -0,0 +1,77 @@
+#include <pthread.h>
+#include <time.h>
+
+#include "encode_stats.h"
+
+static volatile bool enabled = false;
+static EncodeStats totals;
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+EncodeStats::reset()
+{
+    encodes = 0;
+    convert_ns = scanlines_ns = finish_ns = grow_ns = copy_ns = queue_wait_ns = 0;
+    bytes_in = bytes_out = 0;
+    allocations = 0;
+}
+
+void
+EncodeStats::add(const EncodeStats &other)
+{
+    encodes += other.encodes;
+    convert_ns += other.convert_ns;
+    scanlines_ns += other.scanlines_ns;
+    finish_ns += other.finish_ns;
+    grow_ns += other.grow_ns;
+    copy_ns += other.copy_ns;
+    queue_wait_ns += other.queue_wait_ns;
+    bytes_in += other.bytes_in;
+    bytes_out += other.bytes_out;
+    allocations += other.allocations;
+}
+
+bool
+stats_enabled()
+{
+    return enabled;
+}
+
+void
+enable_stats(bool on)
+{
+    enabled = on;
+}
+
+uint64_t
+stats_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+void
+add_global_stats(const EncodeStats &stats)
+{
+    pthread_mutex_lock(&totals_lock);
+    totals.add(stats);
+    pthread_mutex_unlock(&totals_lock);
+}
+
+EncodeStats
+global_stats()
+{
+    pthread_mutex_lock(&totals_lock);
+    EncodeStats copy = totals;
+    pthread_mutex_unlock(&totals_lock);
+    return copy;
+}
+
+void
+reset_global_stats()
+{
+    pthread_mutex_lock(&totals_lock);
+    totals.reset();
+    pthread_mutex_unlock(&totals_lock);
+}
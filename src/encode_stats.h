@@ -0,0 +1,38 @@
+#ifndef ENCODE_STATS_H
+#define ENCODE_STATS_H
+
+#include <stdint.h>
+
+// Where encode time goes, in nanoseconds, plus byte and allocation counts.
+// Collection is off unless enable_stats(true) was called, so the timers
+// cost nothing by default.
+struct EncodeStats {
+    uint64_t encodes;
+    uint64_t convert_ns;    // converting pixels / reading the canvas into rows
+    uint64_t scanlines_ns;  // jpeg_write_scanlines (or raw data) calls
+    uint64_t finish_ns;     // jpeg_finish_compress
+    uint64_t grow_ns;       // growing the in-memory output buffer
+    uint64_t copy_ns;       // copying encoded JPEGs around (worker result, Buffer)
+    uint64_t queue_wait_ns; // async encodes waiting for a threadpool thread
+    uint64_t bytes_in;      // pixel bytes read
+    uint64_t bytes_out;     // JPEG bytes produced
+    uint64_t allocations;   // output buffers and result copies malloc'd
+
+    EncodeStats() { reset(); }
+    void reset();
+    void add(const EncodeStats &other);
+};
+
+bool stats_enabled();
+void enable_stats(bool on);
+
+// Monotonic clock in nanoseconds.
+uint64_t stats_clock();
+
+// Totals over every object in the process. Safe to call from any thread.
+void add_global_stats(const EncodeStats &stats);
+EncodeStats global_stats();
+void reset_global_stats();
+
+#endif
+
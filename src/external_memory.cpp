@@ -0,0 +1,88 @@
+#include <node.h>
+#include <cmath>
+
+#include "external_memory.h"
+#include "jpeg_encoder.h"
+#include "tile_pool.h"
+
+using namespace v8;
+using namespace node;
+
+// Shared by every instance of the module (one per context), so they are
+// only changed atomically.
+static int64_t total_reported = 0;
+static int objects = 0;
+
+ExternalMemory::ExternalMemory() : reported(0)
+{
+    __sync_add_and_fetch(&objects, 1);
+}
+
+ExternalMemory::~ExternalMemory()
+{
+    set(0);
+    __sync_sub_and_fetch(&objects, 1);
+}
+
+void
+ExternalMemory::set(int64_t bytes)
+{
+    int64_t delta = bytes - reported;
+    if (!delta) return;
+    V8::AdjustAmountOfExternalAllocatedMemory((intptr_t)delta);
+    __sync_add_and_fetch(&total_reported, delta);
+    reported = bytes;
+}
+
+void
+ExternalMemory::Initialize(v8::Handle<v8::Object> target)
+{
+    NanScope();
+
+    NODE_SET_METHOD(target, "nativeMemory", NativeMemory);
+    NODE_SET_METHOD(target, "setTilePoolLimit", SetTilePoolLimit);
+}
+
+NAN_METHOD(ExternalMemory::NativeMemory)
+{
+    NanScope();
+
+    int64_t stacks = __sync_add_and_fetch(&total_reported, 0);
+    int64_t encoders = JpegEncoder::total_held_bytes();
+
+    Local<Object> obj = Object::New();
+    obj->Set(String::NewSymbol("stacks"), Number::New((double)stacks));
+    obj->Set(String::NewSymbol("encoders"), Number::New((double)encoders));
+    obj->Set(String::NewSymbol("total"), Number::New((double)(stacks + encoders)));
+    obj->Set(String::NewSymbol("objects"), Integer::New(__sync_add_and_fetch(&objects, 0)));
+
+    TilePoolStats pool_stats = tile_pool_stats();
+    Local<Object> pool = Object::New();
+    pool->Set(String::NewSymbol("slabs"), Number::New(pool_stats.slabs));
+    pool->Set(String::NewSymbol("idleSlabs"), Number::New(pool_stats.idle_slabs));
+    pool->Set(String::NewSymbol("usedTiles"), Number::New(pool_stats.used_tiles));
+    pool->Set(String::NewSymbol("freeTiles"), Number::New(pool_stats.free_tiles));
+    pool->Set(String::NewSymbol("bytes"), Number::New(pool_stats.bytes));
+    obj->Set(String::NewSymbol("pool"), pool);
+    NanReturnValue(obj);
+}
+
+NAN_METHOD(ExternalMemory::SetTilePoolLimit)
+{
+    NanScope();
+
+    if (args.Length() != 1)
+        return NanThrowError("One argument required - bytes.");
+    if (!args[0]->IsNumber())
+        return NanThrowTypeError("First argument must be a number of bytes.");
+    double bytes = args[0]->NumberValue();
+    if (bytes != bytes || bytes == HUGE_VAL || bytes == -HUGE_VAL)
+        return NanThrowRangeError("The limit must be a finite number.");
+    if (bytes < 0)
+        return NanThrowRangeError("The limit can't be negative.");
+
+    // past what size_t holds the cast is undefined, and no limit anyway
+    double max = (double)(size_t)-1;
+    set_tile_pool_limit(bytes >= max ? (size_t)-1 : (size_t)bytes);
+    NanReturnUndefined();
+}
@@ -0,0 +1,31 @@
+#ifndef EXTERNAL_MEMORY_H
+#define EXTERNAL_MEMORY_H
+
+#include <node.h>
+#include <stdint.h>
+
+#include "common.h"
+
+// Native memory owned by a JS object (canvas tiles, coefficients), reported
+// to V8 with AdjustAmountOfExternalAllocatedMemory so that the GC knows
+// what collecting the object would free. Only used on the thread of the
+// object's context.
+class ExternalMemory {
+    int64_t reported;
+
+public:
+    ExternalMemory();
+    ~ExternalMemory();
+
+    // Reports the change from the last call.
+    void set(int64_t bytes);
+
+    // Module level nativeMemory(): bytes held by live objects, encoders
+    // and the tile pool, and setTilePoolLimit(bytes).
+    static void Initialize(v8::Handle<v8::Object> target);
+    static NAN_METHOD(NativeMemory);
+    static NAN_METHOD(SetTilePoolLimit);
+};
+
+#endif
+
@@ -3,10 +3,15 @@
 #include <jpeglib.h>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
 
 #include "common.h"
 #include "fixed_jpeg_stack.h"
 #include "jpeg_encoder.h"
+#include "js_args.h"
+#include "mapped_file.h"
+#include "shared_memory.h"
+#include "scan_emitter.h"
 
 using namespace v8;
 using namespace node;
@@ -20,29 +25,91 @@ FixedJpegStack::Initialize(v8::Handle<v8::Object> target)
     t->InstanceTemplate()->SetInternalFieldCount(1);
     NODE_SET_PROTOTYPE_METHOD(t, "encode", JpegEncodeAsync);
     NODE_SET_PROTOTYPE_METHOD(t, "encodeSync", JpegEncodeSync);
+    NODE_SET_PROTOTYPE_METHOD(t, "encodeToFile", JpegEncodeToFileAsync);
+    NODE_SET_PROTOTYPE_METHOD(t, "encodeTiles", JpegEncodeTilesAsync);
     NODE_SET_PROTOTYPE_METHOD(t, "push", Push);
+    NODE_SET_PROTOTYPE_METHOD(t, "copyRect", CopyRect);
+    NODE_SET_PROTOTYPE_METHOD(t, "setSolidBackground", SetSolidBackground);
     NODE_SET_PROTOTYPE_METHOD(t, "setQuality", SetQuality);
+    NODE_SET_PROTOTYPE_METHOD(t, "setProgressive", SetProgressive);
+    NODE_SET_PROTOTYPE_METHOD(t, "setMetrics", SetMetrics);
+    NODE_SET_PROTOTYPE_METHOD(t, "getMetrics", GetMetrics);
+    NODE_SET_PROTOTYPE_METHOD(t, "getStats", GetStats);
+    NODE_SET_PROTOTYPE_METHOD(t, "resetStats", ResetStats);
+    NODE_SET_PROTOTYPE_METHOD(t, "dispose", Dispose);
     target->Set(String::NewSymbol("FixedJpegStack"), t->GetFunction());
 }
 
-FixedJpegStack::FixedJpegStack(int wwidth, int hheight, buffer_type bbuf_type) :
-    width(wwidth), height(hheight), quality(60), buf_type(bbuf_type)
+FixedJpegStack::FixedJpegStack(int wwidth, int hheight, buffer_type bbuf_type, bool ycbcr) :
+    width(wwidth), height(hheight), quality(60), progressive(false), buf_type(bbuf_type),
+    canvas(NULL), yuv(NULL), measure(false), dirty(wwidth, hheight), pending(0), disposed(false)
 {
-    data = (unsigned char *)calloc(width*height*3, sizeof(*data));
-    if (!data) throw "calloc in FixedJpegStack::FixedJpegStack failed!";
+    // black until something is pushed, tiles get allocated on first push
+    if (ycbcr)
+        yuv = new YuvCanvas(width, height);
+    else
+        canvas = new TiledCanvas(width, height);
+    UpdateMemory();
 }
 
+FixedJpegStack::~FixedJpegStack()
+{
+    delete canvas;
+    delete yuv;
+}
+
+// An encoder for the canvas. A YuvCanvas is handed over as a YUV420
+// buffer, which JpegEncoder feeds to libjpeg without converting it.
+class CanvasEncoder {
+    CanvasRowSource *rows;
+    JpegEncoder *encoder;
+
+public:
+    CanvasEncoder(const TiledCanvas *canvas, const YuvCanvas *yuv, int w, int h, int q) :
+        rows(NULL), encoder(NULL)
+    {
+        if (yuv) {
+            encoder = new JpegEncoder((unsigned char *)yuv->data(), w, h, q, BUF_YUV420);
+        }
+        else {
+            rows = new CanvasRowSource(*canvas);
+            encoder = new JpegEncoder(rows, w, h, q);
+        }
+    }
+    ~CanvasEncoder()
+    {
+        delete encoder;
+        delete rows;
+    }
+
+    JpegEncoder *operator->() { return encoder; }
+};
+
 Handle<Value>
 FixedJpegStack::JpegEncodeSync()
 {
     NanScope();
 
     try {
-        JpegEncoder jpeg_encoder(data, width, height, quality, BUF_RGB);
-        jpeg_encoder.encode();
-        int jpeg_len = jpeg_encoder.get_jpeg_len();
+        CanvasEncoder jpeg_encoder(canvas, yuv, width, height, quality);
+        EncodeStats run;
+        EncodeStats *run_stats = stats_enabled() ? &run : NULL;
+        jpeg_encoder->set_progressive(progressive);
+        ImageMetrics run_metrics;
+        jpeg_encoder->set_metrics(measure ? &run_metrics : NULL);
+        jpeg_encoder->set_stats(run_stats);
+        jpeg_encoder->encode();
+        unsigned long jpeg_len = jpeg_encoder->get_jpeg_len();
+        if (jpeg_len > MAX_BUFFER_LENGTH)
+            throw "Encoded JPEG is too large for a Buffer.";
+        uint64_t t0 = run_stats ? stats_clock() : 0;
         Local<Object> retbuf = NanNewBufferHandle(jpeg_len);
-        memcpy(Buffer::Data(retbuf), jpeg_encoder.get_jpeg(), jpeg_len);
+        memcpy(Buffer::Data(retbuf), jpeg_encoder->get_jpeg(), jpeg_len);
+        if (run_metrics.valid) metrics = run_metrics;
+        if (run_stats) {
+            run.copy_ns += stats_clock() - t0;
+            AddStats(run);
+        }
         return scope.Close(retbuf);
     }
     catch (const char *err) {
@@ -51,63 +118,78 @@ FixedJpegStack::JpegEncodeSync()
 }
 
 void
-FixedJpegStack::Push(unsigned char *data_buf, int x, int y, int w, int h)
+FixedJpegStack::Push(unsigned char *data_buf, int x, int y, int w, int h, size_t stride,
+    blend_mode blend, const ScaleOptions &scale)
 {
-    int start = y*width*3 + x*3;
-
-    switch (buf_type) {
-    case BUF_RGB:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-            }
-        }
-        break;
-
-    case BUF_BGR:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *(data_buf+2);
-                *datap++ = *(data_buf+1);
-                *datap++ = *data_buf;
-                data_buf+=3;
-            }
-        }
-        break;
-
-    case BUF_RGBA:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-                *datap++ = *data_buf++;
-                data_buf++;
-            }
-        }
-        break;
-
-    case BUF_BGRA:
-        for (int i = 0; i < h; i++) {
-            unsigned char *datap = &data[start + i*width*3];
-            for (int j = 0; j < w; j++) {
-                *datap++ = *(data_buf+2);
-                *datap++ = *(data_buf+1);
-                *datap++ = *data_buf;
-                data_buf += 4;
-            }
-        }
-        break;
+    if (yuv && scale.enabled())
+        yuv->push_scaled(data_buf, buf_type, x, y, w, h, stride, scale, blend);
+    else if (yuv)
+        yuv->push(data_buf, buf_type, x, y, w, h, stride, blend);
+    else if (scale.enabled())
+        canvas->push_scaled(data_buf, buf_type, x, y, w, h, stride, scale, blend);
+    else
+        canvas->push(data_buf, buf_type, x, y, w, h, stride, blend);
+    UpdateMemory();
+    if (scale.enabled())
+        dirty.mark(x, y, scale.width, scale.height);
+    else
+        dirty.mark(x, y, w, h);
+}
+
+void
+FixedJpegStack::CopyRect(const Rect &src, int dst_x, int dst_y)
+{
+    if (yuv)
+        yuv->copy_rect(src.x, src.y, src.w, src.h, dst_x, dst_y);
+    else
+        canvas->copy_rect(src.x, src.y, src.w, src.h, dst_x, dst_y);
+    UpdateMemory();
+    dirty.mark(dst_x, dst_y, src.w, src.h);
+}
+
+// Pushes a fragment of a frame in shared memory. A torn plain copy is
+// simply pushed again, but blending can't be redone over itself, so blended
+// fragments are copied out of a complete frame first.
+void
+FixedJpegStack::PushShared(const SharedRegion *region, size_t start, size_t span,
+    int x, int y, int w, int h, size_t stride, blend_mode blend, const ScaleOptions &scale)
+{
+    if (blend != BLEND_NONE && region->has_seqlock()) {
+        std::vector<unsigned char> frame;
+        region->snapshot(start, span, frame);
+        Push(span ? &frame[0] : NULL, x, y, w, h, stride, blend, scale);
+        return;
+    }
 
-    default:
-        throw "Unexpected buf_type in FixedJpegStack::Push";
+    for (int i = 0; ; i++) {
+        uint32_t gen = region->begin_read();
+        Push((unsigned char *)region->data() + start, x, y, w, h, stride, blend, scale);
+        if (region->end_read(gen)) return;
+        if (i + 1 == SharedRegion::MAX_READS)
+            throw "Shared frame kept changing while it was pushed.";
     }
 }
 
+void
+FixedJpegStack::SetSolidBackground(unsigned char r, unsigned char g, unsigned char b,
+    int w, int h)
+{
+    if (yuv) {
+        YuvCanvas *new_yuv = new YuvCanvas(w, h, r, g, b);
+        delete yuv;
+        yuv = new_yuv;
+    }
+    else {
+        TiledCanvas *new_canvas = new TiledCanvas(w, h, r, g, b);
+        delete canvas;
+        canvas = new_canvas;
+    }
+    UpdateMemory();
+
+    width = w;
+    height = h;
+    dirty.resize(w, h);
+}
 
 void
 FixedJpegStack::SetQuality(int q)
@@ -115,12 +197,46 @@ FixedJpegStack::SetQuality(int q)
     quality = q;
 }
 
+void
+FixedJpegStack::SetProgressive(bool p)
+{
+    progressive = p;
+}
+
+void
+FixedJpegStack::AddStats(const EncodeStats &run)
+{
+    stats.add(run);
+    add_global_stats(run);
+}
+
+void
+FixedJpegStack::UpdateMemory()
+{
+    if (yuv)
+        memory.set(yuv->allocated_bytes());
+    else
+        memory.set(canvas ? canvas->allocated_bytes() : 0);
+}
+
+// Frees the canvas now rather than whenever the GC gets to the object.
+void
+FixedJpegStack::Dispose()
+{
+    delete canvas;
+    canvas = NULL;
+    delete yuv;
+    yuv = NULL;
+    disposed = true;
+    UpdateMemory();
+}
+
 NAN_METHOD(FixedJpegStack::New)
 {
     NanScope();
 
     if (args.Length() < 2)
-        return NanThrowError("At least two arguments required - width, height, [and buffer type]");
+        return NanThrowError("At least two arguments required - width, height, [buffer type], [options]");
     if (!args[0]->IsInt32())
         return NanThrowTypeError("First argument must be integer width.");
     if (!args[1]->IsInt32())
@@ -133,33 +249,33 @@ NAN_METHOD(FixedJpegStack::New)
         return NanThrowRangeError("Width can't be negative.");
     if (h < 0)
         return NanThrowRangeError("Height can't be negative.");
+    if (w > JPEG_MAX_DIMENSION || h > JPEG_MAX_DIMENSION)
+        return NanThrowRangeError("Width and height can't be larger than 65500.");
 
     buffer_type buf_type = BUF_RGB;
-    if (args.Length() == 3) {
+    if (args.Length() >= 3 && !args[2]->IsUndefined()) {
         if (!args[2]->IsString())
-            return NanThrowTypeError("Third argument must be a string. Either 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return NanThrowTypeError("Third argument must be a string. One of " BUFFER_TYPES ".");
 
         String::AsciiValue bt(args[2]->ToString());
-        if (!(str_eq(*bt, "rgb") || str_eq(*bt, "bgr") ||
-            str_eq(*bt, "rgba") || str_eq(*bt, "bgra")))
-        {
-            return NanThrowTypeError("Buffer type must be 'rgb', 'bgr', 'rgba' or 'bgra'.");
-        }
+        if (!parse_buffer_type(*bt, buf_type))
+            return NanThrowTypeError("Buffer type must be " BUFFER_TYPES ".");
+    }
 
-        if (str_eq(*bt, "rgb"))
-            buf_type = BUF_RGB;
-        else if (str_eq(*bt, "bgr"))
-            buf_type = BUF_BGR;
-        else if (str_eq(*bt, "rgba"))
-            buf_type = BUF_RGBA;
-        else if (str_eq(*bt, "bgra"))
-            buf_type = BUF_BGRA;
-        else
-            return NanThrowTypeError("Buffer type wasn't 'rgb', 'bgr', 'rgba' or 'bgra'.");
+    bool ycbcr = false;
+    if (args.Length() >= 4) {
+        if (!args[3]->IsObject())
+            return NanThrowTypeError("Options must be an object.");
+        Local<Value> opt = args[3]->ToObject()->Get(String::NewSymbol("ycbcr"));
+        if (!opt->IsUndefined()) {
+            if (!opt->IsBoolean())
+                return NanThrowTypeError("ycbcr must be boolean.");
+            ycbcr = opt->BooleanValue();
+        }
     }
 
     try {
-        FixedJpegStack *jpeg = new FixedJpegStack(w, h, buf_type);
+        FixedJpegStack *jpeg = new FixedJpegStack(w, h, buf_type, ycbcr);
         jpeg->Wrap(args.This());
         NanReturnValue(args.This());
     }
@@ -172,6 +288,9 @@ NAN_METHOD(FixedJpegStack::JpegEncodeSync)
 {
     NanScope();
     FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
+    if (jpeg->disposed)
+        return NanThrowError("FixedJpegStack has been disposed.");
+
     NanReturnValue(jpeg->JpegEncodeSync());
 }
 
@@ -179,8 +298,11 @@ NAN_METHOD(FixedJpegStack::Push)
 {
     NanScope();
 
-    if (!Buffer::HasInstance(args[0]))
-        return NanThrowTypeError("First argument must be Buffer.");
+    unsigned char *bytes = NULL;
+    size_t bytes_len = 0;
+    SharedMemory *shm = SharedMemory::FromValue(args[0]);
+    if (!shm && !args[0]->IsString() && !get_bytes(args[0], bytes, bytes_len))
+        return NanThrowTypeError("First argument must be a Buffer, typed array, ArrayBuffer, SharedMemory or path to a raw pixel file.");
     if (!args[1]->IsInt32())
         return NanThrowTypeError("Second argument must be integer x.");
     if (!args[2]->IsInt32())
@@ -191,7 +313,9 @@ NAN_METHOD(FixedJpegStack::Push)
         return NanThrowTypeError("Fifth argument must be integer h.");
 
     FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
-    Local<Object> data_buf = args[0]->ToObject();
+    if (jpeg->disposed)
+        return NanThrowError("FixedJpegStack has been disposed.");
+
     int x = args[1]->Int32Value();
     int y = args[2]->Int32Value();
     int w = args[3]->Int32Value();
@@ -205,16 +329,132 @@ NAN_METHOD(FixedJpegStack::Push)
         return NanThrowRangeError("Width smaller than 0.");
     if (h < 0)
         return NanThrowRangeError("Height smaller than 0.");
+    SourceOptions src;
+    blend_mode blend = BLEND_NONE;
+    ScaleOptions scale;
+    if (args.Length() >= 6) {
+        const char *err = parse_source_options(args[5], src);
+        if (!err) err = parse_blend_option(args[5], jpeg->buf_type, blend);
+        if (!err) err = parse_scale_options(args[5], w, h, scale);
+        if (err) return NanThrowTypeError(err);
+    }
+    // area the fragment covers on the canvas
+    int cw = scale.enabled() ? scale.width : w;
+    int ch = scale.enabled() ? scale.height : h;
+
     if (x >= jpeg->width)
         return NanThrowRangeError("Coordinate x exceeds FixedJpegStack's dimensions.");
     if (y >= jpeg->height)
         return NanThrowRangeError("Coordinate y exceeds FixedJpegStack's dimensions.");
-    if (x+w > jpeg->width)
+    if (x+cw > jpeg->width)
         return NanThrowRangeError("Pushed fragment exceeds FixedJpegStack's width.");
-    if (y+h > jpeg->height)
+    if (y+ch > jpeg->height)
         return NanThrowRangeError("Pushed fragment exceeds FixedJpegStack's height.");
 
-    jpeg->Push((unsigned char *)Buffer::Data(data_buf), x, y, w, h);
+    size_t start, span;
+    const char *extent_err = source_extent(src, w, h, jpeg->buf_type, start, span);
+    if (extent_err) return NanThrowRangeError(extent_err);
+
+    try {
+        if (args[0]->IsString()) {
+            String::Utf8Value path(args[0]);
+            MappedFile mapping;
+            mapping.open(*path, start, span);
+            mapping.advise_sequential();
+            jpeg->Push((unsigned char *)mapping.data(), x, y, w, h, src.stride, blend, scale);
+        }
+        else if (shm) {
+            const SharedRegion *region = shm->get_region();
+            if (!region)
+                return NanThrowError("SharedMemory has been disposed.");
+            if (!extent_fits(start, span, region->size()))
+                return NanThrowRangeError("Shared memory is too small for the given width, height and buffer type.");
+            jpeg->PushShared(region, start, span, x, y, w, h, src.stride, blend, scale);
+        }
+        else {
+            if (!extent_fits(start, span, bytes_len))
+                return NanThrowRangeError("Buffer is too small for the given width, height and buffer type.");
+            jpeg->Push(bytes + start, x, y, w, h, src.stride, blend, scale);
+        }
+    }
+    catch (const char *err) {
+        return NanThrowError(err);
+    }
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(FixedJpegStack::CopyRect)
+{
+    NanScope();
+
+    if (args.Length() != 6)
+        return NanThrowError("Six arguments required - srcX, srcY, width, height, dstX, dstY");
+    for (int i = 0; i < 6; i++) {
+        if (!args[i]->IsInt32())
+            return NanThrowTypeError("Arguments must be integers srcX, srcY, width, height, dstX, dstY.");
+    }
+
+    FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
+    if (jpeg->disposed)
+        return NanThrowError("FixedJpegStack has been disposed.");
+
+    Rect src(args[0]->Int32Value(), args[1]->Int32Value(),
+        args[2]->Int32Value(), args[3]->Int32Value());
+    int dst_x = args[4]->Int32Value();
+    int dst_y = args[5]->Int32Value();
+
+    const char *err = check_copy_rect(src, dst_x, dst_y, jpeg->width, jpeg->height);
+    if (err) return NanThrowRangeError(err);
+
+    try {
+        jpeg->CopyRect(src, dst_x, dst_y);
+    }
+    catch (const char *err) {
+        return NanThrowError(err);
+    }
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(FixedJpegStack::SetSolidBackground)
+{
+    NanScope();
+
+    if (args.Length() != 5)
+        return NanThrowError("Five arguments required - r, g, b, width, height");
+    for (int i = 0; i < 5; i++) {
+        if (!args[i]->IsInt32())
+            return NanThrowTypeError("Arguments must be integers r, g, b, width, height.");
+    }
+
+    int r = args[0]->Int32Value();
+    int g = args[1]->Int32Value();
+    int b = args[2]->Int32Value();
+    int w = args[3]->Int32Value();
+    int h = args[4]->Int32Value();
+
+    if (r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255)
+        return NanThrowRangeError("Colour components must be between 0 and 255.");
+    if (w < 0)
+        return NanThrowRangeError("Width smaller than 0.");
+    if (h < 0)
+        return NanThrowRangeError("Height smaller than 0.");
+    if (w > JPEG_MAX_DIMENSION || h > JPEG_MAX_DIMENSION)
+        return NanThrowRangeError("Width and height can't be larger than 65500.");
+
+    FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
+    if (jpeg->disposed)
+        return NanThrowError("FixedJpegStack has been disposed.");
+    if (jpeg->pending)
+        return NanThrowError("Can't set the background while an encode is running.");
+
+    try {
+        jpeg->SetSolidBackground(r, g, b, w, h);
+    }
+    catch (const char *err) {
+        return NanThrowError(err);
+    }
 
     NanReturnUndefined();
 }
@@ -242,17 +482,100 @@ NAN_METHOD(FixedJpegStack::SetQuality)
     NanReturnUndefined();
 }
 
+NAN_METHOD(FixedJpegStack::SetProgressive)
+{
+    NanScope();
+
+    if (args.Length() != 1)
+        return NanThrowError("One argument required - progressive");
+
+    if (!args[0]->IsBoolean())
+        return NanThrowTypeError("First argument must be boolean progressive");
+
+    FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
+    jpeg->SetProgressive(args[0]->BooleanValue());
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(FixedJpegStack::SetMetrics)
+{
+    NanScope();
+
+    if (args.Length() != 1)
+        return NanThrowError("One argument required - metrics");
+
+    if (!args[0]->IsBoolean())
+        return NanThrowTypeError("First argument must be boolean metrics");
+
+    FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
+    jpeg->measure = args[0]->BooleanValue();
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(FixedJpegStack::GetMetrics)
+{
+    NanScope();
+
+    FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
+    if (!jpeg->metrics.valid)
+        NanReturnUndefined();
+    NanReturnValue(metrics_object(jpeg->metrics));
+}
+
+NAN_METHOD(FixedJpegStack::GetStats)
+{
+    NanScope();
+
+    FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
+    NanReturnValue(stats_object(jpeg->stats));
+}
+
+NAN_METHOD(FixedJpegStack::ResetStats)
+{
+    NanScope();
+
+    FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
+    jpeg->stats.reset();
+    NanReturnUndefined();
+}
+
+NAN_METHOD(FixedJpegStack::Dispose)
+{
+    NanScope();
+
+    FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
+    if (jpeg->pending)
+        return NanThrowError("Can't dispose while an encode is running.");
+    jpeg->Dispose();
+    NanReturnUndefined();
+}
+
 void FixedJpegStack::FixedJpegEncodeWorker::Execute() {
+    started();
     try {
-        JpegEncoder encoder(jpeg_obj->data, jpeg_obj->width, jpeg_obj->height, jpeg_obj->quality, BUF_RGB);
-        encoder.encode();
-        jpeg_len = encoder.get_jpeg_len();
+        CanvasEncoder encoder(jpeg_obj->canvas, jpeg_obj->yuv,
+            jpeg_obj->width, jpeg_obj->height, jpeg_obj->quality);
+        encoder->set_progressive(jpeg_obj->progressive);
+        encoder->set_scan_listener(scans);
+        encoder->set_metrics(jpeg_obj->measure ? &metrics : NULL);
+        encoder->set_stats(run_stats());
+        encoder->encode();
+        jpeg_len = encoder->get_jpeg_len();
+        if (jpeg_len > MAX_BUFFER_LENGTH)
+            throw "Encoded JPEG is too large for a Buffer.";
+        uint64_t t0 = run_stats() ? stats_clock() : 0;
         jpeg = (char *)malloc(sizeof(*jpeg)*jpeg_len);
         if (!jpeg) {
             errmsg = strdup("malloc in FixedJpegStack::FixedJpegEncodeWorker::Execute() failed.");
         }
         else {
-            memcpy(jpeg, encoder.get_jpeg(), jpeg_len);
+            memcpy(jpeg, encoder->get_jpeg(), jpeg_len);
+            if (run_stats()) {
+                stats.copy_ns += stats_clock() - t0;
+                stats.allocations++;
+            }
         }
     }
     catch (const char *err) {
@@ -263,8 +586,13 @@ void FixedJpegStack::FixedJpegEncodeWorker::Execute() {
 void FixedJpegStack::FixedJpegEncodeWorker::HandleOKCallback() {
     NanScope();
 
+    finish_scans();
+    if (metrics.valid) jpeg_obj->metrics = metrics;
+
+    uint64_t t0 = run_stats() ? stats_clock() : 0;
     Local<Object> buf = NanNewBufferHandle(jpeg_len);
     memcpy(Buffer::Data(buf), jpeg, jpeg_len);
+    if (run_stats()) stats.copy_ns += stats_clock() - t0;
     Local<Value> argv[2] = {buf, Undefined()};
 
     TryCatch try_catch; // don't quite see the necessity of this
@@ -278,11 +606,15 @@ void FixedJpegStack::FixedJpegEncodeWorker::HandleOKCallback() {
     free(jpeg);
     jpeg = NULL;
 
+    if (run_stats()) jpeg_obj->AddStats(stats);
+    jpeg_obj->pending--;
     jpeg_obj->Unref();
 }
 
 void FixedJpegStack::FixedJpegEncodeWorker::HandleErrorCallback() {
     NanScope();
+
+    finish_scans();
     Local<Value> argv[2] = {Undefined(), v8::Exception::Error(v8::String::New(errmsg))};
 
     TryCatch try_catch; // don't quite see the necessity of this
@@ -298,6 +630,8 @@ void FixedJpegStack::FixedJpegEncodeWorker::HandleErrorCallback() {
         jpeg = NULL;
     }
 
+    if (run_stats()) jpeg_obj->AddStats(stats);
+    jpeg_obj->pending--;
     jpeg_obj->Unref();
 }
 
@@ -306,18 +640,287 @@ NAN_METHOD(FixedJpegStack::JpegEncodeAsync)
 {
     NanScope();
 
-    if (args.Length() != 1)
-        return NanThrowError("One argument required - callback function.");
+    if (args.Length() != 1 && args.Length() != 2)
+        return NanThrowError("One argument required - callback function, [and onScan function].");
 
     if (!args[0]->IsFunction())
         return NanThrowTypeError("First argument must be a function.");
+    if (args.Length() == 2 && !args[1]->IsFunction())
+        return NanThrowTypeError("Second argument must be a function.");
 
     Local<Function> callback = Local<Function>::Cast(args[0]);
     FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
+    if (jpeg->disposed)
+        return NanThrowError("FixedJpegStack has been disposed.");
+
+    FixedJpegStack::FixedJpegEncodeWorker *worker = new FixedJpegStack::FixedJpegEncodeWorker(new NanCallback(callback), jpeg);
+    if (args.Length() == 2)
+        worker->set_scans(new ScanEmitter(new NanCallback(Local<Function>::Cast(args[1]))));
+    NanAsyncQueueWorker(worker);
+
+    jpeg->Ref();
+    jpeg->pending++;
+
+    NanReturnUndefined();
+}
+
+void FixedJpegStack::FixedJpegEncodeToFileWorker::Execute() {
+    started();
+    try {
+        CanvasEncoder encoder(jpeg_obj->canvas, jpeg_obj->yuv,
+            jpeg_obj->width, jpeg_obj->height, jpeg_obj->quality);
+        encoder->set_progressive(jpeg_obj->progressive);
+        encoder->set_stats(run_stats());
+        encoder->encode_to_file(target);
+        jpeg_len = encoder->get_jpeg_len();
+    }
+    catch (const char *err) {
+        errmsg = strdup(err);
+    }
+}
+
+void FixedJpegStack::FixedJpegEncodeToFileWorker::HandleOKCallback() {
+    NanScope();
+
+    Local<Value> argv[2] = {Number::New(jpeg_len), Undefined()};
+
+    TryCatch try_catch;
+
+    callback->Call(2, argv);
+
+    if (try_catch.HasCaught()) {
+        FatalException(try_catch);
+    }
+
+    if (run_stats()) jpeg_obj->AddStats(stats);
+    jpeg_obj->pending--;
+    jpeg_obj->Unref();
+}
+
+void FixedJpegStack::FixedJpegEncodeToFileWorker::HandleErrorCallback() {
+    NanScope();
+    Local<Value> argv[2] = {Undefined(), v8::Exception::Error(v8::String::New(errmsg))};
+
+    TryCatch try_catch;
+
+    callback->Call(2, argv);
+
+    if (try_catch.HasCaught()) {
+        FatalException(try_catch);
+    }
+
+    if (run_stats()) jpeg_obj->AddStats(stats);
+    jpeg_obj->pending--;
+    jpeg_obj->Unref();
+}
+
+NAN_METHOD(FixedJpegStack::JpegEncodeToFileAsync)
+{
+    NanScope();
+
+    if (args.Length() != 2 && args.Length() != 3)
+        return NanThrowError("Two or three arguments required - path or fd, [options], callback function.");
+
+    if (!args[args.Length()-1]->IsFunction())
+        return NanThrowTypeError("Last argument must be a function.");
+
+    FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
+    if (jpeg->disposed)
+        return NanThrowError("FixedJpegStack has been disposed.");
+
+    FileTarget target;
+    const char *err = parse_file_target(args[0],
+        args.Length() == 3 ? args[1] : Handle<Value>(Undefined()), target);
+    if (err) {
+        free(target.path);
+        return NanThrowTypeError(err);
+    }
+
+    Local<Function> callback = Local<Function>::Cast(args[args.Length()-1]);
+
+    NanAsyncQueueWorker(new FixedJpegStack::FixedJpegEncodeToFileWorker(new NanCallback(callback), jpeg, target));
+
+    jpeg->Ref();
+    jpeg->pending++;
+
+    NanReturnUndefined();
+}
+
+// Threads libuv runs work on, so that each gets one tiles worker.
+static int
+threadpool_size()
+{
+    const char *env = getenv("UV_THREADPOOL_SIZE");
+    int n = env ? atoi(env) : 4;
+    if (n < 1) n = 1;
+    if (n > 128) n = 128;
+    return n;
+}
+
+FixedJpegStack::TileJob::TileJob(FixedJpegStack *jpeg) :
+    jpeg_obj(jpeg), quality(jpeg->quality), progressive(jpeg->progressive),
+    next(0), workers(0), callback(NULL), errmsg(NULL) {}
+
+FixedJpegStack::TileJob::~TileJob()
+{
+    for (size_t i = 0; i < jpegs.size(); i++)
+        free(jpegs[i]);
+    free(errmsg);
+    delete callback;
+}
+
+void
+FixedJpegStack::TileJob::worker_done()
+{
+    if (--workers) return;
+
+    NanScope();
+
+    Local<Value> argv[2] = {Undefined(), Undefined()};
+    if (errmsg) {
+        // they weren't delivered, so they still count as changed
+        for (size_t i = 0; i < tiles.size(); i++)
+            jpeg_obj->dirty.mark(tiles[i].x, tiles[i].y, tiles[i].w, tiles[i].h);
+        argv[1] = v8::Exception::Error(v8::String::New(errmsg));
+    }
+    else {
+        Local<Array> list = Array::New(tiles.size());
+        for (size_t i = 0; i < tiles.size(); i++) {
+            Local<Object> buf = NanNewBufferHandle(jpeg_lens[i]);
+            memcpy(Buffer::Data(buf), jpegs[i], jpeg_lens[i]);
+            free(jpegs[i]);
+            jpegs[i] = NULL;
+
+            Local<Object> tile = Object::New();
+            tile->Set(String::NewSymbol("col"), Integer::New(cols[i]));
+            tile->Set(String::NewSymbol("row"), Integer::New(rows[i]));
+            tile->Set(String::NewSymbol("x"), Integer::New(tiles[i].x));
+            tile->Set(String::NewSymbol("y"), Integer::New(tiles[i].y));
+            tile->Set(String::NewSymbol("width"), Integer::New(tiles[i].w));
+            tile->Set(String::NewSymbol("height"), Integer::New(tiles[i].h));
+            tile->Set(String::NewSymbol("jpeg"), buf);
+            list->Set(i, tile);
+        }
+        argv[0] = list;
+    }
+
+    TryCatch try_catch;
+
+    callback->Call(2, argv);
+
+    if (try_catch.HasCaught()) {
+        FatalException(try_catch);
+    }
+
+    jpeg_obj->pending--;
+    jpeg_obj->Unref();
+    delete this;
+}
+
+// Encodes tiles until there are none left, or one fails.
+void FixedJpegStack::FixedJpegTilesWorker::Execute() {
+    started();
+    FixedJpegStack *stack = job->jpeg_obj;
+    int n = job->tiles.size();
+    for (;;) {
+        int i = __sync_fetch_and_add(&job->next, 1);
+        if (i >= n) break;
+        try {
+            const Rect &tile = job->tiles[i];
+            CanvasEncoder encoder(stack->canvas, stack->yuv, stack->width, stack->height, job->quality);
+            encoder->setRect(tile);
+            encoder->set_progressive(job->progressive);
+            encoder->set_stats(run_stats());
+            encoder->encode();
+            if (encoder->get_jpeg_len() > MAX_BUFFER_LENGTH)
+                throw "Encoded JPEG is too large for a Buffer.";
+            job->jpeg_lens[i] = encoder->get_jpeg_len();
+            job->jpegs[i] = (char *)malloc(job->jpeg_lens[i]);
+            if (!job->jpegs[i]) {
+                errmsg = strdup("malloc in FixedJpegStack::FixedJpegTilesWorker::Execute() failed.");
+                return;
+            }
+            memcpy(job->jpegs[i], encoder->get_jpeg(), job->jpeg_lens[i]);
+            if (run_stats()) stats.allocations++;
+        }
+        catch (const char *err) {
+            errmsg = strdup(err);
+            return;
+        }
+    }
+}
+
+void FixedJpegStack::FixedJpegTilesWorker::HandleOKCallback() {
+    if (run_stats()) job->jpeg_obj->AddStats(stats);
+    job->worker_done();
+}
+
+void FixedJpegStack::FixedJpegTilesWorker::HandleErrorCallback() {
+    if (!job->errmsg) job->errmsg = strdup(errmsg);
+    if (run_stats()) job->jpeg_obj->AddStats(stats);
+    job->worker_done();
+}
+
+NAN_METHOD(FixedJpegStack::JpegEncodeTilesAsync)
+{
+    NanScope();
+
+    if (args.Length() != 3 && args.Length() != 4)
+        return NanThrowError("Three or four arguments required - tileWidth, tileHeight, [options], callback function.");
+
+    if (!args[0]->IsInt32())
+        return NanThrowTypeError("First argument must be integer tile width.");
+    if (!args[1]->IsInt32())
+        return NanThrowTypeError("Second argument must be integer tile height.");
+    if (!args[args.Length()-1]->IsFunction())
+        return NanThrowTypeError("Last argument must be a function.");
+
+    int tile_w = args[0]->Int32Value();
+    int tile_h = args[1]->Int32Value();
+    if (tile_w <= 0 || tile_h <= 0)
+        return NanThrowRangeError("Tile width and height must be positive.");
+
+    bool changed_only = false;
+    if (args.Length() == 4) {
+        if (!args[2]->IsObject())
+            return NanThrowTypeError("Options must be an object.");
+        Local<Value> changed = args[2]->ToObject()->Get(String::NewSymbol("changedOnly"));
+        if (!changed->IsUndefined()) {
+            if (!changed->IsBoolean())
+                return NanThrowTypeError("changedOnly must be boolean.");
+            changed_only = changed->BooleanValue();
+        }
+    }
+
+    Local<Function> callback = Local<Function>::Cast(args[args.Length()-1]);
+    FixedJpegStack *jpeg = ObjectWrap::Unwrap<FixedJpegStack>(args.This());
+    if (jpeg->disposed)
+        return NanThrowError("FixedJpegStack has been disposed.");
+
+    TileJob *job = new TileJob(jpeg);
+    for (int y = 0, row = 0; y < jpeg->height; y += tile_h, row++) {
+        for (int x = 0, col = 0; x < jpeg->width; x += tile_w, col++) {
+            Rect tile(x, y, std::min(tile_w, jpeg->width - x), std::min(tile_h, jpeg->height - y));
+            if (changed_only && !jpeg->dirty.any(tile.x, tile.y, tile.w, tile.h))
+                continue;
+            job->tiles.push_back(tile);
+            job->cols.push_back(col);
+            job->rows.push_back(row);
+        }
+    }
+    jpeg->dirty.clear();
+    job->jpegs.resize(job->tiles.size(), NULL);
+    job->jpeg_lens.resize(job->tiles.size(), 0);
+    job->callback = new NanCallback(callback);
 
-    NanAsyncQueueWorker(new FixedJpegStack::FixedJpegEncodeWorker(new NanCallback(callback), jpeg));
+    // a worker per threadpool thread, or per tile if there are fewer
+    job->workers = std::min(threadpool_size(), (int)job->tiles.size());
+    if (job->workers < 1) job->workers = 1;
+    for (int i = job->workers; i > 0; i--)
+        NanAsyncQueueWorker(new FixedJpegStack::FixedJpegTilesWorker(job));
 
     jpeg->Ref();
+    jpeg->pending++;
 
     NanReturnUndefined();
 }
@@ -6,19 +6,66 @@
 
 #include "common.h"
 #include "jpeg_encoder.h"
+#include "tiled_canvas.h"
+#include "yuv_canvas.h"
+#include "external_memory.h"
+#include "shared_region.h"
+#include "dirty_map.h"
 
 class FixedJpegStack : public node::ObjectWrap {
     int width, height, quality;
+    bool progressive;
     buffer_type buf_type;
 
-    unsigned char *data;
+    TiledCanvas *canvas;
+    YuvCanvas *yuv; // instead of canvas, with the ycbcr option
+    EncodeStats stats;
+    bool measure; // setMetrics
+    ImageMetrics metrics; // of the last measured encode
+    ExternalMemory memory; // canvas bytes reported to V8
+    DirtyMap dirty; // what changed since the last encodeTiles
+    int pending; // async encodes that still use the canvas
+    bool disposed;
+
+    void UpdateMemory();
+
+    // One encodeTiles call: the grid tiles to encode, which a few
+    // FixedJpegTilesWorkers take turns picking off, and their JPEGs. The
+    // callback gets them all once the last worker is done.
+    struct TileJob {
+        FixedJpegStack *jpeg_obj;
+        int quality;
+        bool progressive;
+        std::vector<Rect> tiles;
+        std::vector<int> cols, rows; // grid position of each tile
+        std::vector<char *> jpegs;
+        std::vector<unsigned long> jpeg_lens;
+        int next; // next tile to take, atomic
+        int workers; // still running
+        NanCallback *callback;
+        char *errmsg; // of the first tile that failed
+
+        TileJob(FixedJpegStack *jpeg);
+        ~TileJob();
+        void worker_done(); // on the main thread, as each worker finishes
+    };
 
 public:
     static void Initialize(v8::Handle<v8::Object> target);
-    FixedJpegStack(int wwidth, int hheight, buffer_type bbuf_type);
+    FixedJpegStack(int wwidth, int hheight, buffer_type bbuf_type, bool ycbcr = false);
+    ~FixedJpegStack();
     v8::Handle<v8::Value> JpegEncodeSync();
-    void Push(unsigned char *data_buf, int x, int y, int w, int h);
+    void Push(unsigned char *data_buf, int x, int y, int w, int h, size_t stride = 0,
+        blend_mode blend = BLEND_NONE, const ScaleOptions &scale = ScaleOptions());
+    void PushShared(const SharedRegion *region, size_t start, size_t span,
+        int x, int y, int w, int h, size_t stride = 0,
+        blend_mode blend = BLEND_NONE, const ScaleOptions &scale = ScaleOptions());
+    void CopyRect(const Rect &src, int dst_x, int dst_y);
+    void SetSolidBackground(unsigned char r, unsigned char g, unsigned char b, int w, int h);
     void SetQuality(int q);
+    void SetProgressive(bool p);
+    void AddStats(const EncodeStats &run);
+    void Dispose();
 
     class FixedJpegEncodeWorker : public JpegEncoder::EncodeWorker {
     public:
@@ -33,11 +80,50 @@ public:
         FixedJpegStack *jpeg_obj;
     };
 
+    class FixedJpegEncodeToFileWorker : public JpegEncoder::EncodeWorker {
+    public:
+        FixedJpegEncodeToFileWorker(NanCallback *callback, FixedJpegStack *jpeg, const FileTarget &ttarget) :
+            JpegEncoder::EncodeWorker(callback), jpeg_obj(jpeg), target(ttarget) {
+        };
+        ~FixedJpegEncodeToFileWorker() { free(target.path); }
+
+        void Execute();
+        void HandleOKCallback();
+        void HandleErrorCallback();
+
+    private:
+        FixedJpegStack *jpeg_obj;
+        FileTarget target;
+    };
+
+    class FixedJpegTilesWorker : public JpegEncoder::EncodeWorker {
+    public:
+        FixedJpegTilesWorker(TileJob *jjob) : JpegEncoder::EncodeWorker(NULL), job(jjob) {
+        };
+
+        void Execute();
+        void HandleOKCallback();
+        void HandleErrorCallback();
+
+    private:
+        TileJob *job;
+    };
+
     static NAN_METHOD(New);
     static NAN_METHOD(JpegEncodeSync);
     static NAN_METHOD(JpegEncodeAsync);
+    static NAN_METHOD(JpegEncodeToFileAsync);
+    static NAN_METHOD(JpegEncodeTilesAsync);
     static NAN_METHOD(Push);
+    static NAN_METHOD(CopyRect);
+    static NAN_METHOD(SetSolidBackground);
     static NAN_METHOD(SetQuality);
+    static NAN_METHOD(SetProgressive);
+    static NAN_METHOD(SetMetrics);
+    static NAN_METHOD(GetMetrics);
+    static NAN_METHOD(GetStats);
+    static NAN_METHOD(ResetStats);
+    static NAN_METHOD(Dispose);
 };
 
 
@@ -0,0 +1,175 @@
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include "image_metrics.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+MetricsAccumulator::MetricsAccumulator(int wwidth, int hheight) :
+    width(wwidth), height(hheight), blocks(wwidth/4), rows(0),
+    sq_err(0), ssim_sum(0), windows(0),
+    luma_a(wwidth), luma_b(wwidth),
+    s1(blocks*2), s2(blocks*2), ss(blocks*2), s12(blocks*2),
+    prev_blocks(blocks*4), cur_blocks(blocks*4), have_prev(false),
+    g_s1(0), g_s2(0), g_ss(0), g_s12(0) {}
+
+// Sum of squared differences of n bytes.
+static uint64_t
+squared_error(const unsigned char *a, const unsigned char *b, int n)
+{
+    uint64_t sum = 0;
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    while (i + 16 <= n) {
+        // at most 2*255^2 per lane and step, flush well before 2^31
+        __m128i acc = zero;
+        for (int k = 0; k < 1024 && i + 16 <= n; k++, i += 16) {
+            __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+            __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+            __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+            __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+            acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+        }
+        int32_t lanes[4];
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        sum += (uint64_t)(uint32_t)lanes[0] + (uint32_t)lanes[1] +
+            (uint32_t)lanes[2] + (uint32_t)lanes[3];
+    }
+#endif
+
+    for (; i < n; i++) {
+        int d = a[i] - b[i];
+        sum += d*d;
+    }
+    return sum;
+}
+
+// Adds a row of luma to the per column pair sums of the strip. n is even.
+static void
+add_luma_row(const unsigned char *a, const unsigned char *b, int n,
+    int32_t *s1, int32_t *s2, int32_t *ss, int32_t *s12)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    for (; i + 8 <= n; i += 8) {
+        __m128i va = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(a + i)), zero);
+        __m128i vb = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(b + i)), zero);
+        int p = i/2;
+        // madd sums adjacent 16-bit products, which is one column pair
+        __m128i *d1 = (__m128i *)(s1 + p), *d2 = (__m128i *)(s2 + p);
+        __m128i *dss = (__m128i *)(ss + p), *d12 = (__m128i *)(s12 + p);
+        _mm_storeu_si128(d1, _mm_add_epi32(_mm_loadu_si128(d1), _mm_madd_epi16(va, ones)));
+        _mm_storeu_si128(d2, _mm_add_epi32(_mm_loadu_si128(d2), _mm_madd_epi16(vb, ones)));
+        _mm_storeu_si128(dss, _mm_add_epi32(_mm_loadu_si128(dss),
+            _mm_add_epi32(_mm_madd_epi16(va, va), _mm_madd_epi16(vb, vb))));
+        _mm_storeu_si128(d12, _mm_add_epi32(_mm_loadu_si128(d12), _mm_madd_epi16(va, vb)));
+    }
+#endif
+
+    for (; i < n; i += 2) {
+        int p = i/2;
+        s1[p] += a[i] + a[i+1];
+        s2[p] += b[i] + b[i+1];
+        ss[p] += a[i]*a[i] + a[i+1]*a[i+1] + b[i]*b[i] + b[i+1]*b[i+1];
+        s12[p] += a[i]*b[i] + a[i+1]*b[i+1];
+    }
+}
+
+static void
+rgb_to_luma(const unsigned char *rgb, unsigned char *y, int n)
+{
+    for (int i = 0; i < n; i++, rgb += 3)
+        y[i] = (77*rgb[0] + 150*rgb[1] + 29*rgb[2] + 128) >> 8;
+}
+
+// SSIM of one window from its sums over n pixels.
+static double
+window_ssim(double s1, double s2, double ss, double s12, double n)
+{
+    const double c1 = .01*.01*255*255*n*n;
+    const double c2 = .03*.03*255*255*n*(n - 1);
+    double vars = ss*n - s1*s1 - s2*s2;
+    double covar = s12*n - s1*s2;
+    return (2*s1*s2 + c1)*(2*covar + c2)/((s1*s1 + s2*s2 + c1)*(vars + c2));
+}
+
+void
+MetricsAccumulator::add_row(const unsigned char *a, const unsigned char *b)
+{
+    if (rows >= height) return;
+    sq_err += squared_error(a, b, width*3);
+
+    rgb_to_luma(a, &luma_a[0], width);
+    rgb_to_luma(b, &luma_b[0], width);
+
+    if (width < 8 || height < 8) {
+        for (int i = 0; i < width; i++) {
+            g_s1 += luma_a[i];
+            g_s2 += luma_b[i];
+            g_ss += luma_a[i]*luma_a[i] + luma_b[i]*luma_b[i];
+            g_s12 += luma_a[i]*luma_b[i];
+        }
+    }
+    else {
+        add_luma_row(&luma_a[0], &luma_b[0], blocks*4, &s1[0], &s2[0], &ss[0], &s12[0]);
+    }
+
+    rows++;
+    if (rows%4 == 0 && blocks) end_strip();
+}
+
+// Turns the strip's column pair sums into 4x4 block sums and scores the
+// 8x8 windows made of them and the blocks of the strip above.
+void
+MetricsAccumulator::end_strip()
+{
+    for (int k = 0; k < blocks; k++) {
+        int32_t *blk = &cur_blocks[k*4];
+        blk[0] = s1[2*k] + s1[2*k+1];
+        blk[1] = s2[2*k] + s2[2*k+1];
+        blk[2] = ss[2*k] + ss[2*k+1];
+        blk[3] = s12[2*k] + s12[2*k+1];
+    }
+    memset(&s1[0], 0, s1.size()*sizeof(s1[0]));
+    memset(&s2[0], 0, s2.size()*sizeof(s2[0]));
+    memset(&ss[0], 0, ss.size()*sizeof(ss[0]));
+    memset(&s12[0], 0, s12.size()*sizeof(s12[0]));
+
+    if (have_prev) {
+        for (int k = 0; k + 1 < blocks; k++) {
+            const int32_t *p = &prev_blocks[k*4], *c = &cur_blocks[k*4];
+            double w[4];
+            for (int j = 0; j < 4; j++)
+                w[j] = (double)p[j] + p[4+j] + c[j] + c[4+j];
+            ssim_sum += window_ssim(w[0], w[1], w[2], w[3], 64);
+            windows++;
+        }
+    }
+    prev_blocks.swap(cur_blocks);
+    have_prev = true;
+}
+
+ImageMetrics
+MetricsAccumulator::result() const
+{
+    ImageMetrics m;
+    double samples = (double)width*rows*3;
+    m.mse = samples ? sq_err/samples : 0;
+    m.psnr = m.mse ? 10*log10(255.0*255.0/m.mse) : std::numeric_limits<double>::infinity();
+    if (windows)
+        m.ssim = ssim_sum/windows;
+    else if (width && rows)
+        m.ssim = window_ssim(g_s1, g_s2, g_ss, g_s12, (double)width*rows);
+    else
+        m.ssim = 1;
+    m.valid = true;
+    return m;
+}
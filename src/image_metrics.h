@@ -0,0 +1,48 @@
+#ifndef IMAGE_METRICS_H
+#define IMAGE_METRICS_H
+
+#include <stdint.h>
+#include <vector>
+
+// How close a JPEG is to its source. psnr is over R, G and B (infinite when
+// they are identical), ssim is the mean SSIM of luma over 8x8 windows
+// every 4 pixels, like x264 computes it.
+struct ImageMetrics {
+    bool valid;
+    double mse, psnr, ssim;
+
+    ImageMetrics() : valid(false), mse(0), psnr(0), ssim(0) {}
+};
+
+// Accumulates ImageMetrics over two width x height RGB images that are fed
+// in row by row, keeping only 4 rows of luma sums.
+class MetricsAccumulator {
+    int width, height;
+    int blocks; // 4x4 luma blocks per strip
+    int rows;   // rows added so far
+
+    uint64_t sq_err;
+    double ssim_sum;
+    long windows;
+
+    std::vector<unsigned char> luma_a, luma_b;
+    // per pair of columns over the current strip of 4 rows
+    std::vector<int32_t> s1, s2, ss, s12;
+    // per 4x4 block: strip above and current strip, 4 sums each
+    std::vector<int32_t> prev_blocks, cur_blocks;
+    bool have_prev;
+
+    // whole image luma sums, for images too small for an 8x8 window
+    double g_s1, g_s2, g_ss, g_s12;
+
+    void end_strip();
+
+public:
+    MetricsAccumulator(int wwidth, int hheight);
+
+    void add_row(const unsigned char *a, const unsigned char *b);
+    ImageMetrics result() const;
+};
+
+#endif
+
@@ -7,6 +7,11 @@
 #include "common.h"
 #include "jpeg.h"
 #include "jpeg_encoder.h"
+#include "js_args.h"
+#include "mapped_file.h"
+#include "shared_memory.h"
+#include "scan_emitter.h"
+#include "dct_image.h"
 
 using namespace v8;
 using namespace node;
@@ -20,29 +25,153 @@ Jpeg::Initialize(v8::Handle<v8::Object> target)
     t->InstanceTemplate()->SetInternalFieldCount(1);
     NODE_SET_PROTOTYPE_METHOD(t, "encode", JpegEncodeAsync);
     NODE_SET_PROTOTYPE_METHOD(t, "encodeSync", JpegEncodeSync);
+    NODE_SET_PROTOTYPE_METHOD(t, "encodeToFile", JpegEncodeToFileAsync);
+    NODE_SET_PROTOTYPE_METHOD(t, "encodeVariants", JpegEncodeVariantsAsync);
     NODE_SET_PROTOTYPE_METHOD(t, "setQuality", SetQuality);
     NODE_SET_PROTOTYPE_METHOD(t, "setSmoothing", SetSmoothing);
+    NODE_SET_PROTOTYPE_METHOD(t, "setProgressive", SetProgressive);
+    NODE_SET_PROTOTYPE_METHOD(t, "setMetrics", SetMetrics);
+    NODE_SET_PROTOTYPE_METHOD(t, "getMetrics", GetMetrics);
+    NODE_SET_PROTOTYPE_METHOD(t, "getStats", GetStats);
+    NODE_SET_PROTOTYPE_METHOD(t, "resetStats", ResetStats);
+    NODE_SET_PROTOTYPE_METHOD(t, "dispose", Dispose);
     target->Set(String::NewSymbol("Jpeg"), t->GetFunction());
 }
 
 Jpeg::Jpeg(unsigned char *ddata, int wwidth, int hheight, int qquality, buffer_type bbuf_type) :
-    jpeg_encoder(ddata, wwidth, hheight, qquality, bbuf_type) {}
+    jpeg_encoder(ddata, wwidth, hheight, qquality, bbuf_type), mapping(NULL),
+    region(NULL), measure(false), pending(0), disposed(false) {}
+
+Jpeg::~Jpeg()
+{
+    delete mapping;
+    if (region) region->unref();
+    // Dispose has let go of the source already
+    if (!disposed && !source.IsEmpty()) NanDispose(source);
+}
+
+void
+Jpeg::Encode(EncodeStats *run_stats, JpegScanListener *scans, ImageMetrics *run_metrics)
+{
+    jpeg_encoder.set_stats(run_stats);
+    jpeg_encoder.set_scan_listener(scans);
+    jpeg_encoder.set_metrics(run_metrics);
+    if (mapping) mapping->advise_sequential();
+    try {
+        if (!region) {
+            jpeg_encoder.encode();
+        }
+        else {
+            // a frame the writer got to while it was being encoded is torn,
+            // encode it again
+            for (int i = 0; ; i++) {
+                uint32_t gen = region->begin_read();
+                jpeg_encoder.encode();
+                if (region->end_read(gen)) break;
+                jpeg_encoder.free_jpeg();
+                if (i + 1 == SharedRegion::MAX_READS)
+                    throw "Shared frame kept changing while it was encoded.";
+            }
+        }
+    }
+    catch (...) {
+        jpeg_encoder.set_scan_listener(NULL);
+        jpeg_encoder.set_metrics(NULL);
+        if (mapping) mapping->release_pages();
+        throw;
+    }
+    jpeg_encoder.set_scan_listener(NULL);
+    jpeg_encoder.set_metrics(NULL);
+    if (mapping) mapping->release_pages();
+}
+
+void
+Jpeg::EncodeToFile(const FileTarget &target, EncodeStats *run_stats)
+{
+    jpeg_encoder.set_stats(run_stats);
+    if (mapping) mapping->advise_sequential();
+    try {
+        if (!region) {
+            jpeg_encoder.encode_to_file(target);
+        }
+        else {
+            // a path is truncated when it's opened, so a torn frame can be
+            // written again; an fd already has the torn JPEG in it
+            for (int i = 0; ; i++) {
+                uint32_t gen = region->begin_read();
+                jpeg_encoder.encode_to_file(target);
+                if (region->end_read(gen)) break;
+                if (!target.path)
+                    throw "Shared frame changed while it was encoded.";
+                if (i + 1 == SharedRegion::MAX_READS)
+                    throw "Shared frame kept changing while it was encoded.";
+            }
+        }
+    }
+    catch (...) {
+        if (mapping) mapping->release_pages();
+        throw;
+    }
+    if (mapping) mapping->release_pages();
+}
+
+// A Buffer's pixels are only borrowed by the pyramid; a file's pages are
+// released afterwards and a shared frame may change, so those are copied.
+void
+Jpeg::BuildVariants(VariantPyramid &pyramid)
+{
+    if (mapping) mapping->advise_sequential();
+    try {
+        if (!region) {
+            jpeg_encoder.build_variants(pyramid, !mapping);
+        }
+        else {
+            for (int i = 0; ; i++) {
+                uint32_t gen = region->begin_read();
+                jpeg_encoder.build_variants(pyramid, false);
+                if (region->end_read(gen)) break;
+                if (i + 1 == SharedRegion::MAX_READS)
+                    throw "Shared frame kept changing while it was encoded.";
+            }
+        }
+    }
+    catch (...) {
+        if (mapping) mapping->release_pages();
+        throw;
+    }
+    if (mapping) mapping->release_pages();
+}
 
 Handle<Value>
 Jpeg::JpegEncodeSync()
 {
     NanScope();
 
+    EncodeStats run;
+    EncodeStats *run_stats = stats_enabled() ? &run : NULL;
+    ImageMetrics run_metrics;
+
     try {
-        jpeg_encoder.encode();
+        Encode(run_stats, NULL, measure ? &run_metrics : NULL);
     }
     catch (const char *err) {
         return ThrowException(Exception::Error(String::New(err)));
     }
 
-    int jpeg_len = jpeg_encoder.get_jpeg_len();
+    unsigned long jpeg_len = jpeg_encoder.get_jpeg_len();
+    if (jpeg_len > MAX_BUFFER_LENGTH) {
+        jpeg_encoder.free_jpeg();
+        return ThrowException(Exception::Error(String::New("Encoded JPEG is too large for a Buffer.")));
+    }
+    uint64_t t0 = run_stats ? stats_clock() : 0;
     Local<Object> retbuf = NanNewBufferHandle(jpeg_len);
     memcpy(Buffer::Data(retbuf), jpeg_encoder.get_jpeg(), jpeg_len);
+    jpeg_encoder.free_jpeg();
+    if (run_metrics.valid) metrics = run_metrics;
+    if (run_stats) {
+        run.copy_ns += stats_clock() - t0;
+        AddStats(run);
+    }
     return scope.Close(retbuf);
 }
 
@@ -58,14 +187,42 @@ Jpeg::SetSmoothing(int s)
     jpeg_encoder.set_smoothing(s);
 }
 
+void
+Jpeg::SetProgressive(bool p)
+{
+    jpeg_encoder.set_progressive(p);
+}
+
+void
+Jpeg::AddStats(const EncodeStats &run)
+{
+    stats.add(run);
+    add_global_stats(run);
+}
+
+// Unmaps a pixel file now rather than whenever the GC gets to the object.
+void
+Jpeg::Dispose()
+{
+    delete mapping;
+    mapping = NULL;
+    if (region) region->unref();
+    region = NULL;
+    if (!source.IsEmpty()) NanDispose(source);
+    disposed = true;
+}
+
 NAN_METHOD(Jpeg::New)
 {
     NanScope();
 
     if (args.Length() < 3)
         return NanThrowError("At least three arguments required - buffer, width, height, [and buffer type]");
-    if (!Buffer::HasInstance(args[0]))
-        return NanThrowTypeError("First argument must be Buffer.");
+    unsigned char *bytes = NULL;
+    size_t bytes_len = 0;
+    SharedMemory *shm = SharedMemory::FromValue(args[0]);
+    if (!shm && !args[0]->IsString() && !get_bytes(args[0], bytes, bytes_len))
+        return NanThrowTypeError("First argument must be a Buffer, typed array, ArrayBuffer, SharedMemory or path to a raw pixel file.");
     if (!args[1]->IsInt32())
         return NanThrowTypeError("Second argument must be integer width.");
     if (!args[2]->IsInt32())
@@ -85,31 +242,61 @@ NAN_METHOD(Jpeg::New)
         return NanThrowRangeError("Quality must be between 0 and 100");
 
     buffer_type buf_type = BUF_RGB;
-    if (args.Length() == 5) {
+    if (args.Length() >= 5) {
         if (!args[4]->IsString())
-            return NanThrowTypeError("Fifth argument must be a string. Either 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return NanThrowTypeError("Fifth argument must be a string. One of " BUFFER_TYPES ".");
 
         String::AsciiValue bt(args[4]->ToString());
-        if (!(str_eq(*bt, "rgb") || str_eq(*bt, "bgr") ||
-            str_eq(*bt, "rgba") || str_eq(*bt, "bgra")))
-        {
-            return NanThrowTypeError("Buffer type must be 'rgb', 'bgr', 'rgba' or 'bgra'.");
-        }
+        if (!parse_buffer_type(*bt, buf_type))
+            return NanThrowTypeError("Buffer type must be " BUFFER_TYPES ".");
+    }
 
-        if (str_eq(*bt, "rgb"))
-            buf_type = BUF_RGB;
-        else if (str_eq(*bt, "bgr"))
-            buf_type = BUF_BGR;
-        else if (str_eq(*bt, "rgba"))
-            buf_type = BUF_RGBA;
-        else if (str_eq(*bt, "bgra"))
-            buf_type = BUF_BGRA;
-        else
-            return NanThrowTypeError("Buffer type wasn't 'rgb', 'bgr', 'rgba' or 'bgra'.");
+    SourceOptions src;
+    if (args.Length() >= 6) {
+        const char *err = parse_source_options(args[5], src);
+        if (err) return NanThrowTypeError(err);
+    }
+    size_t start, span;
+    const char *extent_err = source_extent(src, w, h, buf_type, start, span);
+    if (extent_err) return NanThrowRangeError(extent_err);
+
+    unsigned char *data;
+    MappedFile *mapping = NULL;
+    const SharedRegion *region = NULL;
+    if (args[0]->IsString()) {
+        String::Utf8Value path(args[0]);
+        mapping = new MappedFile;
+        try {
+            mapping->open(*path, start, span);
+        }
+        catch (const char *err) {
+            delete mapping;
+            return NanThrowError(err);
+        }
+        data = (unsigned char *)mapping->data();
+    }
+    else if (shm) {
+        region = shm->get_region();
+        if (!region)
+            return NanThrowError("SharedMemory has been disposed.");
+        if (!extent_fits(start, span, region->size()))
+            return NanThrowRangeError("Shared memory is too small for the given width, height and buffer type.");
+        data = (unsigned char *)region->data() + start;
+        region->ref();
+    }
+    else {
+        if (!extent_fits(start, span, bytes_len))
+            return NanThrowRangeError("Buffer is too small for the given width, height and buffer type.");
+        data = bytes + start;
     }
 
-    Local<Object> buffer = args[0]->ToObject();
-    Jpeg *jpeg = new Jpeg((unsigned char*) Buffer::Data(buffer), w, h, q, buf_type);
+    Jpeg *jpeg = new Jpeg(data, w, h, q, buf_type);
+    jpeg->jpeg_encoder.set_stride(src.stride);
+    jpeg->mapping = mapping;
+    jpeg->region = region;
+    // the pixels aren't copied, so the GC mustn't collect what holds them
+    // while the Jpeg can still encode them
+    if (bytes) NanAssignPersistent(Object, jpeg->source, args[0]->ToObject());
     jpeg->Wrap(args.This());
     NanReturnValue(args.This());
 }
@@ -119,6 +306,9 @@ NAN_METHOD(Jpeg::JpegEncodeSync)
     NanScope();
 
     Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
+    if (jpeg->disposed)
+        return NanThrowError("Jpeg has been disposed.");
+
     NanReturnValue(jpeg->JpegEncodeSync());
 }
 
@@ -168,28 +358,114 @@ NAN_METHOD(Jpeg::SetSmoothing)
     NanReturnUndefined();
 }
 
+NAN_METHOD(Jpeg::SetProgressive)
+{
+    NanScope();
+
+    if (args.Length() != 1)
+        return NanThrowError("One argument required - progressive");
+
+    if (!args[0]->IsBoolean())
+        return NanThrowTypeError("First argument must be boolean progressive");
+
+    Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
+    jpeg->SetProgressive(args[0]->BooleanValue());
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(Jpeg::SetMetrics)
+{
+    NanScope();
+
+    if (args.Length() != 1)
+        return NanThrowError("One argument required - metrics");
+
+    if (!args[0]->IsBoolean())
+        return NanThrowTypeError("First argument must be boolean metrics");
+
+    Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
+    jpeg->measure = args[0]->BooleanValue();
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(Jpeg::GetMetrics)
+{
+    NanScope();
+
+    Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
+    if (!jpeg->metrics.valid)
+        NanReturnUndefined();
+    NanReturnValue(metrics_object(jpeg->metrics));
+}
+
+NAN_METHOD(Jpeg::GetStats)
+{
+    NanScope();
+
+    Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
+    NanReturnValue(stats_object(jpeg->stats));
+}
+
+NAN_METHOD(Jpeg::ResetStats)
+{
+    NanScope();
+
+    Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
+    jpeg->stats.reset();
+    NanReturnUndefined();
+}
+
+NAN_METHOD(Jpeg::Dispose)
+{
+    NanScope();
+
+    Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
+    if (jpeg->pending)
+        return NanThrowError("Can't dispose while an encode is running.");
+    jpeg->Dispose();
+    NanReturnUndefined();
+}
+
 void Jpeg::JpegEncodeWorker::Execute() {
+    started();
     try {
-        jpeg_obj->jpeg_encoder.encode();
+        jpeg_obj->Encode(run_stats(), scans, jpeg_obj->measure ? &metrics : NULL);
         jpeg_len = jpeg_obj->jpeg_encoder.get_jpeg_len();
+        if (jpeg_len > MAX_BUFFER_LENGTH)
+            throw "Encoded JPEG is too large for a Buffer.";
+        uint64_t t0 = run_stats() ? stats_clock() : 0;
         jpeg = (char *)malloc(sizeof(*jpeg)*jpeg_len);
         if (!jpeg) {
             errmsg = strdup("malloc in Jpeg::JpegEncodeWorker::Execute() failed.");
         }
         else {
             memcpy(jpeg, jpeg_obj->jpeg_encoder.get_jpeg(), jpeg_len);
+            if (run_stats()) {
+                stats.copy_ns += stats_clock() - t0;
+                stats.allocations++;
+            }
         }
     } catch (const char *err) {
         errmsg = strdup(err);
     }
-
+    jpeg_obj->jpeg_encoder.free_jpeg();
 }
 
 void Jpeg::JpegEncodeWorker::HandleOKCallback() {
     NanScope();
 
+    finish_scans();
+    if (metrics.valid) jpeg_obj->metrics = metrics;
+
+    uint64_t t0 = run_stats() ? stats_clock() : 0;
     Local<Object> buf = NanNewBufferHandle(jpeg_len);
     memcpy(Buffer::Data(buf), jpeg, jpeg_len);
+    if (run_stats()) {
+        stats.copy_ns += stats_clock() - t0;
+        jpeg_obj->AddStats(stats);
+    }
     Local<Value> argv[2] = {buf, Undefined()};
 
     TryCatch try_catch; // don't quite see the necessity of this
@@ -203,11 +479,14 @@ void Jpeg::JpegEncodeWorker::HandleOKCallback() {
     free(jpeg);
     jpeg = NULL;
 
+    jpeg_obj->pending--;
     jpeg_obj->Unref();
 }
 
 void Jpeg::JpegEncodeWorker::HandleErrorCallback() {
     NanScope();
+
+    finish_scans();
     Local<Value> argv[2] = {Undefined(), v8::Exception::Error(v8::String::New(errmsg))};
 
     TryCatch try_catch; // don't quite see the necessity of this
@@ -222,6 +501,8 @@ void Jpeg::JpegEncodeWorker::HandleErrorCallback() {
         free(jpeg);
     }
 
+    if (run_stats()) jpeg_obj->AddStats(stats);
+    jpeg_obj->pending--;
     jpeg_obj->Unref();
 }
 
@@ -229,18 +510,279 @@ NAN_METHOD(Jpeg::JpegEncodeAsync)
 {
     NanScope();
 
-    if (args.Length() != 1)
-        return NanThrowError("One argument required - callback function.");
+    if (args.Length() != 1 && args.Length() != 2)
+        return NanThrowError("One argument required - callback function, [and onScan function].");
 
     if (!args[0]->IsFunction())
         return NanThrowTypeError("First argument must be a function.");
+    if (args.Length() == 2 && !args[1]->IsFunction())
+        return NanThrowTypeError("Second argument must be a function.");
 
     Local<Function> callback = Local<Function>::Cast(args[0]);
     Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
+    if (jpeg->disposed)
+        return NanThrowError("Jpeg has been disposed.");
+
+    Jpeg::JpegEncodeWorker *worker = new Jpeg::JpegEncodeWorker(new NanCallback(callback), jpeg);
+    if (args.Length() == 2)
+        worker->set_scans(new ScanEmitter(new NanCallback(Local<Function>::Cast(args[1]))));
+    NanAsyncQueueWorker(worker);
+
+    jpeg->Ref();
+    jpeg->pending++;
+
+    NanReturnUndefined();
+}
+
+
+void Jpeg::JpegEncodeToFileWorker::Execute() {
+    started();
+    try {
+        jpeg_obj->EncodeToFile(target, run_stats());
+        jpeg_len = jpeg_obj->jpeg_encoder.get_jpeg_len();
+    } catch (const char *err) {
+        errmsg = strdup(err);
+    }
+}
+
+void Jpeg::JpegEncodeToFileWorker::HandleOKCallback() {
+    NanScope();
+
+    Local<Value> argv[2] = {Number::New(jpeg_len), Undefined()};
+
+    TryCatch try_catch;
+
+    callback->Call(2, argv);
+
+    if (try_catch.HasCaught()) {
+        FatalException(try_catch);
+    }
+
+    if (run_stats()) jpeg_obj->AddStats(stats);
+    jpeg_obj->pending--;
+    jpeg_obj->Unref();
+}
+
+void Jpeg::JpegEncodeToFileWorker::HandleErrorCallback() {
+    NanScope();
+    Local<Value> argv[2] = {Undefined(), v8::Exception::Error(v8::String::New(errmsg))};
+
+    TryCatch try_catch;
+
+    callback->Call(2, argv);
+
+    if (try_catch.HasCaught()) {
+        FatalException(try_catch);
+    }
+
+    if (run_stats()) jpeg_obj->AddStats(stats);
+    jpeg_obj->pending--;
+    jpeg_obj->Unref();
+}
+
+NAN_METHOD(Jpeg::JpegEncodeToFileAsync)
+{
+    NanScope();
+
+    if (args.Length() != 2 && args.Length() != 3)
+        return NanThrowError("Two or three arguments required - path or fd, [options], callback function.");
+
+    if (!args[args.Length()-1]->IsFunction())
+        return NanThrowTypeError("Last argument must be a function.");
+
+    Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
+    if (jpeg->disposed)
+        return NanThrowError("Jpeg has been disposed.");
+
+    FileTarget target;
+    const char *err = parse_file_target(args[0],
+        args.Length() == 3 ? args[1] : Handle<Value>(Undefined()), target);
+    if (err) {
+        free(target.path);
+        return NanThrowTypeError(err);
+    }
+
+    Local<Function> callback = Local<Function>::Cast(args[args.Length()-1]);
+
+    NanAsyncQueueWorker(new Jpeg::JpegEncodeToFileWorker(new NanCallback(callback), jpeg, target));
+
+    jpeg->Ref();
+    jpeg->pending++;
+
+    NanReturnUndefined();
+}
+
+Jpeg::VariantJob::VariantJob(Jpeg *jpeg, const std::vector<JpegVariant> &variants,
+    resample_filter filter) :
+    jpeg_obj(jpeg), pyramid(variants, filter),
+    progressive(jpeg->jpeg_encoder.get_progressive()), callback(NULL),
+    jpegs(variants.size(), (char *)NULL), jpeg_lens(variants.size(), 0),
+    remaining(variants.size()), errmsg(NULL) {}
+
+Jpeg::VariantJob::~VariantJob()
+{
+    for (size_t i = 0; i < jpegs.size(); i++)
+        free(jpegs[i]);
+    free(errmsg);
+    delete callback;
+}
+
+void
+Jpeg::VariantJob::variant_done()
+{
+    if (--remaining) return;
+
+    NanScope();
+
+    Local<Value> argv[2] = {Undefined(), Undefined()};
+    if (errmsg) {
+        argv[1] = v8::Exception::Error(v8::String::New(errmsg));
+    }
+    else {
+        Local<Array> list = Array::New(jpegs.size());
+        for (size_t i = 0; i < jpegs.size(); i++) {
+            Local<Object> buf = NanNewBufferHandle(jpeg_lens[i]);
+            memcpy(Buffer::Data(buf), jpegs[i], jpeg_lens[i]);
+            list->Set(i, buf);
+        }
+        argv[0] = list;
+    }
+    pyramid.clear();
+
+    TryCatch try_catch;
+
+    callback->Call(2, argv);
+
+    if (try_catch.HasCaught()) {
+        FatalException(try_catch);
+    }
+
+    jpeg_obj->pending--;
+    jpeg_obj->Unref();
+    delete this;
+}
+
+void Jpeg::JpegVariantsWorker::Execute() {
+    started();
+    try {
+        uint64_t t0 = run_stats() ? stats_clock() : 0;
+        job->jpeg_obj->BuildVariants(job->pyramid);
+        if (run_stats()) stats.convert_ns += stats_clock() - t0;
+    } catch (const char *err) {
+        errmsg = strdup(err);
+    }
+}
+
+void Jpeg::JpegVariantsWorker::HandleOKCallback() {
+    NanScope();
+
+    if (run_stats()) job->jpeg_obj->AddStats(stats);
+
+    // the job calls back once the last variant is encoded
+    job->callback = callback;
+    callback = NULL;
+    for (size_t i = 0; i < job->pyramid.size(); i++)
+        NanAsyncQueueWorker(new Jpeg::JpegVariantWorker(job, i));
+}
+
+void Jpeg::JpegVariantsWorker::HandleErrorCallback() {
+    NanScope();
+    Local<Value> argv[2] = {Undefined(), v8::Exception::Error(v8::String::New(errmsg))};
+
+    TryCatch try_catch;
+
+    callback->Call(2, argv);
+
+    if (try_catch.HasCaught()) {
+        FatalException(try_catch);
+    }
+
+    if (run_stats()) job->jpeg_obj->AddStats(stats);
+    job->jpeg_obj->pending--;
+    job->jpeg_obj->Unref();
+    delete job;
+}
+
+void Jpeg::JpegVariantWorker::Execute() {
+    started();
+    const JpegVariant &variant = job->pyramid.variant(index);
+    const VariantPyramid::Level &level = job->pyramid.level(index);
+
+    JpegEncoder encoder((unsigned char *)level.rgb, level.width, level.height,
+        variant.quality, BUF_RGB);
+    encoder.set_progressive(job->progressive);
+    encoder.set_stats(run_stats());
+    try {
+        if (level.dct) {
+            // same size as another variant, only quantize the shared DCT
+            QuantizedDct coefs(*level.dct, variant.quality, job->progressive);
+            encoder.set_coef_source(&coefs);
+            encoder.encode();
+            encoder.set_coef_source(NULL);
+        }
+        else {
+            encoder.encode();
+        }
+        jpeg_len = encoder.get_jpeg_len();
+        if (jpeg_len > MAX_BUFFER_LENGTH)
+            throw "Encoded JPEG is too large for a Buffer.";
+        jpeg = (char *)malloc(sizeof(*jpeg)*jpeg_len);
+        if (!jpeg) {
+            errmsg = strdup("malloc in Jpeg::JpegVariantWorker::Execute() failed.");
+        }
+        else {
+            memcpy(jpeg, encoder.get_jpeg(), jpeg_len);
+            if (run_stats()) stats.allocations++;
+        }
+    } catch (const char *err) {
+        errmsg = strdup(err);
+    }
+}
+
+void Jpeg::JpegVariantWorker::HandleOKCallback() {
+    job->jpegs[index] = jpeg;
+    job->jpeg_lens[index] = jpeg_len;
+    jpeg = NULL;
+    if (run_stats()) job->jpeg_obj->AddStats(stats);
+    job->variant_done();
+}
+
+void Jpeg::JpegVariantWorker::HandleErrorCallback() {
+    if (!job->errmsg) job->errmsg = strdup(errmsg);
+    free(jpeg);
+    jpeg = NULL;
+    if (run_stats()) job->jpeg_obj->AddStats(stats);
+    job->variant_done();
+}
+
+NAN_METHOD(Jpeg::JpegEncodeVariantsAsync)
+{
+    NanScope();
+
+    if (args.Length() != 2 && args.Length() != 3)
+        return NanThrowError("Two or three arguments required - variants, [options], callback function.");
+
+    if (!args[args.Length()-1]->IsFunction())
+        return NanThrowTypeError("Last argument must be a function.");
+
+    Local<Function> callback = Local<Function>::Cast(args[args.Length()-1]);
+    Jpeg *jpeg = ObjectWrap::Unwrap<Jpeg>(args.This());
+    if (jpeg->disposed)
+        return NanThrowError("Jpeg has been disposed.");
+
+    std::vector<JpegVariant> variants;
+    const char *err = parse_variants(args[0], jpeg->jpeg_encoder.get_width(),
+        jpeg->jpeg_encoder.get_height(), jpeg->jpeg_encoder.get_quality(), variants);
+    resample_filter filter = FILTER_BILINEAR;
+    if (!err && args.Length() == 3)
+        err = parse_variants_options(args[1], filter);
+    if (err) return NanThrowTypeError(err);
 
-    NanAsyncQueueWorker(new Jpeg::JpegEncodeWorker(new NanCallback(callback), jpeg));
+    VariantJob *job = new VariantJob(jpeg, variants, filter);
+    NanAsyncQueueWorker(new Jpeg::JpegVariantsWorker(new NanCallback(callback), job));
 
     jpeg->Ref();
+    jpeg->pending++;
 
     NanReturnUndefined();
 }
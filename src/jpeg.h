@@ -5,9 +5,45 @@
 #include <node_buffer.h>
 
 #include "jpeg_encoder.h"
+#include "mapped_file.h"
+#include "shared_region.h"
+#include "jpeg_variants.h"
 
 class Jpeg : public node::ObjectWrap {
     JpegEncoder jpeg_encoder;
+    MappedFile *mapping; // set when pixels come from a file instead of a Buffer
+    const SharedRegion *region; // set when pixels come from shared memory
+    v8::Persistent<v8::Object> source; // the Buffer or typed array the pixels are in
+
+    EncodeStats stats;
+    bool measure; // setMetrics
+    ImageMetrics metrics; // of the last measured encode
+    int pending; // async encodes that still use the pixels
+    bool disposed;
+
+    void Encode(EncodeStats *run_stats = NULL, JpegScanListener *scans = NULL,
+        ImageMetrics *run_metrics = NULL);
+    void EncodeToFile(const FileTarget &target, EncodeStats *run_stats = NULL);
+    void BuildVariants(VariantPyramid &pyramid);
+
+    // What one encodeVariants call shares: the pyramid that
+    // JpegVariantsWorker builds and the JPEGs that one JpegVariantWorker
+    // per variant then encodes from it in parallel. The callback gets them
+    // all once the last worker is done.
+    struct VariantJob {
+        Jpeg *jpeg_obj;
+        VariantPyramid pyramid;
+        bool progressive;
+        NanCallback *callback;
+        std::vector<char *> jpegs;
+        std::vector<unsigned long> jpeg_lens;
+        size_t remaining;
+        char *errmsg; // of the first variant that failed
+
+        VariantJob(Jpeg *jpeg, const std::vector<JpegVariant> &variants, resample_filter filter);
+        ~VariantJob();
+        void variant_done(); // on the main thread, as each worker finishes
+    };
 
     class JpegEncodeWorker : public JpegEncoder::EncodeWorker {
     public:
@@ -22,18 +58,75 @@ class Jpeg : public node::ObjectWrap {
         Jpeg *jpeg_obj;
     };
 
+    class JpegEncodeToFileWorker : public JpegEncoder::EncodeWorker {
+    public:
+        JpegEncodeToFileWorker(NanCallback *callback, Jpeg *jpeg, const FileTarget &ttarget) :
+            EncodeWorker(callback), jpeg_obj(jpeg), target(ttarget) {
+        };
+        ~JpegEncodeToFileWorker() { free(target.path); }
+
+        void Execute();
+        void HandleOKCallback();
+        void HandleErrorCallback();
+
+    private:
+        Jpeg *jpeg_obj;
+        FileTarget target;
+    };
+
+    class JpegVariantsWorker : public JpegEncoder::EncodeWorker {
+    public:
+        JpegVariantsWorker(NanCallback *callback, VariantJob *jjob) :
+            EncodeWorker(callback), job(jjob) {
+        };
+
+        void Execute();
+        void HandleOKCallback();
+        void HandleErrorCallback();
+
+    private:
+        VariantJob *job;
+    };
+
+    class JpegVariantWorker : public JpegEncoder::EncodeWorker {
+    public:
+        JpegVariantWorker(VariantJob *jjob, size_t iindex) :
+            EncodeWorker(NULL), job(jjob), index(iindex) {
+        };
+
+        void Execute();
+        void HandleOKCallback();
+        void HandleErrorCallback();
+
+    private:
+        VariantJob *job;
+        size_t index;
+    };
+
 public:
     static void Initialize(v8::Handle<v8::Object> target);
     Jpeg(unsigned char *ddata, int wwidth, int hheight, int qquality, buffer_type bbuf_type);
+    ~Jpeg();
     v8::Handle<v8::Value> JpegEncodeSync();
     void SetQuality(int q);
     void SetSmoothing(int s);
+    void SetProgressive(bool p);
+    void AddStats(const EncodeStats &run);
+    void Dispose();
 
     static NAN_METHOD(New);
     static NAN_METHOD(JpegEncodeSync);
     static NAN_METHOD(JpegEncodeAsync);
+    static NAN_METHOD(JpegEncodeToFileAsync);
+    static NAN_METHOD(JpegEncodeVariantsAsync);
     static NAN_METHOD(SetQuality);
     static NAN_METHOD(SetSmoothing);
+    static NAN_METHOD(SetProgressive);
+    static NAN_METHOD(SetMetrics);
+    static NAN_METHOD(GetMetrics);
+    static NAN_METHOD(GetStats);
+    static NAN_METHOD(ResetStats);
+    static NAN_METHOD(Dispose);
 };
 
 #endif
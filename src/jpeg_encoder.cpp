@@ -1,15 +1,49 @@
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "jpeg_encoder.h"
+#include "jpeg_transform.h"
+#include "jpeg_variants.h"
 
 JpegEncoder::JpegEncoder(unsigned char *ddata, int wwidth, int hheight,
     int qquality, buffer_type bbuf_type)
     :
-      data(ddata), width(wwidth), height(hheight), quality(qquality), smoothing(0),
-    buf_type(bbuf_type),
-    jpeg(NULL), jpeg_len(0),
+      data(ddata), source(NULL), coef_source(NULL), stats(NULL), scan_listener(NULL), metrics(NULL),
+    width(wwidth), height(hheight), quality(qquality), smoothing(0), progressive(false),
+    buf_type(bbuf_type), stride(0),
+    jpeg(NULL), jpeg_len(0), jpeg_held(0), out_fd(-1),
+    offset(0, 0, 0, 0) {}
+
+JpegEncoder::JpegEncoder(JpegRowSource *ssource, int wwidth, int hheight, int qquality)
+    :
+      data(NULL), source(ssource), coef_source(NULL), stats(NULL), scan_listener(NULL), metrics(NULL),
+    width(wwidth), height(hheight), quality(qquality), smoothing(0), progressive(false),
+    buf_type(BUF_RGB), stride(0),
+    jpeg(NULL), jpeg_len(0), jpeg_held(0), out_fd(-1),
     offset(0, 0, 0, 0) {}
 
 JpegEncoder::~JpegEncoder() {
+    free_jpeg();
+}
+
+// Encoded JPEGs currently held by all encoders, in any thread.
+static int64_t held_bytes = 0;
+
+int64_t
+JpegEncoder::total_held_bytes()
+{
+    return __sync_add_and_fetch(&held_bytes, 0);
+}
+
+void
+JpegEncoder::free_jpeg()
+{
     free(jpeg);
+    jpeg = NULL;
+    jpeg_len = 0;
+    if (jpeg_held) __sync_sub_and_fetch(&held_bytes, jpeg_held);
+    jpeg_held = 0;
 }
 
 #if JPEG_LIB_VERSION < 80
@@ -41,6 +75,8 @@ empty_mem_output_buffer (j_compress_ptr cinfo)
   size_t nextsize;
   JOCTET * nextbuffer;
   my_mem_dest_ptr dest = (my_mem_dest_ptr) cinfo->dest;
+  EncodeStats * stats = (EncodeStats *) cinfo->client_data;
+  uint64_t t0 = stats ? stats_clock() : 0;
 
   /* Try to allocate new buffer with double size */
   nextsize = dest->bufsize * 2;
@@ -62,6 +98,11 @@ empty_mem_output_buffer (j_compress_ptr cinfo)
   dest->buffer = nextbuffer;
   dest->bufsize = nextsize;
 
+  if (stats) {
+    stats->grow_ns += stats_clock() - t0;
+    stats->allocations++;
+  }
+
   return TRUE;
 }
 
@@ -110,73 +151,577 @@ jpeg_mem_dest (j_compress_ptr cinfo,
 }
 #endif
 
+// Frees the buffer of a memory destination whose encode failed. jpeg can
+// point at it or at one it has already replaced, so the caller drops jpeg
+// instead of freeing it.
+static void
+release_mem_destination(j_compress_ptr cinfo)
+{
+#if JPEG_LIB_VERSION < 80
+    my_mem_dest_ptr dest = (my_mem_dest_ptr)cinfo->dest;
+    if (dest) {
+        free(dest->newbuffer);
+        dest->newbuffer = NULL;
+    }
+#endif
+}
+
+#define FD_OUTPUT_BUF_SIZE (1 << 20)
+
+typedef struct {
+  struct jpeg_destination_mgr pub; /* public fields */
+
+  int fd;                       /* target file descriptor */
+  bool seekable;                /* pwrite at offset, otherwise plain write */
+  off_t offset;                 /* file offset of buffer start */
+  unsigned long * outsize;      /* bytes written so far */
+  JOCTET * buffer;              /* start of buffer */
+} fd_destination_mgr;
+
+typedef fd_destination_mgr * fd_dest_ptr;
+
+static void
+write_block (fd_dest_ptr dest, const JOCTET * buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = dest->seekable ?
+      pwrite(dest->fd, buf, len, dest->offset) : write(dest->fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      throw "write failed in JpegEncoder (fd destination)";
+    }
+    buf += n;
+    len -= n;
+    dest->offset += n;
+    *dest->outsize += n;
+  }
+}
+
+static void
+init_fd_destination (j_compress_ptr cinfo)
+{
+  fd_dest_ptr dest = (fd_dest_ptr) cinfo->dest;
+
+  dest->buffer = (JOCTET *)
+    (*cinfo->mem->alloc_large) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+                                FD_OUTPUT_BUF_SIZE);
+  dest->pub.next_output_byte = dest->buffer;
+  dest->pub.free_in_buffer = FD_OUTPUT_BUF_SIZE;
+
+  /* pipes and sockets can't pwrite, they get sequential writes */
+  dest->offset = lseek(dest->fd, 0, SEEK_CUR);
+  dest->seekable = dest->offset >= 0;
+  *dest->outsize = 0;
+}
+
+static boolean
+empty_fd_output_buffer (j_compress_ptr cinfo)
+{
+  fd_dest_ptr dest = (fd_dest_ptr) cinfo->dest;
+
+  /* libjpeg wants the whole buffer flushed, regardless of free_in_buffer */
+  write_block(dest, dest->buffer, FD_OUTPUT_BUF_SIZE);
+
+  dest->pub.next_output_byte = dest->buffer;
+  dest->pub.free_in_buffer = FD_OUTPUT_BUF_SIZE;
+
+  return TRUE;
+}
+
+static void
+term_fd_destination (j_compress_ptr cinfo)
+{
+  fd_dest_ptr dest = (fd_dest_ptr) cinfo->dest;
+
+  write_block(dest, dest->buffer, FD_OUTPUT_BUF_SIZE - dest->pub.free_in_buffer);
+
+  /* leave the file position after the jpeg, like write() would */
+  if (dest->seekable)
+    lseek(dest->fd, dest->offset, SEEK_SET);
+}
+
+static void
+jpeg_fd_dest (j_compress_ptr cinfo, int fd, unsigned long * outsize)
+{
+  fd_dest_ptr dest;
+
+  if (cinfo->dest == NULL) {
+    cinfo->dest = (struct jpeg_destination_mgr *)
+      (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
+                                  sizeof(fd_destination_mgr));
+  }
+
+  dest = (fd_dest_ptr) cinfo->dest;
+  dest->pub.init_destination = init_fd_destination;
+  dest->pub.empty_output_buffer = empty_fd_output_buffer;
+  dest->pub.term_destination = term_fd_destination;
+  dest->fd = fd;
+  dest->outsize = outsize;
+}
+
+#define SCAN_OUTPUT_BUF_SIZE 65536
+
+// Memory destination whose bytes can be read while libjpeg is still writing
+// them, so finished scans can be handed out. *outbuffer always points to the
+// current buffer, so it's freed with the jpeg even if encoding fails.
+typedef struct {
+  struct jpeg_destination_mgr pub; /* public fields */
+
+  unsigned char ** outbuffer;   /* target buffer */
+  unsigned long * outsize;
+  JOCTET * buffer;              /* start of buffer */
+  size_t bufsize;
+} scan_destination_mgr;
+
+typedef scan_destination_mgr * scan_dest_ptr;
+
+static void
+init_scan_destination (j_compress_ptr cinfo)
+{
+  scan_dest_ptr dest = (scan_dest_ptr) cinfo->dest;
+
+  dest->buffer = (JOCTET *)malloc(SCAN_OUTPUT_BUF_SIZE);
+  if (dest->buffer == NULL)
+    throw "malloc failed in init_scan_destination";
+  *dest->outbuffer = dest->buffer;
+  dest->bufsize = SCAN_OUTPUT_BUF_SIZE;
+  dest->pub.next_output_byte = dest->buffer;
+  dest->pub.free_in_buffer = dest->bufsize;
+}
+
+static boolean
+empty_scan_output_buffer (j_compress_ptr cinfo)
+{
+  scan_dest_ptr dest = (scan_dest_ptr) cinfo->dest;
+
+  JOCTET * nextbuffer = (JOCTET *)realloc(dest->buffer, dest->bufsize * 2);
+  if (nextbuffer == NULL)
+    throw "realloc failed in empty_scan_output_buffer";
+
+  *dest->outbuffer = nextbuffer;
+  dest->pub.next_output_byte = nextbuffer + dest->bufsize;
+  dest->pub.free_in_buffer = dest->bufsize;
+  dest->buffer = nextbuffer;
+  dest->bufsize *= 2;
+
+  EncodeStats * stats = (EncodeStats *) cinfo->client_data;
+  if (stats) stats->allocations++;
+  return TRUE;
+}
+
+static void
+term_scan_destination (j_compress_ptr cinfo)
+{
+  scan_dest_ptr dest = (scan_dest_ptr) cinfo->dest;
+
+  *dest->outsize = dest->bufsize - dest->pub.free_in_buffer;
+}
+
+static void
+jpeg_scan_dest (j_compress_ptr cinfo, unsigned char ** outbuffer, unsigned long * outsize)
+{
+  scan_dest_ptr dest;
+
+  if (cinfo->dest == NULL) {
+    cinfo->dest = (struct jpeg_destination_mgr *)
+      (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
+                                  sizeof(scan_destination_mgr));
+  }
+
+  dest = (scan_dest_ptr) cinfo->dest;
+  dest->pub.init_destination = init_scan_destination;
+  dest->pub.empty_output_buffer = empty_scan_output_buffer;
+  dest->pub.term_destination = term_scan_destination;
+  dest->outbuffer = outbuffer;
+  dest->outsize = outsize;
+}
+
+// libjpeg has no per-scan hook, but every scan is its own pass (two with
+// Huffman optimization, which progressive mode always uses) and the
+// progress monitor sees each pass start. An output pass writes its scan's
+// headers, ending in SOS, before it starts; when the previous pass was an
+// output pass, its scan is complete.
+typedef struct {
+  struct jpeg_progress_mgr pub; /* public fields */
+
+  JpegScanListener * listener;
+  int pass;                     /* completed_passes of the current pass */
+  bool in_scan;                 /* the current pass writes a scan */
+  size_t sent;                  /* bytes handed to the listener so far */
+  int scans;                    /* scans handed to the listener so far */
+} scan_progress_mgr;
+
+typedef scan_progress_mgr * scan_progress_ptr;
+
+static size_t
+scan_dest_written (j_compress_ptr cinfo)
+{
+  scan_dest_ptr dest = (scan_dest_ptr) cinfo->dest;
+  return dest->bufsize - dest->pub.free_in_buffer;
+}
+
+// Does the output end in an SOS marker segment? Entropy coded data can't
+// contain FF DA, since FF bytes in it are followed by 00.
+static bool
+ends_with_sos (const JOCTET * buf, size_t len)
+{
+  for (int ns = 1; ns <= 4; ns++) {
+    size_t seg = 2 + 6 + 2*ns;
+    if (len < seg) break;
+    const JOCTET * p = buf + len - seg;
+    if (p[0] == 0xFF && p[1] == 0xDA && p[2] == 0 && p[3] == 6 + 2*ns && p[4] == ns)
+      return true;
+  }
+  return false;
+}
+
+static void
+send_scan (j_compress_ptr cinfo, size_t upto)
+{
+  scan_progress_ptr progress = (scan_progress_ptr) cinfo->progress;
+  scan_dest_ptr dest = (scan_dest_ptr) cinfo->dest;
+
+  if (upto <= progress->sent) return;
+  progress->listener->scan_done(dest->buffer + progress->sent, upto - progress->sent,
+                                progress->scans++);
+  progress->sent = upto;
+}
+
+static void
+scan_progress_monitor (j_common_ptr common)
+{
+  j_compress_ptr cinfo = (j_compress_ptr) common;
+  scan_progress_ptr progress = (scan_progress_ptr) cinfo->progress;
+
+  if (progress->pub.completed_passes == progress->pass) return;
+  progress->pass = progress->pub.completed_passes;
+
+  size_t written = scan_dest_written(cinfo);
+  if (progress->in_scan) send_scan(cinfo, written);
+  progress->in_scan = ends_with_sos(((scan_dest_ptr) cinfo->dest)->buffer, written);
+}
+
+const unsigned char *
+BufferRowSource::get_row(int x, int y, int w)
+{
+    const unsigned char *src = data + (size_t)y*stride + (size_t)x*bpp;
+    if (buf_type == BUF_RGB)
+        return src;
+
+    row.resize((size_t)w*3);
+    if (is_planar(buf_type))
+        yuv_row_to_rgb(planes, x, y, w, &row[0]);
+    else
+        row_to_rgb(src, &row[0], w, buf_type);
+    return &row[0];
+}
+
+// Copies n samples spaced step bytes apart to dst and pads it to padded
+// samples by repeating the last one.
+static void
+copy_padded(const unsigned char *src, int step, int n, unsigned char *dst, int padded)
+{
+    if (step == 1) {
+        memcpy(dst, src, n);
+    }
+    else {
+        for (int i = 0; i < n; i++)
+            dst[i] = src[i*step];
+    }
+    memset(dst + n, dst[n-1], padded - n);
+}
+
+// Feeds YUV420/NV12 planes to libjpeg in raw data mode, which skips colour
+// conversion and chroma downsampling entirely. Rows are only copied into
+// MCU-padded strips (and NV12 chroma deinterleaved). The area encoded
+// starts at (x, y), which have to be even so that chroma lines up.
+void
+JpegEncoder::encode_yuv(j_compress_ptr cinfo, int x, int y)
+{
+    YuvPlanes planes(data, width, height, buf_type, stride);
+    int w = cinfo->image_width, h = cinfo->image_height;
+    int cw = (w + 1)/2, ch = (h + 1)/2;
+    int y_padded = (w + 15) & ~15, c_padded = (cw + 7) & ~7;
+    const unsigned char *y_plane = planes.y + (size_t)y*planes.y_stride + x;
+    const unsigned char *u_plane = planes.u + (size_t)(y/2)*planes.uv_stride + (x/2)*planes.uv_step;
+    const unsigned char *v_plane = planes.v + (size_t)(y/2)*planes.uv_stride + (x/2)*planes.uv_step;
+
+    cinfo->raw_data_in = TRUE;
+#if JPEG_LIB_VERSION >= 70
+    cinfo->do_fancy_downsampling = FALSE;
+#endif
+    cinfo->comp_info[0].h_samp_factor = 2;
+    cinfo->comp_info[0].v_samp_factor = 2;
+    cinfo->comp_info[1].h_samp_factor = 1;
+    cinfo->comp_info[1].v_samp_factor = 1;
+    cinfo->comp_info[2].h_samp_factor = 1;
+    cinfo->comp_info[2].v_samp_factor = 1;
+    jpeg_start_compress(cinfo, TRUE);
+
+    // from libjpeg's pool, which jpeg_destroy_compress frees even when an
+    // error jumps out of here
+    JSAMPLE *strip = (JSAMPLE *)(*cinfo->mem->alloc_large)((j_common_ptr)cinfo, JPOOL_IMAGE,
+        (size_t)16*y_padded + (size_t)2*8*c_padded);
+    JSAMPROW y_rows[16], u_rows[8], v_rows[8];
+    for (int i = 0; i < 16; i++)
+        y_rows[i] = strip + (size_t)i*y_padded;
+    for (int i = 0; i < 8; i++) {
+        u_rows[i] = strip + (size_t)16*y_padded + (size_t)i*c_padded;
+        v_rows[i] = strip + (size_t)16*y_padded + (size_t)(8 + i)*c_padded;
+    }
+    JSAMPARRAY image[3] = { y_rows, u_rows, v_rows };
+
+    uint64_t t0 = 0, t1 = 0;
+    while (cinfo->next_scanline < cinfo->image_height) {
+        if (stats) t0 = stats_clock();
+        int row = cinfo->next_scanline;
+        for (int i = 0; i < 16; i++) {
+            int yy = row + i < h ? row + i : h - 1;
+            copy_padded(y_plane + (size_t)yy*planes.y_stride, 1, w, y_rows[i], y_padded);
+        }
+        for (int i = 0; i < 8; i++) {
+            int yy = row/2 + i < ch ? row/2 + i : ch - 1;
+            copy_padded(u_plane + (size_t)yy*planes.uv_stride, planes.uv_step, cw, u_rows[i], c_padded);
+            copy_padded(v_plane + (size_t)yy*planes.uv_stride, planes.uv_step, cw, v_rows[i], c_padded);
+        }
+        if (stats) t1 = stats_clock();
+        jpeg_write_raw_data(cinfo, image, 16);
+        if (stats) {
+            stats->convert_ns += t1 - t0;
+            stats->scanlines_ns += stats_clock() - t1;
+        }
+    }
+}
+
+// Decodes the JPEG that was just made and compares it with its source row
+// by row. libjpeg doesn't hand out the quantized coefficients it encoded,
+// so decoding them is the reconstruction; nothing but one row of each is
+// kept.
+void
+JpegEncoder::measure(JpegRowSource *rows, int x, int y, int w, int h)
+{
+    struct jpeg_decompress_struct dinfo;
+    jpeg_jmp_error_mgr jerr;
+    char message[JMSG_LENGTH_MAX];
+    MetricsAccumulator acc(w, h);
+    std::vector<unsigned char> decoded((size_t)w*3);
+    JSAMPROW row = &decoded[0];
+
+    dinfo.err = jpeg_jmp_error(&jerr, message);
+    if (setjmp(jerr.jump)) {
+        jpeg_destroy_decompress(&dinfo);
+        throw "Couldn't decode the JPEG to measure it.";
+    }
+    jpeg_create_decompress(&dinfo);
+    jpeg_buffer_src(&dinfo, jpeg, jpeg_len);
+    jpeg_read_header(&dinfo, TRUE);
+    dinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&dinfo);
+
+    try {
+        while (dinfo.output_scanline < dinfo.output_height) {
+            int yy = dinfo.output_scanline;
+            jpeg_read_scanlines(&dinfo, &row, 1);
+            acc.add_row(rows->get_row(x, y + yy, w), row);
+        }
+    }
+    catch (...) {
+        jpeg_destroy_decompress(&dinfo);
+        throw;
+    }
+    jpeg_finish_decompress(&dinfo);
+    jpeg_destroy_decompress(&dinfo);
+    *metrics = acc.result();
+}
+
+// libjpeg's message when encode() fails. Per thread, as encodes run on the
+// threadpool, and outside the encoder because the catch that reads it is
+// usually past the encoder's scope.
+static __thread char encode_error[JMSG_LENGTH_MAX];
+
 void
 JpegEncoder::encode()
 {
     struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-
-    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_jmp_error_mgr jerr;
+
+    free_jpeg();
+
+    int w = offset.isNull() ? width : offset.w;
+    int h = offset.isNull() ? height : offset.h;
+    if (w > JPEG_MAX_DIMENSION || h > JPEG_MAX_DIMENSION)
+        throw "Image is too large for a JPEG, width and height can be at most 65500.";
+
+    int x = offset.isNull() ? 0 : offset.x;
+    int y = offset.isNull() ? 0 : offset.y;
+    // an area at odd coordinates splits chroma samples, it goes through RGB
+    bool raw_yuv = !source && is_planar(buf_type) && x % 2 == 0 && y % 2 == 0;
+
+    // buffers are converted one scanline at a time, so there is never a
+    // second whole-image RGB copy around
+    BufferRowSource buffer_rows(data, width, height, buf_type, stride);
+    JpegRowSource *rows = source ? source : &buffer_rows;
+
+    // scans can only be handed out of a memory destination
+    bool send_scans = scan_listener && progressive && out_fd < 0 && !coef_source;
+    scan_progress_mgr progress;
+
+    // Everything with a destructor is set up above, so a libjpeg error
+    // jumping back here skips none. Zeroed so that jpeg_destroy_compress is
+    // safe even if jpeg_create_compress failed.
+    memset(&cinfo, 0, sizeof(cinfo));
+    cinfo.err = jpeg_jmp_error(&jerr, encode_error);
+    bool mem_dest = !send_scans && out_fd < 0;
+    if (setjmp(jerr.jump)) {
+        if (mem_dest) {
+            release_mem_destination(&cinfo);
+            jpeg = NULL;
+            jpeg_len = 0;
+        }
+        jpeg_destroy_compress(&cinfo);
+        throw (const char *)encode_error;
+    }
 
     jpeg_create_compress(&cinfo);
-    jpeg_mem_dest(&cinfo, &jpeg, &jpeg_len);
 
-    if (offset.isNull()) {
-        cinfo.image_width = width;
-        cinfo.image_height = height;
+    if (send_scans) {
+        progress.pub.progress_monitor = scan_progress_monitor;
+        progress.listener = scan_listener;
+        progress.pass = -1;
+        progress.in_scan = false;
+        progress.sent = 0;
+        progress.scans = 0;
+        cinfo.progress = &progress.pub;
+        jpeg_scan_dest(&cinfo, &jpeg, &jpeg_len);
+        if (stats) stats->allocations++;
+    }
+    else if (out_fd >= 0) {
+        jpeg_fd_dest(&cinfo, out_fd, &jpeg_len);
     }
     else {
-        cinfo.image_width = offset.w;
-        cinfo.image_height = offset.h;
+        jpeg_mem_dest(&cinfo, &jpeg, &jpeg_len);
+        if (stats) stats->allocations++;
     }
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
 
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
-    cinfo.smoothing_factor = smoothing;
-    jpeg_start_compress(&cinfo, TRUE);
+    cinfo.image_width = w;
+    cinfo.image_height = h;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = raw_yuv ? JCS_YCbCr : JCS_RGB;
+
+    cinfo.client_data = stats; // for empty_mem_output_buffer
+
+    try {
+        if (coef_source) {
+            uint64_t t0 = stats ? stats_clock() : 0;
+            coef_source->write_coefficients(&cinfo, x, y, cinfo.image_width, cinfo.image_height);
+            if (stats) stats->convert_ns += stats_clock() - t0;
+        }
+        else {
+            jpeg_set_defaults(&cinfo);
+            jpeg_set_quality(&cinfo, quality, TRUE);
+            cinfo.smoothing_factor = smoothing;
+            if (progressive) jpeg_simple_progression(&cinfo);
+
+            if (raw_yuv) {
+                encode_yuv(&cinfo, x, y);
+            }
+            else {
+                jpeg_start_compress(&cinfo, TRUE);
+
+                JSAMPROW row_pointer;
+                uint64_t t0 = 0, t1 = 0;
+                while (cinfo.next_scanline < cinfo.image_height) {
+                    if (stats) t0 = stats_clock();
+                    row_pointer = (JSAMPROW)rows->get_row(x, y + cinfo.next_scanline,
+                        cinfo.image_width);
+                    if (stats) t1 = stats_clock();
+                    jpeg_write_scanlines(&cinfo, &row_pointer, 1);
+                    if (stats) {
+                        stats->convert_ns += t1 - t0;
+                        stats->scanlines_ns += stats_clock() - t1;
+                    }
+                }
+            }
+
+            if (stats) {
+                stats->bytes_in += source ?
+                    (uint64_t)cinfo.image_width*cinfo.image_height*3 :
+                    image_span(cinfo.image_width, cinfo.image_height, buf_type, 0);
+            }
+        }
+
+        uint64_t t0 = stats ? stats_clock() : 0;
+        jpeg_finish_compress(&cinfo);
+        if (send_scans) send_scan(&cinfo, jpeg_len);
+        if (jpeg) {
+            jpeg_held = jpeg_len;
+            __sync_add_and_fetch(&held_bytes, jpeg_held);
+        }
+        if (stats) {
+            stats->finish_ns += stats_clock() - t0;
+            stats->bytes_out += jpeg_len;
+            stats->encodes++;
+        }
+    }
+    catch (...) {
+        if (mem_dest) {
+            release_mem_destination(&cinfo);
+            jpeg = NULL;
+            jpeg_len = 0;
+        }
+        jpeg_destroy_compress(&cinfo);
+        throw;
+    }
+    jpeg_destroy_compress(&cinfo);
 
-    unsigned char *rgb_data;
-    switch (buf_type) {
-    case BUF_RGBA:
-        rgb_data = rgba_to_rgb(data, width*height*4);
-        if (!rgb_data) throw "malloc failed in JpegEncoder::encode/rgba_to_rgb.";
-        break;
+    // JPEG tiles pushed as coefficients have no pixels to compare with
+    if (metrics && jpeg && !coef_source)
+        measure(rows, x, y, w, h);
+}
 
-    case BUF_BGRA:
-        rgb_data = bgra_to_rgb(data, width*height*4);
-        if (!rgb_data) throw "malloc failed in JpegEncoder::encode/bgra_to_rgb.";
-        break;
+void
+JpegEncoder::set_output_fd(int fd)
+{
+    out_fd = fd;
+}
 
-    case BUF_BGR:
-        rgb_data = bgr_to_rgb(data, width*height*3);
-        if (!rgb_data) throw "malloc failed in JpegEncoder::encode/bgr_to_rgb.";
-        break;
+void
+JpegEncoder::set_coef_source(JpegCoefSource *ssource)
+{
+    coef_source = ssource;
+}
 
-    case BUF_RGB:
-        rgb_data = data;
-        break;
+void
+JpegEncoder::set_stats(EncodeStats *sstats)
+{
+    stats = sstats;
+}
 
-    default:
-        throw "Unexpected buf_type in JpegEncoder::encode";
+void
+JpegEncoder::encode_to_file(const FileTarget &target)
+{
+    int fd = target.fd;
+    if (target.path) {
+        fd = open(target.path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) throw "open failed in JpegEncoder::encode_to_file.";
     }
 
-    JSAMPROW row_pointer;
-    int start = 0;
-    if (!offset.isNull()) {
-        start = offset.y*width*3 + offset.x*3;
+    out_fd = fd;
+    try {
+        encode();
+        if (target.fsync && fsync(fd) != 0)
+            throw "fsync failed in JpegEncoder::encode_to_file.";
     }
-    while (cinfo.next_scanline < cinfo.image_height) {
-        row_pointer = &rgb_data[start + cinfo.next_scanline*3*width];
-        jpeg_write_scanlines(&cinfo, &row_pointer, 1);
+    catch (...) {
+        out_fd = -1;
+        if (target.path) close(fd);
+        throw;
     }
+    out_fd = -1;
 
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
-
-    if (buf_type == BUF_BGR || buf_type == BUF_RGBA || buf_type == BUF_BGRA)
-        free(rgb_data);
+    if (target.path && close(fd) != 0)
+        throw "close failed in JpegEncoder::encode_to_file.";
 }
 
 void
@@ -190,18 +735,74 @@ void JpegEncoder::set_smoothing(int ssmoothing)
     smoothing  = ssmoothing;
 }
 
+void
+JpegEncoder::set_progressive(bool pprogressive)
+{
+    progressive = pprogressive;
+}
+
+void
+JpegEncoder::set_scan_listener(JpegScanListener *listener)
+{
+    scan_listener = listener;
+}
+
+void
+JpegEncoder::set_metrics(ImageMetrics *mmetrics)
+{
+    metrics = mmetrics;
+}
+
+void
+JpegEncoder::set_stride(size_t sstride)
+{
+    stride = sstride;
+}
+
 const unsigned char *
 JpegEncoder::get_jpeg() const
 {
     return jpeg;
 }
 
-unsigned int
+unsigned long
 JpegEncoder::get_jpeg_len() const
 {
     return jpeg_len;
 }
 
+int
+JpegEncoder::get_width() const
+{
+    return width;
+}
+
+int
+JpegEncoder::get_height() const
+{
+    return height;
+}
+
+int
+JpegEncoder::get_quality() const
+{
+    return quality;
+}
+
+bool
+JpegEncoder::get_progressive() const
+{
+    return progressive;
+}
+
+void
+JpegEncoder::build_variants(VariantPyramid &pyramid, bool borrow) const
+{
+    if (source)
+        throw "Variants can only be built from a pixel buffer.";
+    pyramid.build(data, width, height, buf_type, stride, borrow);
+}
+
 void
 JpegEncoder::setRect(const Rect &r)
 {
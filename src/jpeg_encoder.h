@@ -3,22 +3,109 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <vector>
 #include <jpeglib.h>
 #include "common.h"
+#include "encode_stats.h"
+#include "image_metrics.h"
+
+#if JPEG_LIB_VERSION < 80
+// libjpeg 8 has this; jpeg_encoder.cpp carries a copy for older versions
+void jpeg_mem_dest(j_compress_ptr cinfo, unsigned char **outbuffer, unsigned long *outsize);
+#endif
+
+// Supplies RGB scanlines to JpegEncoder for images that don't live in one
+// contiguous buffer (see TiledCanvas).
+class JpegRowSource {
+public:
+    virtual ~JpegRowSource() {}
+
+    // Returns w packed RGB pixels starting at (x, y). The pointer only has
+    // to stay valid until the next call.
+    virtual const unsigned char *get_row(int x, int y, int w) = 0;
+};
+
+// Supplies DCT coefficients instead of pixels (see CoefCanvas), so that
+// encoding is just entropy coding.
+class JpegCoefSource {
+public:
+    virtual ~JpegCoefSource() {}
+
+    // Sets up cinfo for the w x h area at (x, y) (components, sampling,
+    // quantization tables) and hands its coefficients to libjpeg with
+    // jpeg_write_coefficients. The caller finishes the compression.
+    virtual void write_coefficients(j_compress_ptr cinfo, int x, int y, int w, int h) = 0;
+};
+
+// Gets a progressive JPEG while it's being encoded. scan_done is called on
+// the encoding thread each time a scan is finished, with the bytes written
+// since the previous call (the next scan's headers may already be among
+// them). All chunks together are the whole JPEG.
+class JpegScanListener {
+public:
+    virtual ~JpegScanListener() {}
+    virtual void scan_done(const unsigned char *data, size_t len, int scan) = 0;
+};
+
+class ScanEmitter;
+class VariantPyramid;
+
+// Rows of a buffer of any buffer_type, converted to RGB on demand. Rows are
+// stride bytes apart (0 means tightly packed).
+class BufferRowSource : public JpegRowSource {
+    const unsigned char *data;
+    size_t stride;
+    int bpp;
+    buffer_type buf_type;
+    YuvPlanes planes;
+    std::vector<unsigned char> row;
+
+public:
+    BufferRowSource(const unsigned char *ddata, int wwidth, int hheight,
+        buffer_type bbuf_type, size_t sstride = 0) :
+        data(ddata), bpp(bytes_per_pixel(bbuf_type)), buf_type(bbuf_type),
+        planes(ddata, wwidth, hheight, bbuf_type, sstride)
+    {
+        stride = sstride ? sstride : (size_t)wwidth*bpp;
+    }
+    const unsigned char *get_row(int x, int y, int w);
+};
+
+// Where encodeToFile writes: a path that is opened (and closed) on the
+// encoding thread, or a file descriptor owned by the caller.
+struct FileTarget {
+    char *path;
+    int fd;
+    bool fsync;
+
+    FileTarget() : path(NULL), fd(-1), fsync(false) {}
+};
 
 class JpegEncoder {
     unsigned char *data;
+    JpegRowSource *source;
+    JpegCoefSource *coef_source; // takes precedence over data and source when set
+    EncodeStats *stats; // timings and counters are added here when set
+    JpegScanListener *scan_listener; // only used for in-memory progressive JPEGs
+    ImageMetrics *metrics; // in-memory JPEGs are measured against their source when set
     int width, height, quality, smoothing;
+    bool progressive;
     buffer_type buf_type;
+    size_t stride; // bytes between rows of data, 0 if tightly packed
 
     unsigned char *jpeg;
-    long unsigned int jpeg_len;
+    unsigned long jpeg_len;
+    unsigned long jpeg_held; // what jpeg added to total_held_bytes
+    int out_fd; // when >= 0 the jpeg is written here instead of to memory
 
     Rect offset;
 
+    void measure(JpegRowSource *rows, int x, int y, int w, int h);
+
 public:
     JpegEncoder(unsigned char *ddata, int wwidth, int hheight,
         int qquality, buffer_type bbuf_type);
+    JpegEncoder(JpegRowSource *ssource, int wwidth, int hheight, int qquality);
     ~JpegEncoder();
 
     class EncodeWorker : public NanAsyncWorker {
@@ -26,18 +113,56 @@ public:
         EncodeWorker(NanCallback *callback) : NanAsyncWorker(callback) {
               jpeg = NULL;
               jpeg_len = 0;
+              queued_at = stats_enabled() ? stats_clock() : 0;
+              scans = NULL;
         };
 
+        // Passes finished scans to an onScan callback while Execute runs.
+        void set_scans(ScanEmitter *sscans) { scans = sscans; }
+
     protected:
         char *jpeg;
-        int jpeg_len;
+        unsigned long jpeg_len;
+
+        // Stats of this encode, added to the object's on the main thread.
+        // queued_at is 0 when stats are off.
+        uint64_t queued_at;
+        EncodeStats stats;
+
+        EncodeStats *run_stats() { return queued_at ? &stats : NULL; }
+        void started() { if (queued_at) stats.queue_wait_ns += stats_clock() - queued_at; }
+
+        ScanEmitter *scans;
+        ImageMetrics metrics; // valid if the encode was measured
+
+        // Calls back with the scans that are still queued and closes the
+        // emitter, before the final callback.
+        void finish_scans();
     };
 
     void encode();
+    void encode_yuv(j_compress_ptr cinfo, int x, int y);
     void set_quality(int qquality);
     void set_smoothing(int ssmoothing);
+    void set_progressive(bool pprogressive);
+    void set_scan_listener(JpegScanListener *listener);
+    void set_metrics(ImageMetrics *mmetrics);
+    void set_stride(size_t sstride);
+    void set_output_fd(int fd);
+    void set_coef_source(JpegCoefSource *ssource);
+    void set_stats(EncodeStats *sstats);
+    void encode_to_file(const FileTarget &target);
     const unsigned char *get_jpeg() const;
-    unsigned int get_jpeg_len() const;
+    unsigned long get_jpeg_len() const;
+    int get_width() const;
+    int get_height() const;
+    int get_quality() const;
+    bool get_progressive() const;
+    // Builds the pyramid from the pixels this encoder was made with.
+    void build_variants(VariantPyramid &pyramid, bool borrow) const;
+    void free_jpeg(); // once the JPEG has been copied out
+
+    static int64_t total_held_bytes();
 
     void setRect(const Rect &r);
 };
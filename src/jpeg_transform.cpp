@@ -0,0 +1,368 @@
+#include <cstdio>
+#include <cstring>
+#include <jerror.h>
+
+#include "jpeg_transform.h"
+#include "jpeg_encoder.h"
+
+static void
+transform_error_exit(j_common_ptr cinfo)
+{
+    jpeg_jmp_error_mgr *err = (jpeg_jmp_error_mgr *)cinfo->err;
+    (*cinfo->err->format_message)(cinfo, err->message);
+    longjmp(err->jump, 1);
+}
+
+// Warnings (such as a truncated input) aren't worth printing to stderr.
+static void
+transform_output_message(j_common_ptr cinfo)
+{
+}
+
+struct jpeg_error_mgr *
+jpeg_jmp_error(jpeg_jmp_error_mgr *err, char *message)
+{
+    jpeg_std_error(&err->pub);
+    err->pub.error_exit = transform_error_exit;
+    err->pub.output_message = transform_output_message;
+    err->message = message;
+    return &err->pub;
+}
+
+// Source manager for a JPEG that is in memory in its entirety. (Not every
+// libjpeg has jpeg_mem_src, and the ones that do disagree on its signature.)
+static void
+init_buffer_source(j_decompress_ptr cinfo)
+{
+}
+
+static boolean
+fill_buffer_input(j_decompress_ptr cinfo)
+{
+    // out of data: insert a fake EOI, like jdatasrc.c does
+    static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+    WARNMS(cinfo, JWRN_JPEG_EOF);
+    cinfo->src->next_input_byte = eoi;
+    cinfo->src->bytes_in_buffer = 2;
+    return TRUE;
+}
+
+static void
+skip_buffer_input(j_decompress_ptr cinfo, long num_bytes)
+{
+    if (num_bytes <= 0) return;
+    while (num_bytes > (long)cinfo->src->bytes_in_buffer) {
+        num_bytes -= (long)cinfo->src->bytes_in_buffer;
+        fill_buffer_input(cinfo);
+    }
+    cinfo->src->next_input_byte += num_bytes;
+    cinfo->src->bytes_in_buffer -= num_bytes;
+}
+
+static void
+term_buffer_source(j_decompress_ptr cinfo)
+{
+}
+
+void
+jpeg_buffer_src(j_decompress_ptr cinfo, const unsigned char *buf, size_t len)
+{
+    struct jpeg_source_mgr *src = (struct jpeg_source_mgr *)
+        (*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_PERMANENT,
+            sizeof(struct jpeg_source_mgr));
+    src->init_source = init_buffer_source;
+    src->fill_input_buffer = fill_buffer_input;
+    src->skip_input_data = skip_buffer_input;
+    src->resync_to_restart = jpeg_resync_to_restart;
+    src->term_source = term_buffer_source;
+    src->next_input_byte = buf;
+    src->bytes_in_buffer = len;
+    cinfo->src = src;
+}
+
+int
+comp_blocks(int pixels, int samp, int max_samp)
+{
+    int blocks = (int)(((long)pixels*samp + max_samp*DCTSIZE - 1)/(max_samp*DCTSIZE));
+    return (blocks + samp - 1)/samp*samp;
+}
+
+static bool
+transposes(transform_op op)
+{
+    return op == XFORM_ROT_90 || op == XFORM_ROT_270;
+}
+
+// whether the op mirrors the source horizontally / vertically
+static bool
+mirrors_x(transform_op op)
+{
+    return op == XFORM_FLIP_H || op == XFORM_ROT_180 || op == XFORM_ROT_270;
+}
+
+static bool
+mirrors_y(transform_op op)
+{
+    return op == XFORM_FLIP_V || op == XFORM_ROT_180 || op == XFORM_ROT_90;
+}
+
+// One 8x8 block of coefficients, natural order, k = row*8 + column. Moving
+// a block in the image goes with transposing it and negating its odd
+// horizontal and/or vertical frequencies.
+static void
+transform_block(transform_op op, JCOEFPTR s, JCOEFPTR d)
+{
+    int i, j;
+    switch (op) {
+    case XFORM_NONE:
+        memcpy(d, s, sizeof(JCOEF)*DCTSIZE2);
+        break;
+    case XFORM_FLIP_H:
+        for (i = 0; i < DCTSIZE; i++)
+            for (j = 0; j < DCTSIZE; j++)
+                d[i*DCTSIZE + j] = (j & 1) ? -s[i*DCTSIZE + j] : s[i*DCTSIZE + j];
+        break;
+    case XFORM_FLIP_V:
+        for (i = 0; i < DCTSIZE; i++)
+            for (j = 0; j < DCTSIZE; j++)
+                d[i*DCTSIZE + j] = (i & 1) ? -s[i*DCTSIZE + j] : s[i*DCTSIZE + j];
+        break;
+    case XFORM_ROT_90:
+        for (i = 0; i < DCTSIZE; i++)
+            for (j = 0; j < DCTSIZE; j++)
+                d[i*DCTSIZE + j] = (j & 1) ? -s[j*DCTSIZE + i] : s[j*DCTSIZE + i];
+        break;
+    case XFORM_ROT_180:
+        for (i = 0; i < DCTSIZE; i++)
+            for (j = 0; j < DCTSIZE; j++)
+                d[i*DCTSIZE + j] = ((i ^ j) & 1) ? -s[i*DCTSIZE + j] : s[i*DCTSIZE + j];
+        break;
+    case XFORM_ROT_270:
+        for (i = 0; i < DCTSIZE; i++)
+            for (j = 0; j < DCTSIZE; j++)
+                d[i*DCTSIZE + j] = (i & 1) ? -s[j*DCTSIZE + i] : s[j*DCTSIZE + i];
+        break;
+    }
+}
+
+JpegTransformer::JpegTransformer(const unsigned char *ssrc, size_t ssrc_len,
+    const TransformOptions &oopts) :
+    src(ssrc), src_len(ssrc_len), opts(oopts),
+    jpeg(NULL), jpeg_len(0), width(0), height(0) {}
+
+JpegTransformer::~JpegTransformer()
+{
+    free(jpeg);
+}
+
+// Fills the output coefficient arrays from the source ones. (crop_x,
+// crop_y) is the crop origin in output pixels.
+void
+JpegTransformer::transform_blocks(j_decompress_ptr srcinfo, jvirt_barray_ptr *src_coefs,
+    j_compress_ptr dstinfo, jvirt_barray_ptr *dst_coefs, int crop_x, int crop_y)
+{
+    transform_op op = opts.op;
+    int src_mcu_w = srcinfo->max_h_samp_factor*DCTSIZE;
+    int src_mcu_h = srcinfo->max_v_samp_factor*DCTSIZE;
+    int dst_mcu_w = dstinfo->max_h_samp_factor*DCTSIZE;
+    int dst_mcu_h = dstinfo->max_v_samp_factor*DCTSIZE;
+
+    for (int ci = 0; ci < srcinfo->num_components; ci++) {
+        jpeg_component_info *scomp = srcinfo->comp_info + ci;
+        jpeg_component_info *dcomp = dstinfo->comp_info + ci;
+
+        int src_bw = comp_blocks(srcinfo->image_width, scomp->h_samp_factor,
+            srcinfo->max_h_samp_factor);
+        int src_bh = comp_blocks(srcinfo->image_height, scomp->v_samp_factor,
+            srcinfo->max_v_samp_factor);
+        // the mirrored extent only counts whole iMCUs
+        int mirror_w = srcinfo->image_width/src_mcu_w*scomp->h_samp_factor;
+        int mirror_h = srcinfo->image_height/src_mcu_h*scomp->v_samp_factor;
+
+        int dst_bw = comp_blocks(width, dcomp->h_samp_factor, dstinfo->max_h_samp_factor);
+        int dst_bh = comp_blocks(height, dcomp->v_samp_factor, dstinfo->max_v_samp_factor);
+        int xoff = crop_x/dst_mcu_w*dcomp->h_samp_factor;
+        int yoff = crop_y/dst_mcu_h*dcomp->v_samp_factor;
+
+        for (int dy = 0; dy < dst_bh; dy++) {
+            JBLOCKARRAY drow = (*srcinfo->mem->access_virt_barray)
+                ((j_common_ptr)srcinfo, dst_coefs[ci], dy, 1, TRUE);
+
+            for (int dx = 0; dx < dst_bw; dx++) {
+                int x = dx + xoff, y = dy + yoff, sx, sy;
+                switch (op) {
+                case XFORM_FLIP_H:  sx = mirror_w - 1 - x; sy = y; break;
+                case XFORM_FLIP_V:  sx = x; sy = mirror_h - 1 - y; break;
+                case XFORM_ROT_90:  sx = y; sy = mirror_h - 1 - x; break;
+                case XFORM_ROT_180: sx = mirror_w - 1 - x; sy = mirror_h - 1 - y; break;
+                case XFORM_ROT_270: sx = mirror_w - 1 - y; sy = x; break;
+                default:            sx = x; sy = y; break;
+                }
+
+                if (sx < 0 || sy < 0 || sx >= src_bw || sy >= src_bh) {
+                    // padding past the edge of the source, never displayed
+                    memset(drow[0][dx], 0, sizeof(JBLOCK));
+                    continue;
+                }
+
+                JBLOCKARRAY srow = (*srcinfo->mem->access_virt_barray)
+                    ((j_common_ptr)srcinfo, src_coefs[ci], sy, 1, FALSE);
+                transform_block(op, srow[0][sx], drow[0][dx]);
+            }
+        }
+    }
+}
+
+void
+JpegTransformer::transform()
+{
+    struct jpeg_decompress_struct srcinfo;
+    struct jpeg_compress_struct dstinfo;
+    jpeg_jmp_error_mgr jerr;
+    char message[JMSG_LENGTH_MAX];
+
+    free(jpeg);
+    jpeg = NULL;
+    jpeg_len = 0;
+
+    // zeroed so that jpeg_destroy_* is safe before jpeg_create_* ran
+    memset(&srcinfo, 0, sizeof(srcinfo));
+    memset(&dstinfo, 0, sizeof(dstinfo));
+    srcinfo.err = dstinfo.err = jpeg_jmp_error(&jerr, message);
+
+    if (setjmp(jerr.jump)) {
+        jpeg_destroy_compress(&dstinfo);
+        jpeg_destroy_decompress(&srcinfo);
+        // a failed jpeg_mem_dest leaves jpeg pointing at a freed buffer
+        jpeg = NULL;
+        jpeg_len = 0;
+        snprintf(error, sizeof(error), "%s", message);
+        throw (const char *)error;
+    }
+
+    try {
+        jpeg_create_decompress(&srcinfo);
+        jpeg_create_compress(&dstinfo);
+        dstinfo.client_data = NULL; // no EncodeStats for empty_mem_output_buffer
+
+        jpeg_buffer_src(&srcinfo, src, src_len);
+        jpeg_read_header(&srcinfo, TRUE);
+
+        transform_op op = opts.op;
+        bool transpose = transposes(op);
+        int mcu_w = srcinfo.max_h_samp_factor*DCTSIZE;
+        int mcu_h = srcinfo.max_v_samp_factor*DCTSIZE;
+
+        // partial iMCUs can't be mirrored, trim them
+        int src_w = srcinfo.image_width, src_h = srcinfo.image_height;
+        if (mirrors_x(op)) src_w -= src_w % mcu_w;
+        if (mirrors_y(op)) src_h -= src_h % mcu_h;
+        if (src_w == 0 || src_h == 0)
+            throw "Image is too small to be rotated or flipped losslessly.";
+
+        width = transpose ? src_h : src_w;
+        height = transpose ? src_w : src_h;
+        int out_mcu_w = transpose ? mcu_h : mcu_w;
+        int out_mcu_h = transpose ? mcu_w : mcu_h;
+
+        int crop_x = 0, crop_y = 0;
+        if (opts.crop) {
+            const Rect &r = opts.crop_rect;
+            if (r.x % out_mcu_w || r.y % out_mcu_h) {
+                snprintf(error, sizeof(error),
+                    "Crop x and y must be multiples of %d and %d for this image.",
+                    out_mcu_w, out_mcu_h);
+                throw (const char *)error;
+            }
+            // subtracted rather than added, x + w can overflow near INT_MAX
+            if (r.w <= 0 || r.h <= 0 || r.w > width || r.h > height ||
+                r.x > width - r.w || r.y > height - r.h)
+                throw "Crop area is outside of the image.";
+            crop_x = r.x;
+            crop_y = r.y;
+            width = r.w;
+            height = r.h;
+        }
+
+        // The output arrays come from the source's memory manager so that
+        // jpeg_read_coefficients realizes them together with its own.
+        jvirt_barray_ptr *dst_coefs = (jvirt_barray_ptr *)(*srcinfo.mem->alloc_small)
+            ((j_common_ptr)&srcinfo, JPOOL_IMAGE, sizeof(jvirt_barray_ptr)*srcinfo.num_components);
+        int dst_max_h = transpose ? srcinfo.max_v_samp_factor : srcinfo.max_h_samp_factor;
+        int dst_max_v = transpose ? srcinfo.max_h_samp_factor : srcinfo.max_v_samp_factor;
+        for (int ci = 0; ci < srcinfo.num_components; ci++) {
+            jpeg_component_info *comp = srcinfo.comp_info + ci;
+            int h_samp = transpose ? comp->v_samp_factor : comp->h_samp_factor;
+            int v_samp = transpose ? comp->h_samp_factor : comp->v_samp_factor;
+            dst_coefs[ci] = (*srcinfo.mem->request_virt_barray)
+                ((j_common_ptr)&srcinfo, JPOOL_IMAGE, FALSE,
+                 comp_blocks(width, h_samp, dst_max_h),
+                 comp_blocks(height, v_samp, dst_max_v), v_samp);
+        }
+
+        jvirt_barray_ptr *src_coefs = jpeg_read_coefficients(&srcinfo);
+
+        jpeg_copy_critical_parameters(&srcinfo, &dstinfo);
+        dstinfo.image_width = width;
+        dstinfo.image_height = height;
+        if (transpose) {
+            for (int ci = 0; ci < dstinfo.num_components; ci++) {
+                jpeg_component_info *comp = dstinfo.comp_info + ci;
+                int h_samp = comp->h_samp_factor;
+                comp->h_samp_factor = comp->v_samp_factor;
+                comp->v_samp_factor = h_samp;
+            }
+            for (int t = 0; t < NUM_QUANT_TBLS; t++) {
+                JQUANT_TBL *qtbl = dstinfo.quant_tbl_ptrs[t];
+                if (!qtbl) continue;
+                for (int i = 0; i < DCTSIZE; i++) {
+                    for (int j = 0; j < i; j++) {
+                        UINT16 q = qtbl->quantval[i*DCTSIZE + j];
+                        qtbl->quantval[i*DCTSIZE + j] = qtbl->quantval[j*DCTSIZE + i];
+                        qtbl->quantval[j*DCTSIZE + i] = q;
+                    }
+                }
+            }
+        }
+        dstinfo.max_h_samp_factor = dst_max_h;
+        dstinfo.max_v_samp_factor = dst_max_v;
+
+        transform_blocks(&srcinfo, src_coefs, &dstinfo, dst_coefs, crop_x, crop_y);
+
+        jpeg_mem_dest(&dstinfo, &jpeg, &jpeg_len);
+        jpeg_write_coefficients(&dstinfo, dst_coefs);
+        jpeg_finish_compress(&dstinfo);
+        jpeg_finish_decompress(&srcinfo);
+    }
+    catch (...) {
+        jpeg_destroy_compress(&dstinfo);
+        jpeg_destroy_decompress(&srcinfo);
+        throw;
+    }
+    jpeg_destroy_compress(&dstinfo);
+    jpeg_destroy_decompress(&srcinfo);
+}
+
+const unsigned char *
+JpegTransformer::get_jpeg() const
+{
+    return jpeg;
+}
+
+unsigned long
+JpegTransformer::get_jpeg_len() const
+{
+    return jpeg_len;
+}
+
+int
+JpegTransformer::get_width() const
+{
+    return width;
+}
+
+int
+JpegTransformer::get_height() const
+{
+    return height;
+}
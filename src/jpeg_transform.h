@@ -0,0 +1,78 @@
+#ifndef JPEG_TRANSFORM_H
+#define JPEG_TRANSFORM_H
+
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <jpeglib.h>
+
+#include "common.h"
+
+// libjpeg error manager that longjmps to jump instead of exiting the
+// process, for decoding JPEGs we didn't make ourselves. The error text goes
+// to message, which must hold JMSG_LENGTH_MAX bytes.
+struct jpeg_jmp_error_mgr {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+    char *message;
+};
+
+struct jpeg_error_mgr *jpeg_jmp_error(jpeg_jmp_error_mgr *err, char *message);
+
+// Decompression source for a JPEG that's in memory in its entirety.
+void jpeg_buffer_src(j_decompress_ptr cinfo, const unsigned char *buf, size_t len);
+
+// Blocks of a component covering `pixels', padded to whole iMCUs the way
+// libjpeg sizes its coefficient arrays.
+int comp_blocks(int pixels, int samp, int max_samp);
+
+typedef enum {
+    XFORM_NONE,
+    XFORM_FLIP_H, XFORM_FLIP_V,
+    XFORM_ROT_90, XFORM_ROT_180, XFORM_ROT_270
+} transform_op;
+
+// What to do to a JPEG: an optional rotation or flip, then an optional
+// crop of the result. The crop origin has to be on an iMCU boundary (8 or
+// 16 pixels, depending on the chroma subsampling of the image).
+struct TransformOptions {
+    transform_op op;
+    bool crop;
+    Rect crop_rect;
+
+    TransformOptions() : op(XFORM_NONE), crop(false), crop_rect(0, 0, 0, 0) {}
+};
+
+// Lossless jpegtran style transforms. The DCT coefficients are read with
+// jpeg_read_coefficients, moved (and transposed or sign flipped) block by
+// block and written back with jpeg_write_coefficients, so nothing is
+// decoded and there is no generation loss.
+//
+// Partial iMCUs on edges that a rotation or flip would move to the top or
+// left can't be moved losslessly and are trimmed, like jpegtran -trim.
+class JpegTransformer {
+    const unsigned char *src;
+    size_t src_len;
+    TransformOptions opts;
+
+    unsigned char *jpeg;
+    unsigned long jpeg_len;
+    int width, height; // of the output
+    char error[JMSG_LENGTH_MAX + 64]; // libjpeg's message when transform() throws
+
+    void transform_blocks(j_decompress_ptr srcinfo, jvirt_barray_ptr *src_coefs,
+        j_compress_ptr dstinfo, jvirt_barray_ptr *dst_coefs, int crop_x, int crop_y);
+
+public:
+    JpegTransformer(const unsigned char *ssrc, size_t ssrc_len, const TransformOptions &oopts);
+    ~JpegTransformer();
+
+    void transform();
+    const unsigned char *get_jpeg() const;
+    unsigned long get_jpeg_len() const;
+    int get_width() const;
+    int get_height() const;
+};
+
+#endif
+
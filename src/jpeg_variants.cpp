@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <cstring>
+
+#include "jpeg_variants.h"
+#include "jpeg_encoder.h"
+
+// Rows of a packed RGB level, for DctImage.
+class LevelRowSource : public JpegRowSource {
+    const unsigned char *rgb;
+    int width;
+
+public:
+    LevelRowSource(const unsigned char *rrgb, int wwidth) : rgb(rrgb), width(wwidth) {}
+    const unsigned char *get_row(int x, int y, int)
+    {
+        return rgb + ((size_t)y*width + x)*3;
+    }
+};
+
+static bool
+larger_area(const VariantPyramid::Level &a, const VariantPyramid::Level &b)
+{
+    return (long)a.width*a.height > (long)b.width*b.height;
+}
+
+VariantPyramid::VariantPyramid(const std::vector<JpegVariant> &vvariants,
+    resample_filter ffilter) :
+    variants(vvariants), filter(ffilter)
+{
+    for (size_t i = 0; i < variants.size(); i++) {
+        size_t l = 0;
+        while (l < levels.size() &&
+            (levels[l].width != variants[i].width || levels[l].height != variants[i].height))
+            l++;
+        if (l == levels.size()) {
+            Level level;
+            level.width = variants[i].width;
+            level.height = variants[i].height;
+            level.rgb = NULL;
+            level.dct = NULL;
+            level.uses = 0;
+            levels.push_back(level);
+        }
+        levels[l].uses++;
+    }
+    std::stable_sort(levels.begin(), levels.end(), larger_area);
+
+    for (size_t i = 0; i < variants.size(); i++) {
+        size_t l = 0;
+        while (levels[l].width != variants[i].width || levels[l].height != variants[i].height)
+            l++;
+        variant_level.push_back(l);
+    }
+}
+
+VariantPyramid::~VariantPyramid()
+{
+    clear();
+}
+
+void
+VariantPyramid::build(const unsigned char *data, int w, int h, buffer_type buf_type,
+    size_t stride, bool borrow)
+{
+    clear();
+
+    for (size_t l = 0; l < levels.size(); l++) {
+        Level &level = levels[l];
+        int lw = level.width, lh = level.height;
+
+        // the smallest larger level it can be resampled from
+        int parent = -1;
+        for (int p = (int)l - 1; p >= 0 && parent < 0; p--) {
+            if (levels[p].width >= lw && levels[p].height >= lh)
+                parent = p;
+        }
+
+        if (parent < 0 && lw == w && lh == h) {
+            bool packed = !stride || stride == (size_t)w*3;
+            if (borrow && buf_type == BUF_RGB && packed) {
+                level.rgb = data;
+            }
+            else {
+                level.pixels.resize((size_t)lw*lh*3);
+                BufferRowSource rows(data, w, h, buf_type, stride);
+                for (int y = 0; y < lh; y++)
+                    memcpy(&level.pixels[(size_t)y*lw*3], rows.get_row(0, y, lw), (size_t)lw*3);
+                level.rgb = &level.pixels[0];
+            }
+        }
+        else {
+            level.pixels.resize((size_t)lw*lh*3);
+            Resampler resampler(
+                parent < 0 ? data : levels[parent].rgb,
+                parent < 0 ? buf_type : BUF_RGB,
+                parent < 0 ? w : levels[parent].width,
+                parent < 0 ? h : levels[parent].height,
+                parent < 0 ? stride : 0, lw, lh, filter);
+            for (int y = 0; y < lh; y++) {
+                row_to_rgb(resampler.get_row(y), &level.pixels[(size_t)y*lw*3], lw,
+                    resampler.out_type());
+            }
+            level.rgb = &level.pixels[0];
+        }
+
+        if (level.uses > 1) {
+            LevelRowSource rows(level.rgb, lw);
+            level.dct = new DctImage(rows, lw, lh);
+        }
+    }
+
+    // levels with a DctImage only needed their pixels for smaller levels
+    for (size_t l = 0; l < levels.size(); l++) {
+        if (levels[l].dct) {
+            std::vector<unsigned char>().swap(levels[l].pixels);
+            levels[l].rgb = NULL;
+        }
+    }
+}
+
+// Frees the levels, but keeps what they are, so build() can run again.
+void
+VariantPyramid::clear()
+{
+    for (size_t l = 0; l < levels.size(); l++) {
+        delete levels[l].dct;
+        levels[l].dct = NULL;
+        std::vector<unsigned char>().swap(levels[l].pixels);
+        levels[l].rgb = NULL;
+    }
+}
+
+size_t
+VariantPyramid::size() const
+{
+    return variants.size();
+}
+
+const JpegVariant &
+VariantPyramid::variant(size_t i) const
+{
+    return variants[i];
+}
+
+const VariantPyramid::Level &
+VariantPyramid::level(size_t i) const
+{
+    return levels[variant_level[i]];
+}
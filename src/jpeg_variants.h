@@ -0,0 +1,57 @@
+#ifndef JPEG_VARIANTS_H
+#define JPEG_VARIANTS_H
+
+#include <vector>
+
+#include "common.h"
+#include "resample.h"
+#include "dct_image.h"
+
+struct JpegVariant {
+    int width, height, quality;
+};
+
+// The images a set of JpegVariants is encoded from. The source is read and
+// converted once: the largest size is resampled from it (or converted, or
+// just pointed at when it's already packed RGB) and every smaller size is
+// resampled from the next larger one, so each level reads a smaller image
+// than the source. Sizes that more than one variant asks for are also
+// transformed once into a DctImage, so their qualities only differ in
+// quantization and entropy coding.
+//
+// Once build() has returned the variants can be encoded from any number of
+// threads at the same time.
+class VariantPyramid {
+public:
+    struct Level {
+        int width, height;
+        std::vector<unsigned char> pixels;
+        const unsigned char *rgb; // packed RGB, pixels or the source
+        DctImage *dct; // NULL when only one variant has this size
+        int uses;
+    };
+
+private:
+    std::vector<JpegVariant> variants;
+    std::vector<Level> levels; // largest first
+    std::vector<int> variant_level;
+    resample_filter filter;
+
+public:
+    VariantPyramid(const std::vector<JpegVariant> &vvariants, resample_filter ffilter);
+    ~VariantPyramid();
+
+    // With borrow set, a level the size of the source that is packed RGB
+    // points at data instead of copying it, so data has to outlive the
+    // encodes.
+    void build(const unsigned char *data, int w, int h, buffer_type buf_type,
+        size_t stride, bool borrow);
+    void clear();
+
+    size_t size() const;
+    const JpegVariant &variant(size_t i) const;
+    const Level &level(size_t i) const; // of variant i
+};
+
+#endif
+
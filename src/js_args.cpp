@@ -0,0 +1,383 @@
+#include <node_buffer.h>
+#include <cstdlib>
+#include <cstring>
+
+#include "js_args.h"
+
+using namespace v8;
+using namespace node;
+
+bool
+get_bytes(Handle<Value> val, unsigned char *&data, size_t &len)
+{
+    if (Buffer::HasInstance(val)) {
+        Local<Object> buf = val->ToObject();
+        data = (unsigned char *)Buffer::Data(buf);
+        len = Buffer::Length(buf);
+        return true;
+    }
+    if (!val->IsObject()) return false;
+
+    // typed arrays and ArrayBuffers keep their bytes as external array
+    // data, like Buffers do
+    Local<Object> obj = val->ToObject();
+    if (!obj->HasIndexedPropertiesInExternalArrayData()) return false;
+
+    size_t elem_size;
+    switch (obj->GetIndexedPropertiesExternalArrayDataType()) {
+    case kExternalByteArray:
+    case kExternalUnsignedByteArray:
+    case kExternalPixelArray:
+        elem_size = 1;
+        break;
+    case kExternalShortArray:
+    case kExternalUnsignedShortArray:
+        elem_size = 2;
+        break;
+    case kExternalIntArray:
+    case kExternalUnsignedIntArray:
+    case kExternalFloatArray:
+        elem_size = 4;
+        break;
+    case kExternalDoubleArray:
+        elem_size = 8;
+        break;
+    default:
+        return false;
+    }
+    data = (unsigned char *)obj->GetIndexedPropertiesExternalArrayData();
+    len = (size_t)obj->GetIndexedPropertiesExternalArrayDataLength()*elem_size;
+    return true;
+}
+
+Local<Object>
+stats_object(const EncodeStats &stats)
+{
+    Local<Object> obj = Object::New();
+    obj->Set(String::NewSymbol("encodes"), Number::New((double)stats.encodes));
+    obj->Set(String::NewSymbol("convertNs"), Number::New((double)stats.convert_ns));
+    obj->Set(String::NewSymbol("scanlinesNs"), Number::New((double)stats.scanlines_ns));
+    obj->Set(String::NewSymbol("finishNs"), Number::New((double)stats.finish_ns));
+    obj->Set(String::NewSymbol("growNs"), Number::New((double)stats.grow_ns));
+    obj->Set(String::NewSymbol("copyNs"), Number::New((double)stats.copy_ns));
+    obj->Set(String::NewSymbol("queueWaitNs"), Number::New((double)stats.queue_wait_ns));
+    obj->Set(String::NewSymbol("bytesIn"), Number::New((double)stats.bytes_in));
+    obj->Set(String::NewSymbol("bytesOut"), Number::New((double)stats.bytes_out));
+    obj->Set(String::NewSymbol("allocations"), Number::New((double)stats.allocations));
+    return obj;
+}
+
+Local<Object>
+metrics_object(const ImageMetrics &metrics)
+{
+    Local<Object> obj = Object::New();
+    obj->Set(String::NewSymbol("psnr"), Number::New(metrics.psnr));
+    obj->Set(String::NewSymbol("ssim"), Number::New(metrics.ssim));
+    obj->Set(String::NewSymbol("mse"), Number::New(metrics.mse));
+    return obj;
+}
+
+const char *
+parse_file_target(Handle<Value> dest, Handle<Value> opts, FileTarget &target)
+{
+    if (!opts->IsUndefined()) {
+        if (!opts->IsObject())
+            return "Options must be an object.";
+        target.fsync = opts->ToObject()->Get(String::NewSymbol("fsync"))->BooleanValue();
+    }
+
+    if (dest->IsString()) {
+        String::Utf8Value path(dest);
+        target.path = strdup(*path);
+        if (!target.path) return "strdup failed in parse_file_target.";
+    }
+    else if (dest->IsInt32() && dest->Int32Value() >= 0) {
+        target.fd = dest->Int32Value();
+    }
+    else {
+        return "First argument must be a path or a file descriptor.";
+    }
+    return NULL;
+}
+
+static const char *
+get_size_option(Handle<Object> opts, const char *name, size_t &value)
+{
+    Local<Value> v = opts->Get(String::NewSymbol(name));
+    if (v->IsUndefined())
+        return NULL;
+    // past 2^53 doubles aren't exact, and no buffer is that large anyway
+    if (!v->IsNumber() || v->IntegerValue() < 0 || v->NumberValue() > 9007199254740991.0)
+        return "Offset, stride, x and y must be non-negative integers.";
+    if ((uint64_t)v->IntegerValue() > (size_t)-1)
+        return "Offset, stride, x or y is too large.";
+    value = (size_t)v->IntegerValue();
+    return NULL;
+}
+
+const char *
+parse_source_options(Handle<Value> opts, SourceOptions &o)
+{
+    if (opts->IsUndefined())
+        return NULL;
+    if (!opts->IsObject())
+        return "Options must be an object.";
+
+    Local<Object> obj = opts->ToObject();
+    const char *err = get_size_option(obj, "offset", o.offset);
+    if (!err) err = get_size_option(obj, "stride", o.stride);
+    if (!err) err = get_size_option(obj, "x", o.x);
+    if (!err) err = get_size_option(obj, "y", o.y);
+    return err;
+}
+
+const char *
+parse_blend_option(Handle<Value> opts, buffer_type buf_type, blend_mode &blend)
+{
+    if (!opts->IsObject())
+        return NULL;
+
+    Local<Value> v = opts->ToObject()->Get(String::NewSymbol("blend"));
+    if (v->IsUndefined())
+        return NULL;
+    if (!v->IsString())
+        return "Blend must be 'over' or 'premultiplied'.";
+
+    String::AsciiValue mode(v->ToString());
+    if (str_eq(*mode, "over"))
+        blend = BLEND_OVER;
+    else if (str_eq(*mode, "premultiplied"))
+        blend = BLEND_PREMULTIPLIED;
+    else
+        return "Blend must be 'over' or 'premultiplied'.";
+
+    if (!has_alpha(buf_type))
+        return "Blending needs a buffer type with alpha: 'rgba', 'bgra' or 'argb'.";
+    return NULL;
+}
+
+static const char *
+get_dimension_option(Handle<Object> opts, const char *name, int &value)
+{
+    Local<Value> v = opts->Get(String::NewSymbol(name));
+    if (v->IsUndefined())
+        return NULL;
+    if (!v->IsInt32() || v->Int32Value() <= 0)
+        return "dstWidth and dstHeight must be positive integers.";
+    value = v->Int32Value();
+    return NULL;
+}
+
+const char *
+parse_scale_options(Handle<Value> opts, int w, int h, ScaleOptions &scale)
+{
+    if (!opts->IsObject())
+        return NULL;
+
+    Local<Object> obj = opts->ToObject();
+    int dst_w = 0, dst_h = 0;
+    const char *err = get_dimension_option(obj, "dstWidth", dst_w);
+    if (!err) err = get_dimension_option(obj, "dstHeight", dst_h);
+    if (err) return err;
+
+    Local<Value> filter = obj->Get(String::NewSymbol("filter"));
+    if (!filter->IsUndefined()) {
+        if (!filter->IsString())
+            return "Filter must be 'box', 'bilinear' or 'lanczos'.";
+        String::AsciiValue name(filter->ToString());
+        if (!parse_resample_filter(*name, scale.filter))
+            return "Filter must be 'box', 'bilinear' or 'lanczos'.";
+    }
+
+    if (!dst_w && !dst_h)
+        return NULL;
+    if (!w || !h)
+        return "Can't scale an empty fragment.";
+    if (!dst_w) dst_w = (int)(((long long)dst_h*w + h/2)/h);
+    if (!dst_h) dst_h = (int)(((long long)dst_w*h + w/2)/w);
+    scale.width = dst_w > 0 ? dst_w : 1;
+    scale.height = dst_h > 0 ? dst_h : 1;
+    return NULL;
+}
+
+const char *
+parse_variants(Handle<Value> list, int w, int h, int quality,
+    std::vector<JpegVariant> &variants)
+{
+    if (!list->IsArray())
+        return "Variants must be an array.";
+    Local<Array> arr = Local<Array>::Cast(list);
+    if (arr->Length() == 0)
+        return "At least one variant required.";
+
+    for (uint32_t i = 0; i < arr->Length(); i++) {
+        Local<Value> item = arr->Get(i);
+        if (!item->IsObject())
+            return "Each variant must be a { width, height, quality } object.";
+        Local<Object> obj = item->ToObject();
+
+        JpegVariant v;
+        v.width = w;
+        v.height = h;
+        v.quality = quality;
+
+        Local<Value> vw = obj->Get(String::NewSymbol("width"));
+        Local<Value> vh = obj->Get(String::NewSymbol("height"));
+        Local<Value> vq = obj->Get(String::NewSymbol("quality"));
+        if (!vw->IsUndefined()) {
+            if (!vw->IsInt32() || vw->Int32Value() <= 0)
+                return "Variant width and height must be positive integers.";
+            v.width = vw->Int32Value();
+        }
+        if (!vh->IsUndefined()) {
+            if (!vh->IsInt32() || vh->Int32Value() <= 0)
+                return "Variant width and height must be positive integers.";
+            v.height = vh->Int32Value();
+        }
+        if (v.width > w || v.height > h)
+            return "Variants can't be larger than the image.";
+        if (!vq->IsUndefined()) {
+            if (!vq->IsInt32() || vq->Int32Value() < 0 || vq->Int32Value() > 100)
+                return "Variant quality must be between 0 and 100.";
+            v.quality = vq->Int32Value();
+        }
+        variants.push_back(v);
+    }
+    return NULL;
+}
+
+const char *
+parse_variants_options(Handle<Value> opts, resample_filter &filter)
+{
+    if (!opts->IsObject())
+        return "Options must be an object.";
+
+    Local<Value> f = opts->ToObject()->Get(String::NewSymbol("filter"));
+    if (!f->IsUndefined()) {
+        if (!f->IsString())
+            return "Filter must be 'box', 'bilinear' or 'lanczos'.";
+        String::AsciiValue name(f->ToString());
+        if (!parse_resample_filter(*name, filter))
+            return "Filter must be 'box', 'bilinear' or 'lanczos'.";
+    }
+    return NULL;
+}
+
+const char *
+parse_transform_options(Handle<Value> opts, TransformOptions &t)
+{
+    if (!opts->IsObject())
+        return "Options must be an object.";
+    Local<Object> obj = opts->ToObject();
+
+    Local<Value> rotate = obj->Get(String::NewSymbol("rotate"));
+    Local<Value> flip = obj->Get(String::NewSymbol("flip"));
+    if (!rotate->IsUndefined() && !flip->IsUndefined())
+        return "Use either rotate or flip, not both.";
+
+    if (!rotate->IsUndefined()) {
+        if (!rotate->IsInt32())
+            return "Rotate must be 0, 90, 180 or 270.";
+        switch (rotate->Int32Value()) {
+        case 0: t.op = XFORM_NONE; break;
+        case 90: t.op = XFORM_ROT_90; break;
+        case 180: t.op = XFORM_ROT_180; break;
+        case 270: t.op = XFORM_ROT_270; break;
+        default:
+            return "Rotate must be 0, 90, 180 or 270.";
+        }
+    }
+
+    if (!flip->IsUndefined()) {
+        if (!flip->IsString())
+            return "Flip must be 'horizontal' or 'vertical'.";
+        String::AsciiValue dir(flip->ToString());
+        if (str_eq(*dir, "horizontal"))
+            t.op = XFORM_FLIP_H;
+        else if (str_eq(*dir, "vertical"))
+            t.op = XFORM_FLIP_V;
+        else
+            return "Flip must be 'horizontal' or 'vertical'.";
+    }
+
+    Local<Value> crop = obj->Get(String::NewSymbol("crop"));
+    if (!crop->IsUndefined()) {
+        if (!crop->IsObject())
+            return "Crop must be an object with x, y, width and height.";
+        Local<Object> c = crop->ToObject();
+        Local<Value> x = c->Get(String::NewSymbol("x"));
+        Local<Value> y = c->Get(String::NewSymbol("y"));
+        Local<Value> w = c->Get(String::NewSymbol("width"));
+        Local<Value> h = c->Get(String::NewSymbol("height"));
+        if (!x->IsInt32() || !y->IsInt32() || !w->IsInt32() || !h->IsInt32())
+            return "Crop must be an object with integer x, y, width and height.";
+        if (x->Int32Value() < 0 || y->Int32Value() < 0)
+            return "Crop x and y can't be negative.";
+        t.crop = true;
+        t.crop_rect = Rect(x->Int32Value(), y->Int32Value(), w->Int32Value(), h->Int32Value());
+    }
+    return NULL;
+}
+
+const char *
+check_copy_rect(const Rect &src, int dst_x, int dst_y, int width, int height)
+{
+    if (src.w < 0)
+        return "Width smaller than 0.";
+    if (src.h < 0)
+        return "Height smaller than 0.";
+    // compared by subtracting, x + w can overflow for x near INT_MAX
+    if (src.x < 0 || src.y < 0 || src.x > width || src.w > width - src.x ||
+        src.y > height || src.h > height - src.y)
+        return "Source rect exceeds the canvas.";
+    if (dst_x < 0 || dst_y < 0 || dst_x > width || src.w > width - dst_x ||
+        dst_y > height || src.h > height - dst_y)
+        return "Destination rect exceeds the canvas.";
+    return NULL;
+}
+
+static bool
+mul_overflows(size_t a, size_t b)
+{
+    return b && a > (size_t)-1/b;
+}
+
+// The options come straight from JavaScript, so every product and sum is
+// checked: a wrapped start or span would pass the callers' length checks.
+const char *
+source_extent(const SourceOptions &o, int w, int h, buffer_type buf_type,
+    size_t &start, size_t &span)
+{
+    const char *too_large = "Offset, stride, x or y is too large.";
+    size_t bpp = bytes_per_pixel(buf_type);
+    size_t stride = o.stride ? o.stride : (size_t)w*bpp;
+
+    if (is_planar(buf_type) && (o.x || o.y))
+        return "x and y can't be used with planar buffer types.";
+
+    if (o.x > (size_t)-1 - w || mul_overflows(o.x + w, bpp))
+        return too_large;
+    if (stride < (o.x + w)*bpp)
+        return "Stride is smaller than a row of pixels.";
+
+    // image_span is at most 4*(h + 2)*stride, chroma planes included
+    if (mul_overflows(stride, 4*((size_t)h + 2)))
+        return too_large;
+    span = image_span(w, h, buf_type, stride);
+
+    if (mul_overflows(o.y, stride))
+        return too_large;
+    size_t row_start = o.y*stride + o.x*bpp; // x*bpp <= stride
+    if (row_start < o.y*stride || o.offset > (size_t)-1 - row_start)
+        return too_large;
+    start = o.offset + row_start;
+    if (start > (size_t)-1 - span)
+        return too_large;
+    return NULL;
+}
+
+bool
+extent_fits(size_t start, size_t span, size_t len)
+{
+    return start <= len && span <= len - start;
+}
@@ -0,0 +1,85 @@
+#ifndef JS_ARGS_H
+#define JS_ARGS_H
+
+#include <node.h>
+
+#include "jpeg_encoder.h"
+#include "blend.h"
+#include "resample.h"
+#include "jpeg_transform.h"
+#include "jpeg_variants.h"
+
+// Where the pixels of a Jpeg, a pushed fragment or a background start, and
+// how far apart their rows are, from the optional { offset, stride, x, y }
+// argument. x and y select a sub-image of a larger framebuffer.
+struct SourceOptions {
+    size_t offset; // bytes to skip in the buffer or file
+    size_t stride; // bytes between rows, 0 if tightly packed
+    size_t x, y;   // origin of the view in pixels
+
+    SourceOptions() : offset(0), stride(0), x(0), y(0) {}
+};
+
+// Bytes of a Buffer, a typed array of any element type (including
+// subarrays) or an ArrayBuffer, without copying them. Returns false for
+// anything else.
+bool get_bytes(v8::Handle<v8::Value> val, unsigned char *&data, size_t &len);
+
+// Fills o from opts (which may be undefined). Returns an error message, or
+// NULL on success.
+const char *parse_source_options(v8::Handle<v8::Value> opts, SourceOptions &o);
+
+// Resolves o for a w x h view of buf_type pixels: start is the byte offset
+// of the view's first pixel and span the number of bytes it covers from
+// there. Returns an error message, or NULL on success.
+const char *source_extent(const SourceOptions &o, int w, int h, buffer_type buf_type,
+    size_t &start, size_t &span);
+
+// Whether span bytes from start lie within len bytes. Compared without
+// adding start and span, so it can't wrap.
+bool extent_fits(size_t start, size_t span, size_t len);
+
+// Reads push's { blend: 'over' | 'premultiplied' } option into blend, which
+// is left as is when the option is absent. Returns an error message, or
+// NULL on success.
+const char *parse_blend_option(v8::Handle<v8::Value> opts, buffer_type buf_type,
+    blend_mode &blend);
+
+// Reads push's { dstWidth, dstHeight, filter } options into scale for a
+// w x h fragment. If only one of the sizes is given the other keeps the
+// aspect ratio. Returns an error message, or NULL on success.
+const char *parse_scale_options(v8::Handle<v8::Value> opts, int w, int h,
+    ScaleOptions &scale);
+
+// Reads encodeVariants' [{ width, height, quality }, ...] for a w x h
+// source. Missing sizes are the source's, a missing quality is quality.
+// Returns an error message, or NULL on success.
+const char *parse_variants(v8::Handle<v8::Value> list, int w, int h, int quality,
+    std::vector<JpegVariant> &variants);
+
+// Reads encodeVariants' { filter } option. Returns an error message, or
+// NULL on success.
+const char *parse_variants_options(v8::Handle<v8::Value> opts, resample_filter &filter);
+
+// Reads transform's { rotate, flip, crop: { x, y, width, height } }
+// options. Returns an error message, or NULL on success.
+const char *parse_transform_options(v8::Handle<v8::Value> opts, TransformOptions &t);
+
+// Checks copyRect's src rect and its destination at (dst_x, dst_y) against
+// a width x height canvas. Returns an error message, or NULL if both are
+// inside it.
+const char *check_copy_rect(const Rect &src, int dst_x, int dst_y, int width, int height);
+
+// EncodeStats as a JS object. Times are in nanoseconds.
+v8::Local<v8::Object> stats_object(const EncodeStats &stats);
+
+// ImageMetrics as { psnr, ssim, mse }.
+v8::Local<v8::Object> metrics_object(const ImageMetrics &metrics);
+
+// Fills target from encodeToFile's (path|fd, [options]) arguments.
+// Returns an error message, or NULL on success.
+const char *parse_file_target(v8::Handle<v8::Value> dest, v8::Handle<v8::Value> opts,
+    FileTarget &target);
+
+#endif
+
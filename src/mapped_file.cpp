@@ -0,0 +1,87 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mapped_file.h"
+
+MappedFile::MappedFile() : map(NULL), map_len(0), bytes(NULL), length(0) {}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+void
+MappedFile::open(const char *path, off_t offset, size_t llength)
+{
+    close();
+
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) throw "open failed in MappedFile::open.";
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw "fstat failed in MappedFile::open.";
+    }
+    if (offset < 0 || (size_t)offset > (size_t)st.st_size ||
+        llength > (size_t)st.st_size - (size_t)offset) {
+        ::close(fd);
+        throw "File is too small for the given offset, dimensions and buffer type.";
+    }
+    if (llength == 0) {
+        ::close(fd);
+        return;
+    }
+
+    // mmap offsets have to be page aligned
+    off_t page = sysconf(_SC_PAGESIZE);
+    off_t map_offset = offset - offset%page;
+    size_t lead = offset - map_offset;
+
+    void *m = mmap(NULL, lead + llength, PROT_READ, MAP_SHARED, fd, map_offset);
+    ::close(fd);
+    if (m == MAP_FAILED) throw "mmap failed in MappedFile::open.";
+
+    map = m;
+    map_len = lead + llength;
+    bytes = (const unsigned char *)m + lead;
+    length = llength;
+}
+
+void
+MappedFile::close()
+{
+    if (map) munmap(map, map_len);
+    map = NULL;
+    map_len = 0;
+    bytes = NULL;
+    length = 0;
+}
+
+const unsigned char *
+MappedFile::data() const
+{
+    return bytes;
+}
+
+size_t
+MappedFile::size() const
+{
+    return length;
+}
+
+// The encoder reads scanlines top to bottom, let the kernel read ahead.
+void
+MappedFile::advise_sequential() const
+{
+    if (map) madvise(map, map_len, MADV_SEQUENTIAL);
+}
+
+// Drops the mapped pages from our RSS; they stay in the page cache.
+void
+MappedFile::release_pages() const
+{
+    if (map) madvise(map, map_len, MADV_DONTNEED);
+}
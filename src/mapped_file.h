@@ -0,0 +1,30 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <sys/types.h>
+#include <cstddef>
+
+// Read-only mmap of a byte range of a file, used to encode and push raw
+// pixels straight from disk instead of reading them into a Buffer first.
+class MappedFile {
+    void *map;
+    size_t map_len;
+    const unsigned char *bytes;
+    size_t length;
+
+public:
+    MappedFile();
+    ~MappedFile();
+
+    void open(const char *path, off_t offset, size_t llength);
+    void close();
+
+    const unsigned char *data() const;
+    size_t size() const;
+
+    void advise_sequential() const;
+    void release_pages() const;
+};
+
+#endif
+
@@ -0,0 +1,70 @@
+#include <node.h>
+
+#include "metrics.h"
+#include "jpeg_encoder.h"
+#include "js_args.h"
+
+using namespace v8;
+using namespace node;
+
+void
+Metrics::Initialize(v8::Handle<v8::Object> target)
+{
+    NanScope();
+
+    NODE_SET_METHOD(target, "compare", Compare);
+}
+
+NAN_METHOD(Metrics::Compare)
+{
+    NanScope();
+
+    if (args.Length() < 4)
+        return NanThrowError("At least four arguments required - bufA, bufB, width, height, [and buffer type]");
+    unsigned char *a, *b;
+    size_t a_len, b_len;
+    if (!get_bytes(args[0], a, a_len))
+        return NanThrowTypeError("First argument must be a Buffer, typed array or ArrayBuffer.");
+    if (!get_bytes(args[1], b, b_len))
+        return NanThrowTypeError("Second argument must be a Buffer, typed array or ArrayBuffer.");
+    if (!args[2]->IsInt32())
+        return NanThrowTypeError("Third argument must be integer width.");
+    if (!args[3]->IsInt32())
+        return NanThrowTypeError("Fourth argument must be integer height.");
+
+    int w = args[2]->Int32Value();
+    int h = args[3]->Int32Value();
+
+    if (w < 0)
+        return NanThrowRangeError("Width can't be negative.");
+    if (h < 0)
+        return NanThrowRangeError("Height can't be negative.");
+
+    buffer_type buf_type = BUF_RGB;
+    if (args.Length() >= 5) {
+        if (!args[4]->IsString())
+            return NanThrowTypeError("Fifth argument must be a string. One of " BUFFER_TYPES ".");
+
+        String::AsciiValue bt(args[4]->ToString());
+        if (!parse_buffer_type(*bt, buf_type))
+            return NanThrowTypeError("Buffer type must be " BUFFER_TYPES ".");
+    }
+
+    size_t start, span;
+    const char *extent_err = source_extent(SourceOptions(), w, h, buf_type, start, span);
+    if (extent_err) return NanThrowRangeError(extent_err);
+    if (span > a_len || span > b_len)
+        return NanThrowRangeError("Buffer is too small for the given width, height and buffer type.");
+
+    try {
+        // rows come out of a BufferRowSource as RGB, whatever the type
+        BufferRowSource rows_a(a, w, h, buf_type), rows_b(b, w, h, buf_type);
+        MetricsAccumulator acc(w, h);
+        for (int y = 0; y < h; y++)
+            acc.add_row(rows_a.get_row(0, y, w), rows_b.get_row(0, y, w));
+        NanReturnValue(metrics_object(acc.result()));
+    }
+    catch (const char *err) {
+        return NanThrowError(err);
+    }
+}
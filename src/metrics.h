@@ -0,0 +1,19 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <node.h>
+
+#include "common.h"
+#include "image_metrics.h"
+
+// Module level compare(bufA, bufB, width, height, [buffer type]): PSNR and
+// SSIM between two images, for quality vs. size sweeps.
+class Metrics {
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+
+    static NAN_METHOD(Compare);
+};
+
+#endif
+
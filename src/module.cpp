@@ -3,6 +3,12 @@
 #include "jpeg.h"
 #include "fixed_jpeg_stack.h"
 #include "dynamic_jpeg_stack.h"
+#include "background.h"
+#include "shared_memory.h"
+#include "transform.h"
+#include "stats.h"
+#include "metrics.h"
+#include "external_memory.h"
 
 using namespace v8;
 
@@ -13,6 +19,14 @@ init(Handle<Object> target)
     Jpeg::Initialize(target);
     FixedJpegStack::Initialize(target);
     DynamicJpegStack::Initialize(target);
+    Background::Initialize(target);
+    SharedMemory::Initialize(target);
+    Transform::Initialize(target);
+    Stats::Initialize(target);
+    Metrics::Initialize(target);
+    ExternalMemory::Initialize(target);
 }
 
+// Not registered context-aware: async workers and scan callbacks are bound
+// to uv_default_loop(), which only the main context runs.
 NODE_MODULE(jpeg, init)
@@ -0,0 +1,230 @@
+#include <cmath>
+
+#include "resample.h"
+#include "blend.h"
+
+#define WEIGHT_BITS 14 // filter weights are 1.14 fixed point
+#define HPASS_BITS 7   // fraction bits kept between the two passes
+
+bool
+parse_resample_filter(const char *name, resample_filter &filter)
+{
+    if (str_eq(name, "box")) filter = FILTER_BOX;
+    else if (str_eq(name, "bilinear")) filter = FILTER_BILINEAR;
+    else if (str_eq(name, "lanczos")) filter = FILTER_LANCZOS;
+    else return false;
+    return true;
+}
+
+static double
+filter_support(resample_filter filter)
+{
+    switch (filter) {
+    case FILTER_BOX: return 0.5;
+    case FILTER_BILINEAR: return 1.0;
+    case FILTER_LANCZOS: return 3.0;
+    default:
+        throw "Unexpected filter in filter_support";
+    }
+}
+
+static double
+sinc(double x)
+{
+    if (x == 0.0) return 1.0;
+    x *= M_PI;
+    return sin(x)/x;
+}
+
+static double
+filter_value(resample_filter filter, double x)
+{
+    switch (filter) {
+    case FILTER_BOX:
+        return x >= -0.5 && x < 0.5 ? 1.0 : 0.0;
+    case FILTER_BILINEAR:
+        x = fabs(x);
+        return x < 1.0 ? 1.0 - x : 0.0;
+    case FILTER_LANCZOS:
+        x = fabs(x);
+        return x < 3.0 ? sinc(x)*sinc(x/3.0) : 0.0;
+    default:
+        throw "Unexpected filter in filter_value";
+    }
+}
+
+// Weights of the source pixels that contribute to each of dst output
+// pixels. When downscaling the filter is stretched by the scale factor, so
+// every source pixel contributes.
+void
+Resampler::make_taps(Taps &taps, int src, int dst, resample_filter filter)
+{
+    double scale = (double)src/dst;
+    double fscale = scale > 1.0 ? scale : 1.0;
+    double support = filter_support(filter)*fscale;
+
+    taps.start.resize(dst);
+    taps.count.resize(dst);
+    taps.offset.resize(dst);
+    taps.weights.clear();
+    taps.max_count = 0;
+
+    std::vector<double> w;
+    for (int i = 0; i < dst; i++) {
+        double center = (i + 0.5)*scale;
+        int lo = (int)floor(center - support);
+        int hi = (int)ceil(center + support);
+        if (lo < 0) lo = 0;
+        if (hi > src - 1) hi = src - 1;
+
+        w.clear();
+        double sum = 0;
+        for (int j = lo; j <= hi; j++) {
+            w.push_back(filter_value(filter, (j + 0.5 - center)/fscale));
+            sum += w.back();
+        }
+
+        // drop zero weights at either end
+        int first = 0, last = (int)w.size() - 1;
+        while (first < last && w[first] == 0.0) first++;
+        while (last > first && w[last] == 0.0) last--;
+
+        if (sum == 0.0) {
+            // nothing under the filter (box upscaling at an edge), use nearest
+            int nearest = (int)center;
+            if (nearest > src - 1) nearest = src - 1;
+            lo = nearest; first = last = 0;
+            w.assign(1, 1.0);
+            sum = 1.0;
+        }
+
+        taps.start[i] = lo + first;
+        taps.count[i] = last - first + 1;
+        taps.offset[i] = taps.weights.size();
+        if (taps.count[i] > taps.max_count) taps.max_count = taps.count[i];
+
+        // quantize so that the weights add up to exactly 1.0
+        int total = 0, largest = taps.offset[i];
+        for (int j = first; j <= last; j++) {
+            int iw = (int)floor(w[j]/sum*(1 << WEIGHT_BITS) + 0.5);
+            taps.weights.push_back(iw);
+            total += iw;
+            if (iw > taps.weights[largest]) largest = taps.weights.size() - 1;
+        }
+        taps.weights[largest] += (1 << WEIGHT_BITS) - total;
+    }
+}
+
+Resampler::Resampler(const unsigned char *ddata, buffer_type bbuf_type, int ssrc_w, int ssrc_h,
+    size_t sstride, int ddst_w, int ddst_h, resample_filter filter, bool ppremultiply) :
+    data(ddata), buf_type(bbuf_type),
+    planes(ddata, ssrc_w, ssrc_h, bbuf_type, sstride),
+    src_w(ssrc_w), src_h(ssrc_h), dst_w(ddst_w), dst_h(ddst_h),
+    channels(has_alpha(bbuf_type) ? 4 : 3), premultiply(ppremultiply)
+{
+    stride = sstride ? sstride : (size_t)src_w*bytes_per_pixel(buf_type);
+
+    make_taps(htaps, src_w, dst_w, filter);
+    make_taps(vtaps, src_h, dst_h, filter);
+
+    src_row.resize((size_t)src_w*channels);
+    ring.resize((size_t)vtaps.max_count*dst_w*channels);
+    ring_row.assign(vtaps.max_count, -1);
+    acc.resize((size_t)dst_w*channels);
+    out.resize((size_t)dst_w*channels);
+}
+
+buffer_type
+Resampler::out_type() const
+{
+    return channels == 4 ? BUF_RGBA : BUF_RGB;
+}
+
+// Source row sy in RGB(A) order, optionally premultiplied.
+static void
+stage_row(const unsigned char *src, unsigned char *dst, int pixels, buffer_type buf_type,
+    bool premultiply)
+{
+    switch (buf_type) {
+    case BUF_RGBA:
+        memcpy(dst, src, (size_t)pixels*4);
+        break;
+    case BUF_BGRA:
+        for (int i = 0; i < pixels*4; i += 4) {
+            dst[i] = src[i+2]; dst[i+1] = src[i+1]; dst[i+2] = src[i]; dst[i+3] = src[i+3];
+        }
+        break;
+    case BUF_ARGB:
+        for (int i = 0; i < pixels*4; i += 4) {
+            dst[i] = src[i+1]; dst[i+1] = src[i+2]; dst[i+2] = src[i+3]; dst[i+3] = src[i];
+        }
+        break;
+    default:
+        row_to_rgb(src, dst, pixels, buf_type);
+        return;
+    }
+
+    if (premultiply) {
+        for (int i = 0; i < pixels*4; i += 4) {
+            unsigned int a = dst[i+3];
+            dst[i] = (dst[i]*a + 127)/255;
+            dst[i+1] = (dst[i+1]*a + 127)/255;
+            dst[i+2] = (dst[i+2]*a + 127)/255;
+        }
+    }
+}
+
+// Row sy filtered horizontally, with HPASS_BITS of fraction.
+const int *
+Resampler::filtered_row(int sy)
+{
+    int slot = sy % vtaps.max_count;
+    int *row = &ring[(size_t)slot*dst_w*channels];
+    if (ring_row[slot] == sy)
+        return row;
+
+    if (is_planar(buf_type))
+        yuv_row_to_rgb(planes, 0, sy, src_w, &src_row[0]);
+    else
+        stage_row(data + (size_t)sy*stride, &src_row[0], src_w, buf_type, premultiply);
+
+    const int round = 1 << (WEIGHT_BITS - HPASS_BITS - 1);
+    for (int i = 0; i < dst_w; i++) {
+        const unsigned char *s = &src_row[(size_t)htaps.start[i]*channels];
+        const int *w = &htaps.weights[htaps.offset[i]];
+        int *d = row + i*channels;
+        for (int c = 0; c < channels; c++) {
+            int sum = 0;
+            for (int k = 0; k < htaps.count[i]; k++)
+                sum += s[k*channels + c]*w[k];
+            d[c] = (sum + round) >> (WEIGHT_BITS - HPASS_BITS);
+        }
+    }
+    ring_row[slot] = sy;
+    return row;
+}
+
+const unsigned char *
+Resampler::get_row(int dy)
+{
+    int n = dst_w*channels;
+    const int *w = &vtaps.weights[vtaps.offset[dy]];
+
+    // one multiply-add pass over the whole row per tap, which the compiler
+    // vectorizes
+    int *a = &acc[0];
+    for (int i = 0; i < n; i++) a[i] = 0;
+    for (int k = 0; k < vtaps.count[dy]; k++) {
+        const int *row = filtered_row(vtaps.start[dy] + k);
+        int wk = w[k];
+        for (int i = 0; i < n; i++)
+            a[i] += row[i]*wk;
+    }
+
+    const int shift = WEIGHT_BITS + HPASS_BITS;
+    for (int i = 0; i < n; i++) {
+        int v = (a[i] + (1 << (shift - 1))) >> shift;
+        out[i] = v < 0 ? 0 : (v > 255 ? 255 : v);
+    }
+    return &out[0];
+}
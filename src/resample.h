@@ -0,0 +1,65 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <vector>
+
+#include "common.h"
+
+typedef enum { FILTER_BOX, FILTER_BILINEAR, FILTER_LANCZOS } resample_filter;
+
+bool parse_resample_filter(const char *name, resample_filter &filter);
+
+// Target size of a scaled push. A width of 0 means no scaling.
+struct ScaleOptions {
+    int width, height;
+    resample_filter filter;
+
+    ScaleOptions() : width(0), height(0), filter(FILTER_BILINEAR) {}
+    bool enabled() const { return width > 0; }
+};
+
+// Separable resampler that produces the rows of a scaled copy of an image
+// one at a time. Each source row is converted and filtered horizontally
+// once, into a ring of rows as tall as the vertical filter, so no scaled or
+// converted copy of the whole image is ever made.
+//
+// Output rows are packed RGB, or RGBA for buffer types with alpha (see
+// out_type). With premultiply set, colour is multiplied by alpha before
+// filtering, which is what source-over compositing needs.
+class Resampler {
+    struct Taps {
+        std::vector<int> start, count; // per output pixel
+        std::vector<int> weights;      // count[i] weights per pixel, 1.14 fixed point
+        std::vector<int> offset;       // index of pixel i's first weight
+        int max_count;
+    };
+
+    const unsigned char *data;
+    buffer_type buf_type;
+    size_t stride;
+    YuvPlanes planes;
+    int src_w, src_h, dst_w, dst_h;
+    int channels;
+    bool premultiply;
+
+    Taps htaps, vtaps;
+    std::vector<unsigned char> src_row;   // one source row in output channel order
+    std::vector<int> ring;                // horizontally filtered rows
+    std::vector<int> ring_row;            // source row held in each ring slot
+    std::vector<int> acc;
+    std::vector<unsigned char> out;
+
+    static void make_taps(Taps &taps, int src, int dst, resample_filter filter);
+    const int *filtered_row(int sy);
+
+public:
+    Resampler(const unsigned char *ddata, buffer_type bbuf_type, int ssrc_w, int ssrc_h,
+        size_t sstride, int ddst_w, int ddst_h, resample_filter filter,
+        bool ppremultiply = false);
+
+    buffer_type out_type() const;
+    const unsigned char *get_row(int dy); // dy must not decrease between calls
+};
+
+#endif
+
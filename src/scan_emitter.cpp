@@ -0,0 +1,92 @@
+#include <node.h>
+#include <node_buffer.h>
+#include <cstring>
+
+#include "scan_emitter.h"
+
+using namespace v8;
+using namespace node;
+
+ScanEmitter::ScanEmitter(NanCallback *ccallback) : callback(ccallback)
+{
+    pthread_mutex_init(&lock, NULL);
+    uv_async_init(uv_default_loop(), &async, on_async);
+    async.data = this;
+}
+
+ScanEmitter::~ScanEmitter()
+{
+    pthread_mutex_destroy(&lock);
+    delete callback;
+}
+
+void
+ScanEmitter::scan_done(const unsigned char *data, size_t len, int scan)
+{
+    pthread_mutex_lock(&lock);
+    queue.push_back(Chunk());
+    queue.back().data.assign(data, data + len);
+    queue.back().scan = scan;
+    pthread_mutex_unlock(&lock);
+
+    // sends that happen before the main thread wakes up are coalesced,
+    // flush takes everything that's queued
+    uv_async_send(&async);
+}
+
+void
+ScanEmitter::flush()
+{
+    NanScope();
+
+    std::deque<Chunk> chunks;
+    pthread_mutex_lock(&lock);
+    chunks.swap(queue);
+    pthread_mutex_unlock(&lock);
+
+    for (size_t i = 0; i < chunks.size(); i++) {
+        Local<Object> buf = NanNewBufferHandle(chunks[i].data.size());
+        if (!chunks[i].data.empty())
+            memcpy(Buffer::Data(buf), &chunks[i].data[0], chunks[i].data.size());
+        Local<Value> argv[2] = {buf, Integer::New(chunks[i].scan)};
+
+        TryCatch try_catch;
+
+        callback->Call(2, argv);
+
+        if (try_catch.HasCaught()) {
+            FatalException(try_catch);
+        }
+    }
+}
+
+void
+ScanEmitter::close()
+{
+    flush();
+    uv_close((uv_handle_t *)&async, on_close);
+}
+
+#if UV_VERSION_MAJOR == 0
+void
+ScanEmitter::on_async(uv_async_t *handle, int status)
+#else
+void
+ScanEmitter::on_async(uv_async_t *handle)
+#endif
+{
+    ((ScanEmitter *)handle->data)->flush();
+}
+
+void
+ScanEmitter::on_close(uv_handle_t *handle)
+{
+    delete (ScanEmitter *)handle->data;
+}
+
+void
+JpegEncoder::EncodeWorker::finish_scans()
+{
+    if (scans) scans->close();
+    scans = NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef SCAN_EMITTER_H
+#define SCAN_EMITTER_H
+
+#include <node.h>
+#include <uv.h>
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+#include "common.h"
+#include "jpeg_encoder.h"
+
+// Hands the scans of a progressive JPEG, which JpegScanListener gets on the
+// encoding thread, to an onScan(chunk, scan) callback on the main thread
+// through a uv_async_t. The emitter is closed (and deleted once libuv is
+// done with the handle) by the worker, after calling back with whatever
+// is still queued.
+class ScanEmitter : public JpegScanListener {
+    struct Chunk {
+        std::vector<unsigned char> data;
+        int scan;
+    };
+
+    uv_async_t async;
+    pthread_mutex_t lock;
+    std::deque<Chunk> queue;
+    NanCallback *callback;
+
+    ~ScanEmitter();
+
+#if UV_VERSION_MAJOR == 0
+    static void on_async(uv_async_t *handle, int status);
+#else
+    static void on_async(uv_async_t *handle);
+#endif
+    static void on_close(uv_handle_t *handle);
+
+public:
+    ScanEmitter(NanCallback *ccallback);
+
+    void scan_done(const unsigned char *data, size_t len, int scan);
+    void flush();
+    void close();
+};
+
+#endif
+
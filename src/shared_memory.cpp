@@ -0,0 +1,126 @@
+#include <node.h>
+
+#include "shared_memory.h"
+
+using namespace v8;
+using namespace node;
+
+// Tags SharedMemory objects, like Background's.
+static Local<String>
+tag()
+{
+    return String::NewSymbol("node-jpeg:SharedMemory");
+}
+
+void
+SharedMemory::Initialize(v8::Handle<v8::Object> target)
+{
+    NanScope();
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    NODE_SET_PROTOTYPE_METHOD(t, "generation", Generation);
+    NODE_SET_PROTOTYPE_METHOD(t, "dispose", Dispose);
+    target->Set(String::NewSymbol("SharedMemory"), t->GetFunction());
+}
+
+SharedMemory::SharedMemory(SharedRegion *rregion) : region(rregion) {}
+
+SharedMemory::~SharedMemory()
+{
+    if (region) region->unref();
+}
+
+const SharedRegion *
+SharedMemory::get_region() const
+{
+    return region;
+}
+
+void
+SharedMemory::Dispose()
+{
+    if (region) region->unref();
+    region = NULL;
+}
+
+SharedMemory *
+SharedMemory::FromValue(v8::Handle<v8::Value> val)
+{
+    if (!val->IsObject()) return NULL;
+    Local<Value> ext = val->ToObject()->GetHiddenValue(tag());
+    if (ext.IsEmpty() || !ext->IsExternal()) return NULL;
+    return (SharedMemory *)Local<External>::Cast(ext)->Value();
+}
+
+NAN_METHOD(SharedMemory::New)
+{
+    NanScope();
+
+    if (args.Length() < 1)
+        return NanThrowError("At least one argument required - shared memory name or fd, [and options]");
+    if (!args[0]->IsString() && !(args[0]->IsInt32() && args[0]->Int32Value() >= 0))
+        return NanThrowTypeError("First argument must be a shared memory name or a file descriptor.");
+
+    size_t size = 0;
+    bool seqlock = false;
+    size_t seq_offset = 0;
+    if (args.Length() >= 2 && !args[1]->IsUndefined()) {
+        if (!args[1]->IsObject())
+            return NanThrowTypeError("Options must be an object.");
+        Local<Object> opts = args[1]->ToObject();
+        Local<Value> v = opts->Get(String::NewSymbol("size"));
+        if (!v->IsUndefined()) {
+            if (!v->IsNumber() || v->IntegerValue() < 0)
+                return NanThrowTypeError("Size must be a non-negative integer.");
+            size = (size_t)v->IntegerValue();
+        }
+        v = opts->Get(String::NewSymbol("seqlock"));
+        if (!v->IsUndefined()) {
+            if (!v->IsNumber() || v->IntegerValue() < 0)
+                return NanThrowTypeError("Seqlock must be a non-negative byte offset.");
+            seqlock = true;
+            seq_offset = (size_t)v->IntegerValue();
+        }
+    }
+
+    SharedRegion *region = new SharedRegion;
+    try {
+        if (args[0]->IsString()) {
+            String::Utf8Value name(args[0]);
+            region->open(*name, size);
+        }
+        else {
+            region->open(args[0]->Int32Value(), size);
+        }
+        if (seqlock) region->set_seqlock(seq_offset);
+    }
+    catch (const char *err) {
+        region->unref();
+        return NanThrowError(err);
+    }
+
+    SharedMemory *shm = new SharedMemory(region);
+    shm->Wrap(args.This());
+    args.This()->SetHiddenValue(tag(), External::New(shm));
+    NanReturnValue(args.This());
+}
+
+NAN_METHOD(SharedMemory::Generation)
+{
+    NanScope();
+
+    SharedMemory *shm = ObjectWrap::Unwrap<SharedMemory>(args.This());
+    if (!shm->region)
+        return NanThrowError("SharedMemory has been disposed.");
+    NanReturnValue(Number::New(shm->region->generation()));
+}
+
+NAN_METHOD(SharedMemory::Dispose)
+{
+    NanScope();
+
+    SharedMemory *shm = ObjectWrap::Unwrap<SharedMemory>(args.This());
+    shm->Dispose();
+    NanReturnUndefined();
+}
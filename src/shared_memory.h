@@ -0,0 +1,32 @@
+#ifndef SHARED_MEMORY_H
+#define SHARED_MEMORY_H
+
+#include <node.h>
+
+#include "common.h"
+#include "shared_region.h"
+
+// new SharedMemory(name | fd, [{ size, seqlock }]): a frame source that Jpeg
+// and the stacks' push read from directly. Objects that use it keep the
+// mapping alive, even after dispose().
+class SharedMemory : public node::ObjectWrap {
+    SharedRegion *region; // one reference is ours, NULL once disposed
+
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+    SharedMemory(SharedRegion *rregion);
+    ~SharedMemory();
+
+    const SharedRegion *get_region() const;
+    void Dispose();
+
+    // The SharedMemory wrapped by val, or NULL if it isn't one.
+    static SharedMemory *FromValue(v8::Handle<v8::Value> val);
+
+    static NAN_METHOD(New);
+    static NAN_METHOD(Generation);
+    static NAN_METHOD(Dispose);
+};
+
+#endif
+
@@ -0,0 +1,144 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <cstring>
+
+#include "shared_region.h"
+
+SharedRegion::SharedRegion() :
+    map(NULL), length(0), seq_offset(0), seqlock(false), refs(1) {}
+
+SharedRegion::~SharedRegion()
+{
+    if (map) munmap(map, length);
+}
+
+void
+SharedRegion::map_fd(int fd, size_t llength)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        throw "fstat failed in SharedRegion::open.";
+    if (!llength) llength = st.st_size;
+    if (!llength)
+        throw "Shared memory is empty.";
+    if ((size_t)st.st_size < llength)
+        throw "Shared memory is smaller than the given size.";
+
+    void *m = mmap(NULL, llength, PROT_READ, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) throw "mmap failed in SharedRegion::open.";
+
+    if (map) munmap(map, length);
+    map = m;
+    length = llength;
+}
+
+void
+SharedRegion::open(const char *name, size_t llength)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) throw "shm_open failed in SharedRegion::open.";
+    try {
+        map_fd(fd, llength);
+    }
+    catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+void
+SharedRegion::open(int fd, size_t llength)
+{
+    map_fd(fd, llength);
+}
+
+void
+SharedRegion::set_seqlock(size_t offset)
+{
+    if (offset%4)
+        throw "Seqlock offset must be a multiple of 4.";
+    if (offset + 4 > length)
+        throw "Seqlock offset is outside the shared memory.";
+    seq_offset = offset;
+    seqlock = true;
+}
+
+const unsigned char *
+SharedRegion::data() const
+{
+    return (const unsigned char *)map;
+}
+
+size_t
+SharedRegion::size() const
+{
+    return length;
+}
+
+bool
+SharedRegion::has_seqlock() const
+{
+    return seqlock;
+}
+
+uint32_t
+SharedRegion::generation() const
+{
+    if (!seqlock) return 0;
+    // the mapping is read-only, so this can't be an atomic read-modify-write
+    uint32_t gen = *(volatile const uint32_t *)((const unsigned char *)map + seq_offset);
+    __sync_synchronize();
+    return gen;
+}
+
+uint32_t
+SharedRegion::begin_read() const
+{
+    if (!seqlock) return 0;
+
+    // writing a frame takes a memcpy, give the writer up to about 100ms
+    struct timespec pause = { 0, 100000 };
+    for (int i = 0; i < 1000; i++) {
+        uint32_t gen = generation();
+        if (!(gen & 1)) return gen;
+        nanosleep(&pause, NULL);
+    }
+    throw "Timed out waiting for the shared frame's writer.";
+}
+
+bool
+SharedRegion::end_read(uint32_t gen) const
+{
+    if (!seqlock) return true;
+    __sync_synchronize();
+    return generation() == gen;
+}
+
+void
+SharedRegion::snapshot(size_t start, size_t span, std::vector<unsigned char> &out) const
+{
+    out.resize(span);
+    for (int i = 0; i < MAX_READS; i++) {
+        uint32_t gen = begin_read();
+        if (span) memcpy(&out[0], data() + start, span);
+        if (end_read(gen)) return;
+    }
+    throw "Shared frame kept changing while it was read.";
+}
+
+void
+SharedRegion::ref() const
+{
+    __sync_add_and_fetch(&refs, 1);
+}
+
+void
+SharedRegion::unref() const
+{
+    if (__sync_sub_and_fetch(&refs, 1) == 0)
+        delete this;
+}
@@ -0,0 +1,57 @@
+#ifndef SHARED_REGION_H
+#define SHARED_REGION_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <vector>
+
+// Read-only mapping of a POSIX shared memory object or memfd that another
+// process (a capture daemon) writes frames into, so they can be encoded and
+// pushed without copying them into a Buffer first.
+//
+// With a seqlock, the writer increments the 32-bit counter at seq_offset
+// before it starts writing a frame (making it odd) and again when it's done
+// (making it even). Readers take the counter before and after reading and
+// read again if it changed. Without one, frames are read as they are.
+class SharedRegion {
+    void *map;
+    size_t length;
+    size_t seq_offset;
+    bool seqlock;
+    mutable int refs;
+
+    void map_fd(int fd, size_t llength);
+
+public:
+    // Reads of a frame that keeps changing give up after this many tries.
+    static const int MAX_READS = 8;
+
+    SharedRegion();
+    ~SharedRegion();
+
+    // shm_open()s name, length 0 maps the whole object.
+    void open(const char *name, size_t llength);
+    // Maps an fd (memfd, /dev/shm file) that stays owned by the caller.
+    void open(int fd, size_t llength);
+    void set_seqlock(size_t offset);
+
+    const unsigned char *data() const;
+    size_t size() const;
+    bool has_seqlock() const;
+    uint32_t generation() const;
+
+    // Waits until no frame is being written and returns the counter to
+    // pass to end_read, which is true if the frame didn't change since.
+    uint32_t begin_read() const;
+    bool end_read(uint32_t gen) const;
+
+    // Copies span bytes from start out of one complete frame.
+    void snapshot(size_t start, size_t span, std::vector<unsigned char> &out) const;
+
+    // Starts with one reference for whoever created it, see TiledCanvas.
+    void ref() const;
+    void unref() const;
+};
+
+#endif
+
@@ -0,0 +1,47 @@
+#include <node.h>
+
+#include "stats.h"
+#include "js_args.h"
+
+using namespace v8;
+using namespace node;
+
+void
+Stats::Initialize(v8::Handle<v8::Object> target)
+{
+    NanScope();
+
+    NODE_SET_METHOD(target, "enableStats", EnableStats);
+    NODE_SET_METHOD(target, "getStats", GetStats);
+    NODE_SET_METHOD(target, "resetStats", ResetStats);
+}
+
+NAN_METHOD(Stats::EnableStats)
+{
+    NanScope();
+
+    if (args.Length() != 1)
+        return NanThrowError("One argument required - true or false.");
+    if (!args[0]->IsBoolean())
+        return NanThrowTypeError("First argument must be a boolean.");
+
+    enable_stats(args[0]->BooleanValue());
+    NanReturnUndefined();
+}
+
+NAN_METHOD(Stats::GetStats)
+{
+    NanScope();
+
+    Local<Object> obj = stats_object(global_stats());
+    obj->Set(String::NewSymbol("enabled"), Boolean::New(stats_enabled()));
+    NanReturnValue(obj);
+}
+
+NAN_METHOD(Stats::ResetStats)
+{
+    NanScope();
+
+    reset_global_stats();
+    NanReturnUndefined();
+}
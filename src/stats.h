@@ -0,0 +1,21 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <node.h>
+
+#include "common.h"
+#include "encode_stats.h"
+
+// Module level enableStats(on), getStats() and resetStats(): process-wide
+// encode timings. Each encoder object also has its own getStats().
+class Stats {
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+
+    static NAN_METHOD(EnableStats);
+    static NAN_METHOD(GetStats);
+    static NAN_METHOD(ResetStats);
+};
+
+#endif
+
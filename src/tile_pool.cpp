@@ -0,0 +1,146 @@
+#include <cstdlib>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "tile_pool.h"
+#include "tiled_canvas.h"
+
+static const size_t SLAB_SIZE = 2*1024*1024;
+static const size_t TILE_BYTES = TiledCanvas::TILE_SIZE*TiledCanvas::TILE_SIZE*3;
+static const size_t HEADER_SIZE = 64; // keeps the tiles after it 64 byte aligned
+static const int TILES_PER_SLAB = (SLAB_SIZE - HEADER_SIZE)/TILE_BYTES;
+
+// Lives at the start of its slab, so a tile finds its slab by masking its
+// address.
+struct Slab {
+    Slab *prev, *next; // in the list of slabs with free tiles
+    uint64_t free_mask; // bit i set when tile i is free
+    int used;
+};
+
+static Slab *with_free = NULL;
+static size_t slabs = 0, idle_slabs = 0, used_tiles = 0;
+static size_t idle_limit = 16; // slabs
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned char *
+tile_at(Slab *slab, int i)
+{
+    return (unsigned char *)slab + HEADER_SIZE + i*TILE_BYTES;
+}
+
+static void
+link(Slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = with_free;
+    if (with_free) with_free->prev = slab;
+    with_free = slab;
+}
+
+static void
+unlink(Slab *slab)
+{
+    if (slab->prev) slab->prev->next = slab->next;
+    else with_free = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+}
+
+static Slab *
+new_slab()
+{
+    void *mem;
+    if (posix_memalign(&mem, SLAB_SIZE, SLAB_SIZE) != 0)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise(mem, SLAB_SIZE, MADV_HUGEPAGE);
+#endif
+    Slab *slab = (Slab *)mem;
+    slab->free_mask = TILES_PER_SLAB == 64 ? ~(uint64_t)0 : ((uint64_t)1 << TILES_PER_SLAB) - 1;
+    slab->used = 0;
+    link(slab);
+    slabs++;
+    idle_slabs++;
+    return slab;
+}
+
+unsigned char *
+alloc_tile()
+{
+    pthread_mutex_lock(&lock);
+    Slab *slab = with_free ? with_free : new_slab();
+    if (!slab) {
+        pthread_mutex_unlock(&lock);
+        throw "malloc failed in alloc_tile";
+    }
+
+    int i = __builtin_ctzll(slab->free_mask);
+    slab->free_mask &= ~((uint64_t)1 << i);
+    if (!slab->used++) idle_slabs--;
+    if (!slab->free_mask) unlink(slab);
+    used_tiles++;
+
+    pthread_mutex_unlock(&lock);
+    return tile_at(slab, i);
+}
+
+void
+free_tile(unsigned char *tile)
+{
+    if (!tile) return;
+
+    Slab *slab = (Slab *)((uintptr_t)tile & ~(uintptr_t)(SLAB_SIZE - 1));
+    int i = (tile - tile_at(slab, 0))/TILE_BYTES;
+
+    pthread_mutex_lock(&lock);
+    if (!slab->free_mask) link(slab);
+    slab->free_mask |= (uint64_t)1 << i;
+    used_tiles--;
+    if (!--slab->used) {
+        if (idle_slabs < idle_limit) {
+            idle_slabs++;
+        }
+        else {
+            unlink(slab);
+            slabs--;
+            free(slab);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+TilePoolStats
+tile_pool_stats()
+{
+    TilePoolStats stats;
+    pthread_mutex_lock(&lock);
+    stats.slabs = slabs;
+    stats.idle_slabs = idle_slabs;
+    stats.used_tiles = used_tiles;
+    stats.free_tiles = slabs*TILES_PER_SLAB - used_tiles;
+    stats.bytes = slabs*SLAB_SIZE;
+    pthread_mutex_unlock(&lock);
+    return stats;
+}
+
+void
+set_tile_pool_limit(size_t bytes)
+{
+    pthread_mutex_lock(&lock);
+    idle_limit = bytes/SLAB_SIZE;
+
+    // let go of idle slabs over the new limit
+    Slab *slab = with_free;
+    while (slab && idle_slabs > idle_limit) {
+        Slab *next = slab->next;
+        if (!slab->used) {
+            unlink(slab);
+            free(slab);
+            slabs--;
+            idle_slabs--;
+        }
+        slab = next;
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,33 @@
+#ifndef TILE_POOL_H
+#define TILE_POOL_H
+
+#include <cstddef>
+
+// Allocator for TiledCanvas tiles. Tiles are cut from 2MB slabs that are
+// 2MB aligned and marked for transparent huge pages, so a canvas costs a
+// few page faults instead of one per 4kB. Tiles (and so their rows, which
+// are 6 cache lines long) are 64 byte aligned.
+//
+// Slabs whose tiles have all been freed are kept, up to a limit, so that
+// stacks that are created and dropped over and over reuse warm memory
+// instead of faulting in fresh pages. Safe to use from any thread.
+
+unsigned char *alloc_tile();
+void free_tile(unsigned char *tile);
+
+struct TilePoolStats {
+    size_t slabs;      // slabs allocated, in use or not
+    size_t idle_slabs; // slabs without any tiles in use
+    size_t used_tiles;
+    size_t free_tiles; // in slabs, ready to be handed out
+    size_t bytes;      // held by all slabs
+};
+
+TilePoolStats tile_pool_stats();
+
+// How many bytes of idle slabs to keep around (default 32MB). 0 returns
+// every slab to the system as soon as its last tile is freed.
+void set_tile_pool_limit(size_t bytes);
+
+#endif
+
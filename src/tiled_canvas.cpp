@@ -0,0 +1,267 @@
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+#include "tiled_canvas.h"
+#include "tile_pool.h"
+
+TiledCanvas::TiledCanvas(int wwidth, int hheight,
+    unsigned char r, unsigned char g, unsigned char b) :
+    width(wwidth), height(hheight),
+    tiles_x(((size_t)wwidth + TILE_SIZE - 1)/TILE_SIZE),
+    tiles_y(((size_t)hheight + TILE_SIZE - 1)/TILE_SIZE),
+    fill_row(TILE_SIZE*3),
+    tiles(NULL), tile_count(0), base(NULL), refs(1)
+{
+    alloc_tiles();
+    for (int i = 0; i < TILE_SIZE*3; i += 3) {
+        fill_row[i] = r;
+        fill_row[i+1] = g;
+        fill_row[i+2] = b;
+    }
+}
+
+TiledCanvas::TiledCanvas(const TiledCanvas *bbase) :
+    width(bbase->width), height(bbase->height),
+    tiles_x(bbase->tiles_x), tiles_y(bbase->tiles_y),
+    fill_row(bbase->fill_row),
+    tiles(NULL), tile_count(0), base(bbase), refs(1)
+{
+    alloc_tiles();
+    base->ref();
+}
+
+TiledCanvas::~TiledCanvas()
+{
+    for (size_t i = 0; i < (size_t)tiles_x*tiles_y; i++)
+        free_tile(tiles[i]);
+    free(tiles);
+    if (base) base->unref();
+}
+
+// The tile table is counted in size_t and malloced, so a canvas too large
+// for memory is an error for JavaScript rather than an uncaught
+// std::bad_alloc, and tile indices always fit an int.
+void
+TiledCanvas::alloc_tiles()
+{
+    size_t count = (size_t)tiles_x*tiles_y;
+    if (count > (size_t)INT_MAX/sizeof(tiles[0]))
+        throw "Canvas is too large.";
+    if (!count) return;
+    tiles = (unsigned char **)calloc(count, sizeof(tiles[0]));
+    if (!tiles) throw "malloc failed in TiledCanvas::alloc_tiles";
+}
+
+void
+TiledCanvas::ref() const
+{
+    __sync_add_and_fetch(&refs, 1);
+}
+
+void
+TiledCanvas::unref() const
+{
+    if (__sync_sub_and_fetch(&refs, 1) == 0)
+        delete this;
+}
+
+int
+TiledCanvas::get_width() const
+{
+    return width;
+}
+
+int
+TiledCanvas::get_height() const
+{
+    return height;
+}
+
+int
+TiledCanvas::allocated_tiles() const
+{
+    return tile_count;
+}
+
+bool
+TiledCanvas::has_base() const
+{
+    return base != NULL;
+}
+
+size_t
+TiledCanvas::allocated_bytes() const
+{
+    return (size_t)tile_count*TILE_SIZE*TILE_SIZE*3 +
+        (size_t)tiles_x*tiles_y*sizeof(tiles[0]) + fill_row.size();
+}
+
+// The tile's pixels, or NULL if it's all fill colour.
+const unsigned char *
+TiledCanvas::tile_at(int tx, int ty) const
+{
+    const unsigned char *tile = tiles[ty*tiles_x + tx];
+    if (!tile && base) return base->tile_at(tx, ty);
+    return tile;
+}
+
+unsigned char *
+TiledCanvas::materialize_tile(int tx, int ty)
+{
+    unsigned char *&tile = tiles[ty*tiles_x + tx];
+    if (tile) return tile;
+
+    const unsigned char *shared = base ? base->tile_at(tx, ty) : NULL;
+    tile = alloc_tile();
+    tile_count++;
+
+    if (shared) {
+        memcpy(tile, shared, TILE_SIZE*TILE_SIZE*3);
+        return tile;
+    }
+    for (int i = 0; i < TILE_SIZE; i++)
+        memcpy(tile + i*TILE_SIZE*3, &fill_row[0], TILE_SIZE*3);
+    return tile;
+}
+
+void
+TiledCanvas::write_row(int x, int y, int w, const unsigned char *src, buffer_type buf_type,
+    blend_mode blend)
+{
+    int bpp = bytes_per_pixel(buf_type);
+    int ty = y/TILE_SIZE;
+
+    for (int xx = x; xx < x + w; ) {
+        int tx = xx/TILE_SIZE;
+        int tile_x = xx%TILE_SIZE;
+        int n = TILE_SIZE - tile_x;
+        if (n > x + w - xx) n = x + w - xx;
+
+        unsigned char *tile = materialize_tile(tx, ty);
+        unsigned char *dst = tile + ((y%TILE_SIZE)*TILE_SIZE + tile_x)*3;
+        if (blend == BLEND_NONE)
+            row_to_rgb(src, dst, n, buf_type);
+        else
+            blend_row(src, dst, n, buf_type, blend);
+
+        src += n*bpp;
+        xx += n;
+    }
+}
+
+void
+TiledCanvas::push(const unsigned char *data_buf, buffer_type buf_type,
+    int x, int y, int w, int h, size_t stride, blend_mode blend)
+{
+    if (is_planar(buf_type)) {
+        // the canvas is RGB, so planar YUV has to be converted row by row
+        YuvPlanes planes(data_buf, w, h, buf_type, stride);
+        std::vector<unsigned char> rgb((size_t)w*3);
+        for (int i = 0; i < h; i++) {
+            yuv_row_to_rgb(planes, 0, i, w, &rgb[0]);
+            write_row(x, y + i, w, &rgb[0], BUF_RGB);
+        }
+        return;
+    }
+
+    if (!stride) stride = (size_t)w*bytes_per_pixel(buf_type);
+    for (int i = 0; i < h; i++)
+        write_row(x, y + i, w, data_buf + (size_t)i*stride, buf_type, blend);
+}
+
+// Resamples the w x h fragment to scale.width x scale.height while writing
+// it at (x, y), one output row at a time.
+void
+TiledCanvas::push_scaled(const unsigned char *data_buf, buffer_type buf_type,
+    int x, int y, int w, int h, size_t stride, const ScaleOptions &scale,
+    blend_mode blend)
+{
+    // straight alpha has to be premultiplied before filtering, or colour
+    // from transparent pixels bleeds into the edges
+    bool premultiply = blend == BLEND_OVER;
+    Resampler resampler(data_buf, buf_type, w, h, stride,
+        scale.width, scale.height, scale.filter, premultiply);
+
+    if (premultiply) blend = BLEND_PREMULTIPLIED;
+    for (int i = 0; i < scale.height; i++)
+        write_row(x, y + i, scale.width, resampler.get_row(i), resampler.out_type(), blend);
+}
+
+// Moves a w x h block from (src_x, src_y) to (dst_x, dst_y). Rows are
+// walked away from the overlap (bottom-up when moving down) and each one
+// goes through a scratch row, so the areas may overlap like with memmove.
+void
+TiledCanvas::copy_rect(int src_x, int src_y, int w, int h, int dst_x, int dst_y)
+{
+    if (w <= 0 || h <= 0) return;
+
+    std::vector<unsigned char> row((size_t)w*3);
+    bool down = dst_y > src_y;
+    for (int i = 0; i < h; i++) {
+        int r = down ? h - 1 - i : i;
+        // fill colour onto untouched tiles changes nothing
+        if (row_is_blank(src_x, src_y + r, w) && row_is_blank(dst_x, dst_y + r, w))
+            continue;
+        read_row(src_x, src_y + r, w, &row[0]);
+        write_row(dst_x, dst_y + r, w, &row[0], BUF_RGB);
+    }
+}
+
+void
+TiledCanvas::read_row(int x, int y, int w, unsigned char *rgb) const
+{
+    int ty = y/TILE_SIZE;
+
+    for (int xx = x; xx < x + w; ) {
+        int tx = xx/TILE_SIZE;
+        int tile_x = xx%TILE_SIZE;
+        int n = TILE_SIZE - tile_x;
+        if (n > x + w - xx) n = x + w - xx;
+
+        const unsigned char *tile = tile_at(tx, ty);
+        if (tile) {
+            memcpy(rgb, tile + ((y%TILE_SIZE)*TILE_SIZE + tile_x)*3, n*3);
+        }
+        else {
+            memcpy(rgb, &fill_row[0], n*3);
+        }
+
+        rgb += n*3;
+        xx += n;
+    }
+}
+
+bool
+TiledCanvas::row_is_blank(int x, int y, int w) const
+{
+    int ty = y/TILE_SIZE;
+    for (int tx = x/TILE_SIZE; tx <= (x + w - 1)/TILE_SIZE; tx++)
+        if (tile_at(tx, ty)) return false;
+    return true;
+}
+
+void
+TiledCanvas::fill_pixels(unsigned char *rgb, int w) const
+{
+    for (; w > TILE_SIZE; w -= TILE_SIZE, rgb += TILE_SIZE*3)
+        memcpy(rgb, &fill_row[0], TILE_SIZE*3);
+    memcpy(rgb, &fill_row[0], w*3);
+}
+
+const unsigned char *
+CanvasRowSource::get_row(int x, int y, int w)
+{
+    // rows that only cross untouched tiles are all fill colour
+    if (canvas.row_is_blank(x, y, w)) {
+        if (blank_row.size() != (size_t)w*3) {
+            blank_row.resize((size_t)w*3);
+            canvas.fill_pixels(&blank_row[0], w);
+        }
+        return &blank_row[0];
+    }
+
+    row.resize((size_t)w*3);
+    canvas.read_row(x, y, w, &row[0]);
+    return &row[0];
+}
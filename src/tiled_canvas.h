@@ -0,0 +1,83 @@
+#ifndef TILED_CANVAS_H
+#define TILED_CANVAS_H
+
+#include <vector>
+
+#include "common.h"
+#include "blend.h"
+#include "resample.h"
+#include "jpeg_encoder.h"
+
+// RGB canvas split into TILE_SIZE x TILE_SIZE tiles that are only allocated
+// when something gets pushed onto them. Untouched tiles read back as the
+// fill colour, so a huge virtual canvas costs memory proportional to the
+// area that was actually pushed.
+//
+// A canvas can also be layered over a shared base canvas. Untouched tiles
+// then read from the base and are copied the first time they're written,
+// so many canvases can share one background.
+class TiledCanvas {
+    int width, height;
+    int tiles_x, tiles_y;
+    std::vector<unsigned char> fill_row; // TILE_SIZE pixels of fill colour
+
+    unsigned char **tiles; // tiles_x*tiles_y, NULL until pushed to
+    int tile_count; // tiles that aren't NULL
+
+    const TiledCanvas *base; // read through for untouched tiles, or NULL
+    mutable int refs; // owners of a shared canvas, see ref()
+
+    const unsigned char *tile_at(int tx, int ty) const;
+    unsigned char *materialize_tile(int tx, int ty);
+    void alloc_tiles();
+
+    TiledCanvas(const TiledCanvas &);
+    TiledCanvas &operator=(const TiledCanvas &);
+
+public:
+    static const int TILE_SIZE = 128;
+
+    TiledCanvas(int wwidth, int hheight,
+        unsigned char r = 0, unsigned char g = 0, unsigned char b = 0);
+    // Same size and fill colour as bbase, which must not change anymore.
+    TiledCanvas(const TiledCanvas *bbase);
+    ~TiledCanvas();
+
+    // A canvas that is shared as a base starts with one reference for
+    // whoever created it and is deleted when the last one is dropped. The
+    // count is atomic, the tiles are only read once shared.
+    void ref() const;
+    void unref() const;
+
+    int get_width() const;
+    int get_height() const;
+    int allocated_tiles() const;
+    bool has_base() const;
+    size_t allocated_bytes() const;
+
+    void write_row(int x, int y, int w, const unsigned char *src, buffer_type buf_type,
+        blend_mode blend = BLEND_NONE);
+    void push(const unsigned char *data_buf, buffer_type buf_type,
+        int x, int y, int w, int h, size_t stride = 0, blend_mode blend = BLEND_NONE);
+    void push_scaled(const unsigned char *data_buf, buffer_type buf_type,
+        int x, int y, int w, int h, size_t stride, const ScaleOptions &scale,
+        blend_mode blend = BLEND_NONE);
+    void copy_rect(int src_x, int src_y, int w, int h, int dst_x, int dst_y);
+    void read_row(int x, int y, int w, unsigned char *rgb) const;
+    bool row_is_blank(int x, int y, int w) const;
+    void fill_pixels(unsigned char *rgb, int w) const;
+};
+
+// Streams rows of a TiledCanvas into JpegEncoder, one scanline at a time.
+class CanvasRowSource : public JpegRowSource {
+    const TiledCanvas &canvas;
+    std::vector<unsigned char> row;
+    std::vector<unsigned char> blank_row; // filled once, reused for untouched rows
+
+public:
+    CanvasRowSource(const TiledCanvas &ccanvas) : canvas(ccanvas) {}
+    const unsigned char *get_row(int x, int y, int w);
+};
+
+#endif
+
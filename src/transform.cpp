@@ -0,0 +1,124 @@
+#include <node.h>
+#include <node_buffer.h>
+#include <cstdlib>
+#include <cstring>
+
+#include "common.h"
+#include "transform.h"
+#include "js_args.h"
+
+using namespace v8;
+using namespace node;
+
+void
+Transform::Initialize(v8::Handle<v8::Object> target)
+{
+    NanScope();
+
+    NODE_SET_METHOD(target, "transform", TransformAsync);
+    NODE_SET_METHOD(target, "transformSync", TransformSync);
+}
+
+static Local<Object>
+transform_dimensions(const JpegTransformer &transformer)
+{
+    Local<Object> dim = Object::New();
+    dim->Set(String::NewSymbol("width"), Integer::New(transformer.get_width()));
+    dim->Set(String::NewSymbol("height"), Integer::New(transformer.get_height()));
+    return dim;
+}
+
+NAN_METHOD(Transform::TransformSync)
+{
+    NanScope();
+
+    if (args.Length() != 2)
+        return NanThrowError("Two arguments required - jpeg buffer and options.");
+    unsigned char *jpeg_data;
+    size_t jpeg_len;
+    if (!get_bytes(args[0], jpeg_data, jpeg_len))
+        return NanThrowTypeError("First argument must be a Buffer, typed array or ArrayBuffer with a JPEG.");
+
+    TransformOptions opts;
+    const char *err = parse_transform_options(args[1], opts);
+    if (err) return NanThrowTypeError(err);
+
+    JpegTransformer transformer(jpeg_data, jpeg_len, opts);
+
+    try {
+        transformer.transform();
+    }
+    catch (const char *err) {
+        return NanThrowError(err);
+    }
+
+    Local<Object> retbuf = NanNewBufferHandle(transformer.get_jpeg_len());
+    memcpy(Buffer::Data(retbuf), transformer.get_jpeg(), transformer.get_jpeg_len());
+    NanReturnValue(retbuf);
+}
+
+void Transform::TransformWorker::Execute() {
+    try {
+        transformer.transform();
+    } catch (const char *err) {
+        errmsg = strdup(err);
+    }
+}
+
+void Transform::TransformWorker::HandleOKCallback() {
+    NanScope();
+
+    Local<Object> buf = NanNewBufferHandle(transformer.get_jpeg_len());
+    memcpy(Buffer::Data(buf), transformer.get_jpeg(), transformer.get_jpeg_len());
+    Local<Value> argv[3] = {buf, transform_dimensions(transformer), Undefined()};
+
+    TryCatch try_catch;
+
+    callback->Call(3, argv);
+
+    if (try_catch.HasCaught()) {
+        FatalException(try_catch);
+    }
+}
+
+void Transform::TransformWorker::HandleErrorCallback() {
+    NanScope();
+    Local<Value> argv[3] = {Undefined(), Undefined(), v8::Exception::Error(v8::String::New(errmsg))};
+
+    TryCatch try_catch;
+
+    callback->Call(3, argv);
+
+    if (try_catch.HasCaught()) {
+        FatalException(try_catch);
+    }
+}
+
+NAN_METHOD(Transform::TransformAsync)
+{
+    NanScope();
+
+    if (args.Length() != 3)
+        return NanThrowError("Three arguments required - jpeg buffer, options and callback function.");
+    unsigned char *jpeg_data;
+    size_t jpeg_len;
+    if (!get_bytes(args[0], jpeg_data, jpeg_len))
+        return NanThrowTypeError("First argument must be a Buffer, typed array or ArrayBuffer with a JPEG.");
+    if (!args[2]->IsFunction())
+        return NanThrowTypeError("Third argument must be a function.");
+
+    TransformOptions opts;
+    const char *err = parse_transform_options(args[1], opts);
+    if (err) return NanThrowTypeError(err);
+
+    // the Buffer may change while the transform runs on the thread pool
+    unsigned char *src = (unsigned char *)malloc(jpeg_len ? jpeg_len : 1);
+    if (!src)
+        return NanThrowError("malloc failed in Transform::TransformAsync.");
+    memcpy(src, jpeg_data, jpeg_len);
+
+    Local<Function> callback = Local<Function>::Cast(args[2]);
+    NanAsyncQueueWorker(new TransformWorker(new NanCallback(callback), src, jpeg_len, opts));
+
+    NanReturnUndefined();
+}
@@ -0,0 +1,38 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <node.h>
+#include <node_buffer.h>
+
+#include "jpeg_transform.h"
+
+// Module level transform(jpeg, options, callback) and transformSync(jpeg,
+// options): lossless rotate, flip and crop of an encoded JPEG.
+class Transform {
+    class TransformWorker : public NanAsyncWorker {
+    public:
+        // takes ownership of ssrc, which is a copy of the input Buffer
+        TransformWorker(NanCallback *callback, unsigned char *ssrc, size_t ssrc_len,
+            const TransformOptions &opts) :
+            NanAsyncWorker(callback), src(ssrc), transformer(ssrc, ssrc_len, opts) {
+        };
+        ~TransformWorker() { free(src); }
+
+        void Execute();
+        void HandleOKCallback();
+        void HandleErrorCallback();
+
+    private:
+        unsigned char *src;
+        JpegTransformer transformer;
+    };
+
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+
+    static NAN_METHOD(TransformSync);
+    static NAN_METHOD(TransformAsync);
+};
+
+#endif
+
@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "yuv_canvas.h"
+
+// JFIF RGB -> YCbCr in 16.16 fixed point, like libjpeg's jccolor.c. The
+// results are left unrounded so chroma can be averaged first.
+#define Y_R 19595
+#define Y_G 38470
+#define Y_B 7471
+#define CB_R (-11059)
+#define CB_G (-21709)
+#define CR_G (-27439)
+#define CR_B (-5329)
+#define C_HALF 32768 // 0.5, both for the Cb B and Cr R weights and rounding
+
+static inline unsigned char
+to_sample(int v)
+{
+    v = (v + C_HALF) >> 16;
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+// Rows of a fragment on their way onto a YuvCanvas: converted to RGB from
+// what the buffer or the resampler gives, or composited over what the
+// canvas holds under them.
+class PushRowSource : public JpegRowSource {
+    const YuvCanvas &canvas;
+    int x, y;
+    const unsigned char *data;
+    buffer_type buf_type;
+    size_t stride;
+    Resampler *resampler;
+    blend_mode blend;
+    std::vector<unsigned char> row;
+
+public:
+    PushRowSource(const YuvCanvas &ccanvas, int xx, int yy, int w,
+        const unsigned char *ddata, buffer_type bbuf_type, size_t sstride,
+        Resampler *rresampler, blend_mode bblend) :
+        canvas(ccanvas), x(xx), y(yy), data(ddata), buf_type(bbuf_type),
+        resampler(rresampler), blend(bblend), row((size_t)w*3)
+    {
+        stride = sstride ? sstride : (size_t)w*bytes_per_pixel(buf_type);
+    }
+
+    const unsigned char *get_row(int, int i, int w)
+    {
+        const unsigned char *src = resampler ? resampler->get_row(i) : data + (size_t)i*stride;
+        buffer_type type = resampler ? resampler->out_type() : buf_type;
+        if (blend == BLEND_NONE) {
+            row_to_rgb(src, &row[0], w, type);
+        }
+        else {
+            canvas.read_row(x, y + i, w, &row[0]);
+            blend_row(src, &row[0], w, type, blend);
+        }
+        return &row[0];
+    }
+};
+
+YuvCanvas::YuvCanvas(int wwidth, int hheight, unsigned char r, unsigned char g, unsigned char b) :
+    width(wwidth), height(hheight),
+    chroma_w((wwidth + 1)/2), chroma_h((hheight + 1)/2),
+    pixels(NULL), pixels_len(image_span(wwidth, hheight, BUF_YUV420, 0)),
+    y_plane(NULL), u_plane(NULL), v_plane(NULL)
+{
+    if (!pixels_len) return;
+
+    // malloc rather than a vector, so a canvas too large for memory is an
+    // error for JavaScript instead of an uncaught std::bad_alloc
+    pixels = (unsigned char *)malloc(pixels_len);
+    if (!pixels) throw "malloc failed in YuvCanvas::YuvCanvas";
+
+    YuvPlanes planes(pixels, width, height, BUF_YUV420, 0);
+    y_plane = (unsigned char *)planes.y;
+    u_plane = (unsigned char *)planes.u;
+    v_plane = (unsigned char *)planes.v;
+
+    memset(y_plane, to_sample(Y_R*r + Y_G*g + Y_B*b), (size_t)width*height);
+    memset(u_plane, to_sample(CB_R*r + CB_G*g + C_HALF*b + (128 << 16)), (size_t)chroma_w*chroma_h);
+    memset(v_plane, to_sample(C_HALF*r + CR_G*g + CR_B*b + (128 << 16)), (size_t)chroma_w*chroma_h);
+}
+
+YuvCanvas::~YuvCanvas()
+{
+    free(pixels);
+}
+
+int
+YuvCanvas::get_width() const
+{
+    return width;
+}
+
+int
+YuvCanvas::get_height() const
+{
+    return height;
+}
+
+size_t
+YuvCanvas::allocated_bytes() const
+{
+    return pixels_len;
+}
+
+const unsigned char *
+YuvCanvas::data() const
+{
+    return pixels;
+}
+
+// Writes the w x h RGB rows at (x, y), one pair of rows (one row of chroma
+// samples) at a time. Luma is written as it comes, the Cb and Cr of each
+// sample are summed over the pixels the rows cover and merged with the old
+// sample once the pair is done.
+void
+YuvCanvas::write_rows(int x, int y, int w, int h, JpegRowSource &rows)
+{
+    if (w <= 0 || h <= 0) return;
+
+    int cx0 = x/2;
+    int samples = (x + w - 1)/2 - cx0 + 1;
+    sum_cb.resize(samples);
+    sum_cr.resize(samples);
+    covered.resize(samples);
+
+    for (int cy = y/2; cy <= (y + h - 1)/2; cy++) {
+        std::fill(sum_cb.begin(), sum_cb.end(), 0);
+        std::fill(sum_cr.begin(), sum_cr.end(), 0);
+        std::fill(covered.begin(), covered.end(), 0);
+
+        for (int r = 2*cy; r < 2*cy + 2 && r < height; r++) {
+            if (r < y || r >= y + h) continue;
+
+            const unsigned char *rgb = rows.get_row(0, r - y, w);
+            unsigned char *yrow = y_plane + (size_t)r*width + x;
+            for (int i = 0; i < w; i++, rgb += 3) {
+                int R = rgb[0], G = rgb[1], B = rgb[2];
+                int c = (x + i)/2 - cx0;
+                yrow[i] = to_sample(Y_R*R + Y_G*G + Y_B*B);
+                sum_cb[c] += CB_R*R + CB_G*G + C_HALF*B;
+                sum_cr[c] += C_HALF*R + CR_G*G + CR_B*B;
+                covered[c]++;
+            }
+        }
+
+        int rows_in_pair = 2*cy + 1 < height ? 2 : 1;
+        for (int c = 0; c < samples; c++) {
+            int cx = cx0 + c;
+            int n = (2*cx + 1 < width ? 2 : 1)*rows_in_pair; // pixels under the sample
+            int old = n - covered[c];
+            size_t i = (size_t)cy*chroma_w + cx;
+            // sums are centred on 0, the old samples on 128
+            int cb = sum_cb[c] + old*((u_plane[i] - 128) << 16);
+            int cr = sum_cr[c] + old*((v_plane[i] - 128) << 16);
+            u_plane[i] = to_sample(cb/n + (128 << 16));
+            v_plane[i] = to_sample(cr/n + (128 << 16));
+        }
+    }
+}
+
+void
+YuvCanvas::push(const unsigned char *data_buf, buffer_type buf_type,
+    int x, int y, int w, int h, size_t stride, blend_mode blend)
+{
+    if (blend == BLEND_NONE) {
+        // converts any buffer type, planar ones included
+        BufferRowSource rows(data_buf, w, h, buf_type, stride);
+        write_rows(x, y, w, h, rows);
+        return;
+    }
+
+    PushRowSource rows(*this, x, y, w, data_buf, buf_type, stride, NULL, blend);
+    write_rows(x, y, w, h, rows);
+}
+
+// Resamples the w x h fragment to scale.width x scale.height on its way in.
+void
+YuvCanvas::push_scaled(const unsigned char *data_buf, buffer_type buf_type,
+    int x, int y, int w, int h, size_t stride, const ScaleOptions &scale,
+    blend_mode blend)
+{
+    // straight alpha has to be premultiplied before filtering, like
+    // TiledCanvas::push_scaled does
+    bool premultiply = blend == BLEND_OVER;
+    Resampler resampler(data_buf, buf_type, w, h, stride,
+        scale.width, scale.height, scale.filter, premultiply);
+
+    if (premultiply) blend = BLEND_PREMULTIPLIED;
+    PushRowSource rows(*this, x, y, scale.width, NULL, resampler.out_type(), 0,
+        &resampler, blend);
+    write_rows(x, y, scale.width, scale.height, rows);
+}
+
+// Moves a w x h block from (src_x, src_y) to (dst_x, dst_y). The block is
+// read out as RGB first, so the areas may overlap.
+void
+YuvCanvas::copy_rect(int src_x, int src_y, int w, int h, int dst_x, int dst_y)
+{
+    if (w <= 0 || h <= 0) return;
+
+    unsigned char *block = (unsigned char *)malloc((size_t)w*h*3);
+    if (!block) throw "malloc failed in YuvCanvas::copy_rect";
+    for (int i = 0; i < h; i++)
+        read_row(src_x, src_y + i, w, block + (size_t)i*w*3);
+
+    BufferRowSource rows(block, w, h, BUF_RGB);
+    write_rows(dst_x, dst_y, w, h, rows);
+    free(block);
+}
+
+void
+YuvCanvas::read_row(int x, int y, int w, unsigned char *rgb) const
+{
+    YuvPlanes planes(pixels, width, height, BUF_YUV420, 0);
+    yuv_row_to_rgb(planes, x, y, w, rgb);
+}
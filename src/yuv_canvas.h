@@ -0,0 +1,56 @@
+#ifndef YUV_CANVAS_H
+#define YUV_CANVAS_H
+
+#include <vector>
+
+#include "common.h"
+#include "blend.h"
+#include "resample.h"
+#include "jpeg_encoder.h"
+
+// Canvas kept as one full range (JFIF) YUV420 image, so encoding hands its
+// planes straight to libjpeg in raw data mode, without any colour
+// conversion or chroma downsampling. Fragments are converted once, when
+// they are pushed.
+//
+// A chroma sample covers 2x2 pixels. Where a fragment covers only some of
+// them, the others are taken to have the sample's old chroma, which is
+// exact on flat areas and close everywhere else. Blending reads the canvas
+// back as RGB under the fragment.
+//
+// Unlike TiledCanvas the whole image is allocated up front, 1.5 bytes per
+// pixel.
+class YuvCanvas {
+    int width, height;
+    int chroma_w, chroma_h;
+    unsigned char *pixels; // Y plane, then U, then V
+    size_t pixels_len;
+    unsigned char *y_plane, *u_plane, *v_plane;
+    std::vector<int> sum_cb, sum_cr, covered; // per chroma sample of a row pair
+
+    void write_rows(int x, int y, int w, int h, JpegRowSource &rows);
+
+    YuvCanvas(const YuvCanvas &);
+    YuvCanvas &operator=(const YuvCanvas &);
+
+public:
+    YuvCanvas(int wwidth, int hheight,
+        unsigned char r = 0, unsigned char g = 0, unsigned char b = 0);
+    ~YuvCanvas();
+
+    int get_width() const;
+    int get_height() const;
+    size_t allocated_bytes() const;
+    const unsigned char *data() const; // BUF_YUV420 layout
+
+    void push(const unsigned char *data_buf, buffer_type buf_type,
+        int x, int y, int w, int h, size_t stride = 0, blend_mode blend = BLEND_NONE);
+    void push_scaled(const unsigned char *data_buf, buffer_type buf_type,
+        int x, int y, int w, int h, size_t stride, const ScaleOptions &scale,
+        blend_mode blend = BLEND_NONE);
+    void copy_rect(int src_x, int src_y, int w, int h, int dst_x, int dst_y);
+    void read_row(int x, int y, int w, unsigned char *rgb) const;
+};
+
+#endif
+
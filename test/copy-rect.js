@@ -0,0 +1,91 @@
+var assert = require('assert');
+var JpegLib = require('../build/Release/jpeg');
+
+var INT_MAX = 0x7fffffff;
+
+function rangeError(fn) {
+    assert.throws(fn, RangeError);
+}
+
+var stack = new JpegLib.FixedJpegStack(64, 48, 'rgb');
+
+// x + w used to wrap past INT_MAX and pass the bounds check
+rangeError(function () { stack.copyRect(INT_MAX, 0, 1, 1, 0, 0); });
+rangeError(function () { stack.copyRect(0, INT_MAX, 1, 1, 0, 0); });
+rangeError(function () { stack.copyRect(0, 0, 1, 1, INT_MAX, 0); });
+rangeError(function () { stack.copyRect(0, 0, 1, 1, 0, INT_MAX); });
+rangeError(function () { stack.copyRect(1, 0, INT_MAX, 1, 0, 0); });
+rangeError(function () { stack.copyRect(0, 0, 1, INT_MAX, 0, 0); });
+
+// plain bounds
+rangeError(function () { stack.copyRect(60, 0, 5, 1, 0, 0); });
+rangeError(function () { stack.copyRect(0, 0, 5, 1, 60, 0); });
+rangeError(function () { stack.copyRect(-1, 0, 5, 1, 0, 0); });
+rangeError(function () { stack.copyRect(0, 0, -1, 1, 0, 0); });
+stack.copyRect(0, 0, 64, 48, 0, 0);
+stack.copyRect(63, 47, 1, 1, 0, 0);
+stack.copyRect(0, 0, 0, 0, 64, 48);
+
+var dynamic = new JpegLib.DynamicJpegStack('rgb');
+dynamic.setBackground(64, 48);
+rangeError(function () { dynamic.copyRect(INT_MAX, 0, 1, 1, 0, 0); });
+rangeError(function () { dynamic.copyRect(0, 0, 1, 1, 0, INT_MAX); });
+
+// Overlapping moves in every direction must come out as if the block was
+// read before it was written. The expected canvas is pushed as pixels onto
+// a second stack, and both are encoded at the same quality.
+var W = 300, H = 200;
+
+function pattern() {
+    var buf = new Buffer(W*H*3);
+    for (var y = 0; y < H; y++) {
+        for (var x = 0; x < W; x++) {
+            var i = (y*W + x)*3;
+            buf[i] = (x*4) & 255;
+            buf[i + 1] = (y*5) & 255;
+            buf[i + 2] = (x + y*3) & 255;
+        }
+    }
+    return buf;
+}
+
+function moved(buf, sx, sy, w, h, dx, dy) {
+    var out = new Buffer(buf.length);
+    buf.copy(out);
+    for (var y = 0; y < h; y++)
+        buf.copy(out, ((dy + y)*W + dx)*3, ((sy + y)*W + sx)*3, ((sy + y)*W + sx + w)*3);
+    return out;
+}
+
+function sameJpeg(a, b, msg) {
+    assert.ok(a.length == b.length && a.toString('binary') == b.toString('binary'), msg);
+}
+
+var moves = [
+    [0, 0, 250, 200, 37, 0],   // right
+    [37, 0, 250, 200, 0, 0],   // left
+    [0, 0, 300, 150, 0, 29],   // down
+    [0, 29, 300, 150, 0, 0],   // up
+    [10, 10, 200, 150, 45, 33] // down and right, across dynamic tiles
+];
+
+moves.forEach(function (m) {
+    var src = pattern();
+    var expected = moved(src, m[0], m[1], m[2], m[3], m[4], m[5]);
+
+    var fixed = new JpegLib.FixedJpegStack(W, H, 'rgb');
+    fixed.push(src, 0, 0, W, H);
+    fixed.copyRect(m[0], m[1], m[2], m[3], m[4], m[5]);
+    var fixedRef = new JpegLib.FixedJpegStack(W, H, 'rgb');
+    fixedRef.push(expected, 0, 0, W, H);
+    sameJpeg(fixed.encodeSync(), fixedRef.encodeSync(), 'FixedJpegStack copyRect ' + m);
+
+    var dyn = new JpegLib.DynamicJpegStack('rgb');
+    dyn.setBackground(W, H);
+    dyn.push(src, 0, 0, W, H);
+    dyn.copyRect(m[0], m[1], m[2], m[3], m[4], m[5]);
+    var dynRef = new JpegLib.DynamicJpegStack('rgb');
+    dynRef.setBackground(W, H);
+    dynRef.push(expected, 0, 0, W, H);
+    sameJpeg(dyn.encodeSync(), dynRef.encodeSync(), 'DynamicJpegStack copyRect ' + m);
+});
@@ -0,0 +1,9 @@
+// Runs every test in this directory: node test/index.js
+var fs = require('fs');
+var path = require('path');
+
+fs.readdirSync(__dirname).sort().forEach(function (file) {
+    if (!/\.js$/.test(file) || file == 'index.js') return;
+    console.log(file);
+    require(path.join(__dirname, file));
+});
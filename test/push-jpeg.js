@@ -0,0 +1,62 @@
+var assert = require('assert');
+var JpegLib = require('../build/Release/jpeg');
+
+function tile(w, h, quality) {
+    var buf = new Buffer(w*h*3);
+    for (var i = 0; i < buf.length; i++) buf[i] = (i*7) & 255;
+    return new JpegLib.Jpeg(buf, w, h, quality, 'rgb').encodeSync();
+}
+
+var t16 = tile(16, 16, 80);
+
+// no background
+var stack = new JpegLib.DynamicJpegStack('rgb');
+assert.throws(function () { stack.pushJpeg(t16, 0, 0); }, /No background/);
+
+// tiles go on MCU boundaries (16 for this module's JPEGs)
+stack.setSolidBackground(255, 255, 255, 64, 64);
+assert.throws(function () { stack.pushJpeg(t16, 8, 0); }, /multiples of 16 and 16/);
+assert.throws(function () { stack.pushJpeg(t16, 0, 24); }, /multiples of 16 and 16/);
+assert.throws(function () { stack.pushJpeg(t16, -16, 0); }, RangeError);
+assert.throws(function () { stack.pushJpeg(t16, 64, 0); }, /exceeds/);
+// and are whole MCUs, except at the right and bottom edge
+assert.throws(function () { stack.pushJpeg(tile(24, 16, 80), 0, 0); }, /multiples of 16 and 16/);
+assert.throws(function () { stack.pushJpeg(new Buffer(10), 0, 0); }, Error);
+
+stack.pushJpeg(t16, 16, 32);
+stack.pushJpeg(tile(16, 16, 80), 48, 48);
+// tiles of another quality have other quantization tables
+assert.throws(function () { stack.pushJpeg(tile(16, 16, 50), 0, 0); }, /differ/);
+assert.ok(stack.encodeSync().length > 0);
+
+// pixels and JPEG tiles don't mix
+assert.throws(function () { stack.push(new Buffer(16*16*3), 0, 0, 16, 16); }, /JPEG tiles were pushed/);
+assert.throws(function () { stack.copyRect(0, 0, 16, 16, 16, 16); }, /JPEG tiles were pushed/);
+
+var pixels = new JpegLib.DynamicJpegStack('rgb');
+pixels.setBackground(64, 64);
+pixels.push(new Buffer(16*16*3), 0, 0, 16, 16);
+assert.throws(function () { pixels.pushJpeg(t16, 16, 16); }, /pixels were pushed/);
+
+// a partial tile is fine where it ends at the background's edge
+var edge = new JpegLib.DynamicJpegStack('rgb');
+edge.setSolidBackground(0, 0, 0, 40, 40);
+edge.pushJpeg(tile(8, 8, 80), 32, 32);
+edge.pushJpeg(tile(16, 8, 80), 0, 32);
+
+// not over a shared Background
+var bg = new JpegLib.Background(new Buffer(64*64*3), 64, 64, 'rgb');
+var shared = new JpegLib.DynamicJpegStack('rgb');
+shared.setBackground(bg);
+assert.throws(function () { shared.pushJpeg(t16, 0, 0); }, /Background/);
+
+// nor while an encode reads the canvas
+var busy = new JpegLib.DynamicJpegStack('rgb');
+busy.setSolidBackground(0, 0, 0, 32, 32);
+busy.pushJpeg(t16, 0, 0);
+busy.encode(function (jpeg, dims, error) {
+    assert.ok(!error);
+    // the encode still counts as running until its callback returns
+    setImmediate(function () { busy.pushJpeg(t16, 16, 16); });
+});
+assert.throws(function () { busy.pushJpeg(t16, 16, 0); }, /encode is running/);
@@ -0,0 +1,71 @@
+var assert = require('assert');
+var fs = require('fs');
+var os = require('os');
+var path = require('path');
+var JpegLib = require('../build/Release/jpeg');
+
+// a file mapped by fd stands in for the writer's shared memory: a 4 byte
+// seqlock counter followed by a 512x512 RGB frame
+var W = 512, H = 512;
+var file = path.join(os.tmpdir(), 'node-jpeg-test-' + process.pid + '.shm');
+var fd = fs.openSync(file, 'w+');
+fs.unlinkSync(file);
+
+var frame = new Buffer(4 + W*H*3);
+for (var i = 4; i < frame.length; i++) frame[i] = (i*3) & 255;
+
+function setGeneration(gen) {
+    var counter = new Buffer(4);
+    counter.writeUInt32LE(gen, 0);
+    fs.writeSync(fd, counter, 0, 4, 0);
+}
+
+frame.writeUInt32LE(2, 0);
+fs.writeSync(fd, frame, 0, frame.length, 0);
+
+var shm = new JpegLib.SharedMemory(fd, { seqlock: 0 });
+assert.equal(shm.generation(), 2);
+
+// a settled frame encodes like the same pixels in a Buffer
+var expected = new JpegLib.Jpeg(frame.slice(4), W, H, 80, 'rgb').encodeSync();
+var jpeg = new JpegLib.Jpeg(shm, W, H, 80, 'rgb', { offset: 4 });
+assert.equal(jpeg.encodeSync().toString('binary'), expected.toString('binary'));
+
+var stack = new JpegLib.FixedJpegStack(W, H, 'rgb');
+stack.push(shm, 0, 0, W, H, { offset: 4 });
+
+// an odd counter is a frame in progress; with no writer to finish it the
+// reader gives up
+setGeneration(3);
+assert.equal(shm.generation(), 3);
+assert.throws(function () { jpeg.encodeSync(); }, /Timed out waiting/);
+assert.throws(function () { stack.push(shm, 0, 0, W, H, { offset: 4 }); }, /Timed out waiting/);
+
+// a writer that keeps publishing frames makes every read torn, and the
+// encode stops after the last retry
+var gen = 4;
+var writing = true;
+setGeneration(gen);
+function write() {
+    if (!writing) return;
+    gen += 2;
+    setGeneration(gen);
+    setImmediate(write);
+}
+setImmediate(write);
+jpeg.encode(function (image, error) {
+    writing = false;
+    assert.ok(error);
+    assert.ok(/kept changing/.test(error.message));
+
+    // once the writer is done, the same Jpeg encodes again
+    jpeg.encode(function (image, error) {
+        assert.ok(!error);
+        assert.equal(image.toString('binary'), expected.toString('binary'));
+        setImmediate(function () {
+            jpeg.dispose();
+            shm.dispose();
+            fs.closeSync(fd);
+        });
+    });
+});
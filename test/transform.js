@@ -0,0 +1,70 @@
+var assert = require('assert');
+var JpegLib = require('../build/Release/jpeg');
+
+var INT_MAX = 0x7fffffff;
+
+function image(w, h) {
+    var buf = new Buffer(w*h*3);
+    for (var i = 0; i < buf.length; i++) buf[i] = (i*13) & 255;
+    return new JpegLib.Jpeg(buf, w, h, 85, 'rgb').encodeSync();
+}
+
+// width and height from the SOF marker
+function size(jpeg) {
+    var i = 2;
+    while (i < jpeg.length) {
+        var marker = jpeg[i + 1];
+        if (marker >= 0xc0 && marker <= 0xc2)
+            return { width: jpeg.readUInt16BE(i + 7), height: jpeg.readUInt16BE(i + 5) };
+        i += 2 + jpeg.readUInt16BE(i + 2);
+    }
+    assert.fail('no SOF marker');
+}
+
+var src = image(64, 48);
+
+assert.deepEqual(size(JpegLib.transformSync(src, { rotate: 90 })), { width: 48, height: 64 });
+assert.deepEqual(size(JpegLib.transformSync(src, { rotate: 180 })), { width: 64, height: 48 });
+assert.deepEqual(size(JpegLib.transformSync(src, { rotate: 270 })), { width: 48, height: 64 });
+assert.deepEqual(size(JpegLib.transformSync(src, { flip: 'vertical' })), { width: 64, height: 48 });
+assert.deepEqual(size(JpegLib.transformSync(src, {
+    crop: { x: 16, y: 16, width: 32, height: 32 } })), { width: 32, height: 32 });
+// the crop is in the rotated image's coordinates
+assert.deepEqual(size(JpegLib.transformSync(src, {
+    rotate: 90, crop: { x: 16, y: 0, width: 32, height: 64 } })), { width: 32, height: 64 });
+
+// partial MCUs on an edge that moves are trimmed
+var odd = image(70, 50);
+assert.deepEqual(size(JpegLib.transformSync(odd, { flip: 'horizontal' })), { width: 64, height: 50 });
+assert.deepEqual(size(JpegLib.transformSync(odd, { flip: 'vertical' })), { width: 70, height: 48 });
+assert.deepEqual(size(JpegLib.transformSync(odd, { rotate: 90 })), { width: 48, height: 70 });
+
+// crop validation
+function cropError(crop, re) {
+    assert.throws(function () { JpegLib.transformSync(src, { crop: crop }); }, re);
+}
+cropError({ x: 8, y: 0, width: 16, height: 16 }, /multiples of 16 and 16/);
+cropError({ x: 0, y: 8, width: 16, height: 16 }, /multiples of 16 and 16/);
+cropError({ x: 48, y: 0, width: 32, height: 16 }, /outside/);
+cropError({ x: 0, y: 0, width: 0, height: 16 }, /outside/);
+cropError({ x: 0, y: 0, width: 65, height: 16 }, /outside/);
+// x + width used to wrap past INT_MAX
+cropError({ x: INT_MAX - 15, y: 0, width: 32, height: 16 }, /outside/);
+cropError({ x: 16, y: 0, width: INT_MAX, height: 16 }, /outside/);
+cropError({ x: 0, y: 16, width: 16, height: INT_MAX }, /outside/);
+cropError({ x: -16, y: 0, width: 16, height: 16 }, TypeError);
+cropError({ x: 0, y: 0, width: 16 }, TypeError);
+
+assert.throws(function () { JpegLib.transformSync(src, { rotate: 45 }); }, TypeError);
+assert.throws(function () { JpegLib.transformSync(src, { rotate: 90, flip: 'vertical' }); }, TypeError);
+assert.throws(function () { JpegLib.transformSync(new Buffer(10), { rotate: 90 }); }, Error);
+
+JpegLib.transform(src, { rotate: 90 }, function (rotated, dims, error) {
+    assert.ok(!error);
+    assert.deepEqual(dims, { width: 48, height: 64 });
+    assert.deepEqual(size(rotated), dims);
+});
+JpegLib.transform(src, { crop: { x: 0, y: 32, width: 64, height: 32 } }, function (rotated, dims, error) {
+    assert.ok(error);
+    assert.ok(/outside/.test(error.message));
+});